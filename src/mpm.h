@@ -59,7 +59,7 @@ typedef struct mpm_re_internal mpm_re;
 #define MPM_EMPTY_PATTERN               5
 /*! Invalid or unsupported arguments. */
 #define MPM_INVALID_ARGS                6
-/*! Cannot add more regular expressions (max 32). */
+/*! Cannot add more regular expressions (max 1024). */
 #define MPM_PATTERN_LIMIT               7
 /*! Pattern is not suitable for a DFA based engine. */
 #define MPM_TOO_LOW_RATING              8
@@ -71,6 +71,12 @@ typedef struct mpm_re_internal mpm_re;
 #define MPM_STATE_MACHINE_LIMIT         11
 /*! No such pattern (invalid index argument). */
 #define MPM_NO_SUCH_PATTERN             12
+/*! Number of allowed terms is reached (see MPM_COMPILE_BIT_PARALLEL). */
+#define MPM_TERM_LIMIT                  13
+/*! File cannot be opened, read or written (see mpm_save). */
+#define MPM_FILE_ERROR                  14
+/*! File is not a valid database (see mpm_load). */
+#define MPM_INVALID_FILE                15
 
 char *mpm_error_to_string(int error_code);
 
@@ -121,7 +127,9 @@ void mpm_free(mpm_re *re);
 int mpm_add(mpm_re *re, mpm_char8 *pattern, mpm_uint32 flags);
 
 /*! \fn int mpm_add(mpm_re *re, mpm_char8 *pattern, mpm_uint32 flags)
- *  \brief Adds a new pattern to the set of regular expressions. The maximum number of patterns is 32.
+ *  \brief Adds a new pattern to the set of regular expressions. The maximum number of patterns is 1024.
+ *         The library has no modifiable global state, so different sets can be
+ *         created and compiled by multiple threads at the same time.
  *  \param re set of regular expressions created by mpm_create.
  *  \param pattern a new pattern.
  *  \param flags flags started by MPM_ADD_ prefix.
@@ -138,11 +146,49 @@ int mpm_add(mpm_re *re, mpm_char8 *pattern, mpm_uint32 flags);
   /*  This flag is ignored if MPM_VERBOSE is undefined. */
   /*! Display some statistics (e.g: memory consumption) about the compiled pattern. */
 #define MPM_COMPILE_VERBOSE_STATS       0x004
+  /*! The states are built on demand by the matching functions into a bounded
+      cache, so there is no limit for the number of states. The cache is
+      flushed when it is full. A lazy re is modified by the matching, so
+      it must not be used by multiple threads at the same time. The maximum
+      number of patterns is 32, otherwise MPM_PATTERN_LIMIT is returned. Stream
+      matching is not supported, and the functions which match multiple
+      state machines (e.g. mpm_exec4) match a lazy re separately. */
+#define MPM_COMPILE_LAZY                0x008
+  /*! The patterns are matched by a bit parallel simulation of their terms
+      instead of a DFA, so patterns with a low rating (see MPM_ADD_TEST_RATING)
+      can be matched in constant time per character without state blowup.
+      The maximum number of terms is 128, otherwise MPM_TERM_LIMIT is returned.
+      The maximum number of patterns is 32, otherwise MPM_PATTERN_LIMIT is returned.
+      Stream matching is not supported, and the functions which match multiple
+      state machines (e.g. mpm_exec4) match a bit parallel re separately. */
+#define MPM_COMPILE_BIT_PARALLEL        0x010
+  /*! Equivalent states are merged after the state machine is constructed,
+      which reduces the size of the state machine. The number of states
+      is still limited during the construction. */
+#define MPM_COMPILE_MINIMIZE            0x020
+  /*! Each state only stores the transitions which differ from the transitions
+      of a similar (default) state, and the states with a few distinct next
+      states are packed, which usually reduces the size of the state machine.
+      At most four default transitions are followed for a character, so the
+      matching speed is still bounded. The maximum number of patterns is
+      32, otherwise MPM_PATTERN_LIMIT is returned. Stream matching is not
+      supported, and the functions which match multiple state machines (e.g.
+      mpm_exec4) match these state machines separately. */
+#define MPM_COMPILE_DEFAULT_TRANSITIONS 0x040
+  /*! The transitions of the states are computed by n (1 - 255) threads.
+      The result is the same as the single threaded version, including
+      the numbering of the states. */
+#define MPM_COMPILE_THREADS(n)          (((n) & 0xff) << 8)
 
 int mpm_compile(mpm_re *re, mpm_size *consumed_memory, mpm_uint32 flags);
 
 /*! \fn int mpm_compile(mpm_re *re, mpm_uint32 flags)
  *  \brief Compiles the pattern set into a single DFA representation.
+ *         The narrowest (8, 16 or 32 bit) relative offsets are selected, which
+ *         can represent all state transitions. The selected size is printed
+ *         by MPM_COMPILE_VERBOSE_STATS. When the set has more than 32 patterns,
+ *         the states refer to shared end state sets, and the state machine
+ *         can only be matched by mpm_exec and mpm_exec_callback.
  *  \param re set of regular expressions created by mpm_create.
  *  \param consumed_memory if this argument is non-NULL, it contains the memory
  *                         consumption of the machine when MPM_NO_ERROR is returned.
@@ -151,6 +197,26 @@ int mpm_compile(mpm_re *re, mpm_size *consumed_memory, mpm_uint32 flags);
  *  \return MPM_NO_ERROR on success.
  */
 
+int mpm_compile_cached(mpm_re **re, mpm_size *consumed_memory, mpm_uint32 flags, char *cache_directory);
+
+/*! \fn int mpm_compile_cached(mpm_re **re, mpm_size *consumed_memory, mpm_uint32 flags, char *cache_directory)
+ *  \brief Same as mpm_compile, except that the compiled state machine is
+ *         stored in the cache directory, and it is loaded from there (see mpm_load)
+ *         when the same patterns are compiled again with the same flags. The
+ *         entries are named after a 64 bit hash of the patterns and flags, and
+ *         they can be shared by multiple processes. The patterns and flags are
+ *         also stored in the entries and compared before an entry is loaded,
+ *         so hash collisions are detected. Unused entries are never removed,
+ *         and the directory can be cleared at any time.
+ *  \param re *re is a set of regular expressions created by mpm_create. It is
+ *            replaced by the loaded state machine (and the original is freed),
+ *            if the state machine is found in the cache.
+ *  \param consumed_memory see mpm_compile.
+ *  \param flags see mpm_compile. MPM_COMPILE_LAZY disables the cache.
+ *  \param cache_directory an existing directory, or NULL to disable the cache.
+ *  \return MPM_NO_ERROR on success.
+ */
+
 /* Execute the pattern. */
 
 int mpm_exec(mpm_re *re, mpm_char8 *subject, mpm_size length, mpm_size offset, mpm_uint32 *result);
@@ -161,10 +227,12 @@ int mpm_exec(mpm_re *re, mpm_char8 *subject, mpm_size length, mpm_size offset, m
  *  \param subject points to the start of the subject buffer.
  *  \param length length of the subject buffer.
  *  \param offset starting position of the matching inside the subject buffer.
- *  \param result points to a 32 bit long buffer where the result of the match
- *         is stored. The first bit of the buffer represents the first pattern
- *         added by mpm_add, and it is set, if that pattern matches. It is cleared
- *         otherwise. The second bit represents the second pattern, and so on.
+ *  \param result points to a buffer of (number of patterns + 31) / 32, 32 bit
+ *         long words where the result of the match is stored. The first bit of
+ *         the buffer represents the first pattern added by mpm_add, and it is set,
+ *         if that pattern matches. It is cleared otherwise. The second bit represents
+ *         the second pattern, and so on. The 33th pattern is represented by the
+ *         first bit of the second word.
  *  \return MPM_NO_ERROR on success.
  */
 
@@ -180,6 +248,160 @@ int mpm_exec4(mpm_re **re, mpm_char8 *subject, mpm_size length, mpm_size offset,
  *                are described in mpm_exec. The first buffer belongs to re[0],
  *                the second to re[1], and so on.
  *  \return MPM_NO_ERROR on success.
+ *  \note The state machines are only interleaved, if they use the same offset
+ *        size (see mpm_compile). Otherwise they are matched one by one. State
+ *        machines with more than 32 patterns are not supported (MPM_INVALID_ARGS).
+ */
+
+int mpm_exec8(mpm_re **re, mpm_char8 *subject, mpm_size length, mpm_size offset, mpm_uint32 *results);
+
+/*! \fn int mpm_exec8(mpm_re **re, mpm_char8 *subject, mpm_size length, mpm_size offset, mpm_uint32 *results)
+ *  \brief Matches eight compiled regular expressions to the same subject string (see mpm_exec4).
+ *  \param re eight sets of regular expressions compiled by mpm_compile.
+ *  \param subject points to the start of the subject buffer.
+ *  \param length length of the subject buffer.
+ *  \param offset starting position of the matching inside the subject buffer.
+ *  \param result points to eight, 32 bit long buffer. The first buffer belongs
+ *                to re[0], the second to re[1], and so on.
+ *  \return MPM_NO_ERROR on success.
+ */
+
+int mpm_execN(mpm_re **re, mpm_size count, mpm_char8 *subject, mpm_size length, mpm_size offset, mpm_uint32 *results);
+
+/*! \fn int mpm_execN(mpm_re **re, mpm_size count, mpm_char8 *subject, mpm_size length, mpm_size offset, mpm_uint32 *results)
+ *  \brief Matches any number of compiled regular expressions to the same subject
+ *         string. The widest matcher (mpm_exec8, mpm_exec4 or mpm_exec) is selected
+ *         for the remaining regular expressions.
+ *  \param re count sets of regular expressions compiled by mpm_compile.
+ *  \param count number of regular expressions.
+ *  \param subject points to the start of the subject buffer.
+ *  \param length length of the subject buffer.
+ *  \param offset starting position of the matching inside the subject buffer.
+ *  \param result points to count, 32 bit long buffer. The first buffer belongs
+ *                to re[0], the second to re[1], and so on.
+ *  \return MPM_NO_ERROR on success.
+ */
+
+int mpm_exec_batch(mpm_re *re, mpm_char8 **subjects, mpm_size *lengths, mpm_size count, mpm_uint32 *results);
+
+/*! \fn int mpm_exec_batch(mpm_re *re, mpm_char8 **subjects, mpm_size *lengths, mpm_size count, mpm_uint32 *results)
+ *  \brief Matches the compiled regular expression to multiple subject strings.
+ *         The subjects are processed in parallel, which is faster than calling
+ *         mpm_exec for each subject when the subjects are short. State machines
+ *         with more than 32 patterns are not supported (MPM_INVALID_ARGS).
+ *  \param re a set of regular expressions compiled by mpm_compile.
+ *  \param subjects points to the start of count subject buffers.
+ *  \param lengths lengths of the subject buffers.
+ *  \param count number of subject buffers.
+ *  \param result points to count, 32 bit long buffer. The purpose of these buffers
+ *                are described in mpm_exec. The first buffer belongs to subjects[0],
+ *                the second to subjects[1], and so on.
+ *  \return MPM_NO_ERROR on success.
+ */
+
+/*! Callback function type of mpm_exec_callback. The pattern_id is the index
+    of the matching pattern (the first pattern added by mpm_add has index 0),
+    and end_offset is the offset of the character after the last character
+    of the match (measured from the start of the subject buffer). The matching
+    is stopped if the callback returns with a non-zero value. */
+typedef int (*mpm_match_callback)(mpm_uint32 pattern_id, mpm_size end_offset, void *user_data);
+
+/*! Report only the first match of each pattern (see mpm_exec_callback). */
+#define MPM_EXEC_CALLBACK_FIRST         0x001
+
+int mpm_exec_callback(mpm_re *re, mpm_char8 *subject, mpm_size length, mpm_size offset,
+    mpm_match_callback callback, void *user_data, mpm_uint32 flags);
+
+/*! \fn int mpm_exec_callback(mpm_re *re, mpm_char8 *subject, mpm_size length, mpm_size offset, mpm_match_callback callback, void *user_data, mpm_uint32 flags)
+ *  \brief Matches the compiled regular expression to the subject string, and calls
+ *         the callback function for each match with the end position of the match.
+ *         This function is slower than mpm_exec, so it should only be used when
+ *         the position of the match is needed.
+ *  \param re set of regular expressions compiled by mpm_compile.
+ *  \param subject points to the start of the subject buffer.
+ *  \param length length of the subject buffer.
+ *  \param offset starting position of the matching inside the subject buffer.
+ *  \param callback called for each match.
+ *  \param user_data passed to the callback function.
+ *  \param flags flags started by MPM_EXEC_CALLBACK_ prefix.
+ *  \return MPM_NO_ERROR on success (including when the matching is stopped by the callback).
+ */
+
+/* Stream matching. */
+
+/*! Structure used by the mpm_stream_ functions. Allocated by the caller,
+    and its members must not be modified between mpm_stream_begin and mpm_stream_end. */
+typedef struct mpm_stream {
+    mpm_uint32 state_offset; /*!< Private member: offset of the current state. */
+    mpm_uint32 result;       /*!< Private member: end states reached so far. */
+} mpm_stream;
+
+int mpm_stream_begin(mpm_re *re, mpm_stream *stream);
+
+/*! \fn int mpm_stream_begin(mpm_re *re, mpm_stream *stream)
+ *  \brief Starts matching a subject which is split into multiple segments.
+ *         The first segment is matched from the start of the subject
+ *         (same as mpm_exec with zero offset). State machines with more
+ *         than 32 patterns are not supported (MPM_INVALID_ARGS).
+ *  \param re set of regular expressions compiled by mpm_compile.
+ *  \param stream a caller allocated structure, which is initialized by this function.
+ *  \return MPM_NO_ERROR on success.
+ */
+
+int mpm_stream_feed(mpm_re *re, mpm_stream *stream, mpm_char8 *subject, mpm_size length);
+
+/*! \fn int mpm_stream_feed(mpm_re *re, mpm_stream *stream, mpm_char8 *subject, mpm_size length)
+ *  \brief Matches the next segment of the subject. Patterns spanning across
+ *         segment boundaries are found as well, and the segments are not copied.
+ *  \param re the same set of regular expressions passed to mpm_stream_begin.
+ *  \param stream a structure initialized by mpm_stream_begin.
+ *  \param subject points to the start of the segment.
+ *  \param length length of the segment (can be 0).
+ *  \return MPM_NO_ERROR on success.
+ */
+
+int mpm_stream_end(mpm_re *re, mpm_stream *stream, mpm_uint32 *result);
+
+/*! \fn int mpm_stream_end(mpm_re *re, mpm_stream *stream, mpm_uint32 *result)
+ *  \brief Finishes the matching of a segmented subject. The stream
+ *         can be reused after mpm_stream_begin is called again.
+ *  \param re the same set of regular expressions passed to mpm_stream_begin.
+ *  \param stream a structure initialized by mpm_stream_begin.
+ *  \param result points to a 32 bit long buffer where the result of the match
+ *         is stored. Its format is the same as the result of mpm_exec.
+ *  \return MPM_NO_ERROR on success.
+ */
+
+/* Saving and loading compiled state machines. */
+
+int mpm_save(mpm_re *re, char *file_name);
+
+/*! \fn int mpm_save(mpm_re *re, char *file_name)
+ *  \brief Saves the compiled regular expression into a file, which can be
+ *         loaded by mpm_load. The file can only be loaded on machines with
+ *         the same byte order and word size, by the same version of the library.
+ *  \param re set of regular expressions compiled by mpm_compile (state machines
+ *            compiled with MPM_COMPILE_LAZY are not supported).
+ *  \param file_name name of the file. An existing file is replaced only when
+ *                   the new file is completely written, so processes which
+ *                   loaded the old file are not affected.
+ *  \return MPM_NO_ERROR on success.
+ */
+
+int mpm_load(mpm_re **re, char *file_name);
+
+/*! \fn int mpm_load(mpm_re **re, char *file_name)
+ *  \brief Loads a regular expression saved by mpm_save. The file is mapped
+ *         read-only into the memory and the state machine is used in place,
+ *         so loading is fast and the pages are shared by all processes which
+ *         load the same file. The file must not be modified in place while it is
+ *         loaded (mpm_save replaces the file instead of modifying it).
+ *  \param re *re is set to the loaded regular expression when MPM_NO_ERROR is
+ *            returned. It can be passed to mpm_exec and all other matching
+ *            functions, and must be freed by mpm_free.
+ *  \param file_name name of the file.
+ *  \return MPM_NO_ERROR on success, MPM_INVALID_FILE if the file is damaged
+ *          or it is saved by another version or machine type.
  */
 
 /* Utility functions. */
@@ -188,7 +410,7 @@ mpm_re * mpm_dummy_re(void);
 
 /* ! \fn mpm_re * mpm_dummy_re(void)
  *  \brief Returns a dummy regular expression, which never matches anything.
- *         Can be passed as a valid re for mpm_exec or mpm_exec4.
+ *         Can be passed as a valid re for mpm_exec, mpm_exec4 or mpm_exec8.
  */
 
 /*! Copy source instead of merge it. The source will not be deleted. */
@@ -255,11 +477,20 @@ typedef struct mpm_cluster_item {
   /*  This flag is ignored if MPM_VERBOSE is undefined. */
   /*! Verbose the operations of mpm_clustering. */
 #define MPM_CLUSTERING_VERBOSE          0x001
+  /*! The exact distance of two repeating patterns is only computed when
+      they share a bucket of their MinHash signatures (locality sensitive
+      hashing). Otherwise the patterns are treated as completely different. */
+#define MPM_CLUSTERING_LSH              0x002
+  /*! The distance matrix is computed by n (1 - 255) threads. The
+      result does not depend on the number of threads. */
+#define MPM_CLUSTERING_THREADS(n)       (((n) & 0xff) << 8)
 
 int mpm_clustering(mpm_cluster_item *items, mpm_size no_items, mpm_uint32 flags);
 
 /*! \fn int mpm_clustering(mpm_cluster_item *items, mpm_size no_items, mpm_uint32 flags)
- *  \brief Groups similar patterns into one set.
+ *  \brief Groups similar patterns into one set. Large item lists are
+ *         partitioned into smaller parts first, so the memory consumption
+ *         is bounded regardless of the number of items.
  *  \param items list of patterns. Items are fully reordered if the function is successful,
  *               so this is an output argument as well.
  *  \param no_items length of the items argument.
@@ -278,7 +509,9 @@ typedef struct mpm_rule_pattern {
     mpm_uint32 flags;      /*!< Any combination of MPM_ADD_ and MPM_RULE_ flags. */
 } mpm_rule_pattern;
 
-/*! Structure used only by mpm_create_rule_set. */
+/*! Structure used by mpm_compile_rules and mpm_rule_list_update. It must be
+    initialized by mpm_compile_rules_args_init before its members are set, so
+    the members added by later versions of the library get default values. */
 typedef struct mpm_compile_rules_args {
     mpm_uint32 no_selected_patterns;
     mpm_uint32 minimum_no_new_cover;
@@ -286,8 +519,22 @@ typedef struct mpm_compile_rules_args {
     float inner_distance_scale;
     float outer_distance_scale;
     float length_scale;
+    /*! Number of worker threads used for clustering and compiling the state
+        machines. Values less than 2 disable the worker threads. */
+    mpm_uint32 no_threads;
+    /*! Directory of the compile cache (see mpm_compile_cached), or NULL
+        if the cache is disabled. */
+    char *cache_directory;
 } mpm_compile_rules_args;
 
+void mpm_compile_rules_args_init(mpm_compile_rules_args *args);
+
+/*! \fn void mpm_compile_rules_args_init(mpm_compile_rules_args *args)
+ *  \brief Sets all members of args to their default values. These are the
+ *         same options which are used when NULL is passed to mpm_compile_rules.
+ *  \param args the structure to be initialized.
+ */
+
   /*! Ignore fixed patterns from the rule list. */
 #define MPM_COMPILE_RULES_IGNORE_FIXED  0x001
   /*! Ignore regular expression (non-fixed) patterns from the rule list. */
@@ -298,6 +545,17 @@ typedef struct mpm_compile_rules_args {
   /*  This flag is ignored if MPM_VERBOSE is undefined. */
   /*! Display some statistics (e.g: memory consumption) about the compiled patterns. */
 #define MPM_COMPILE_RULES_VERBOSE_STATS 0x008
+  /*! Patterns and sub-patterns, which are not suitable for a DFA based engine
+      (see MPM_ADD_TEST_RATING), are matched by bit parallel state machines
+      (see MPM_COMPILE_BIT_PARALLEL) instead of being ignored. */
+#define MPM_COMPILE_RULES_BIT_PARALLEL  0x010
+  /*! The state machines with at most 32 patterns are compiled with default
+      transitions (see MPM_COMPILE_DEFAULT_TRANSITIONS). */
+#define MPM_COMPILE_RULES_DEFAULT_TRANSITIONS 0x020
+  /*! The rule set keeps uncompiled copies of its patterns, which are
+      needed by mpm_rule_list_update. The copies are included in the
+      consumed memory. */
+#define MPM_COMPILE_RULES_UPDATABLE     0x040
 
 /*! Private representation of a regular expression set. */
 struct mpm_rule_list_internal;
@@ -327,6 +585,36 @@ void mpm_rule_list_free(mpm_rule_list *rule_list);
  *  \param rule_list a list returned by mpm_compile_rules
  */
 
+int mpm_rule_list_update(mpm_rule_list *rule_list, mpm_rule_list **result_rule_list,
+    mpm_rule_pattern *added, mpm_size no_added, mpm_uint32 *removed, mpm_size no_removed,
+    mpm_compile_rules_args *args, mpm_uint32 flags);
+
+/*! \fn int mpm_rule_list_update(mpm_rule_list *rule_list, mpm_rule_list **result_rule_list, mpm_rule_pattern *added, mpm_size no_added, mpm_uint32 *removed, mpm_size no_removed, mpm_compile_rules_args *args, mpm_uint32 flags)
+ *  \brief Creates a new rule set from an existing one by removing and adding
+ *         rules. The state machines, which contain a pattern whose rules are
+ *         all removed, are rebuilt from their remaining patterns. These
+ *         patterns and the patterns of the added rules are grouped by
+ *         mpm_clustering and compiled into new state machines. The other
+ *         state machines are shared with the existing rule set, which stays
+ *         valid and must still be freed by mpm_rule_list_free. The rules of
+ *         the new set are numbered as if the remaining rules were followed by
+ *         the added rules.
+ *  \param rule_list a list returned by mpm_compile_rules with the
+ *                   MPM_COMPILE_RULES_UPDATABLE flag or by mpm_rule_list_update
+ *                   (loaded or attached lists are not supported).
+ *  \param result_rule_list output argument, which contains the new rule set,
+ *                          which can be updated again.
+ *  \param added rules added to the set (same format as the rules of mpm_compile_rules).
+ *  \param no_added length of the added argument (can be 0).
+ *  \param removed indices of the rules removed from the set.
+ *  \param no_removed length of the removed argument (can be 0).
+ *  \param args see mpm_compile_rules.
+ *  \param flags see mpm_compile_rules (MPM_COMPILE_RULES_UPDATABLE is implied).
+ *  \return MPM_NO_ERROR on success, MPM_INVALID_ARGS if rule_list cannot be updated.
+ *  \note The patterns are selected from the added rules only, so the set
+ *        should be recompiled by mpm_compile_rules after many updates.
+ */
+
 int mpm_exec_list(mpm_rule_list *rule_list, mpm_char8 *subject, mpm_size length, mpm_size offset, mpm_uint32 *result);
 
 /*! \fn int mpm_exec_list(mpm_rule_list *rule_list, mpm_char8 *subject, mpm_size length, mpm_size offset, mpm_uint32 *result);
@@ -342,4 +630,75 @@ int mpm_exec_list(mpm_rule_list *rule_list, mpm_char8 *subject, mpm_size length,
  *  \return MPM_NO_ERROR on success.
  */
 
+int mpm_rule_list_save(mpm_rule_list *rule_list, char *file_name);
+
+/*! \fn int mpm_rule_list_save(mpm_rule_list *rule_list, char *file_name)
+ *  \brief Saves the compiled rule set into a file (see mpm_save).
+ *  \param rule_list a list returned by mpm_compile_rules
+ *  \param file_name name of the file, which is replaced like in mpm_save.
+ *  \return MPM_NO_ERROR on success.
+ */
+
+int mpm_rule_list_load(mpm_rule_list **rule_list, char *file_name);
+
+/*! \fn int mpm_rule_list_load(mpm_rule_list **rule_list, char *file_name)
+ *  \brief Loads a rule set saved by mpm_rule_list_save. The file is mapped
+ *         read-only into the memory (see mpm_load).
+ *  \param rule_list *rule_list is set to the loaded rule set when MPM_NO_ERROR is
+ *                   returned. It must be freed by mpm_rule_list_free.
+ *  \param file_name name of the file.
+ *  \return MPM_NO_ERROR on success.
+ */
+
+/* Sharing compiled rule lists between processes. */
+
+int mpm_rule_list_publish(mpm_rule_list *rule_list, char *name);
+
+/*! \fn int mpm_rule_list_publish(mpm_rule_list *rule_list, char *name)
+ *  \brief Copies the compiled rule set into a new POSIX shared memory segment,
+ *         and publishes it as the next generation of the name. Processes can
+ *         attach the latest generation by mpm_rule_list_attach, and the
+ *         processes which attached a previous generation can keep using it
+ *         until they free it. Several processes may publish the same name at
+ *         the same time: each list gets its own generation, and the highest
+ *         one is kept.
+ *  \param rule_list a list returned by mpm_compile_rules
+ *  \param name name of the shared rule list, which must start with a slash,
+ *              and must not contain other slashes (see shm_open).
+ *  \return MPM_NO_ERROR on success.
+ */
+
+int mpm_rule_list_attach(mpm_rule_list **rule_list, char *name);
+
+/*! \fn int mpm_rule_list_attach(mpm_rule_list **rule_list, char *name)
+ *  \brief Maps the latest generation of a rule set published by
+ *         mpm_rule_list_publish read-only into the memory. The compiled
+ *         data is not copied, so all processes share the same pages.
+ *  \param rule_list *rule_list is set to the attached rule set when MPM_NO_ERROR is
+ *                   returned. It must be freed by mpm_rule_list_free.
+ *  \param name name passed to mpm_rule_list_publish.
+ *  \return MPM_NO_ERROR on success, MPM_FILE_ERROR if nothing is published.
+ */
+
+int mpm_rule_list_outdated(mpm_rule_list *rule_list);
+
+/*! \fn int mpm_rule_list_outdated(mpm_rule_list *rule_list)
+ *  \brief Checks whether a newer generation is published since the rule list
+ *         is attached. This check is fast, so it can be called before each
+ *         matching, and the new generation can be attached when it returns
+ *         non-zero.
+ *  \param rule_list a list returned by mpm_rule_list_attach (always returns
+ *                   zero for other lists).
+ *  \return non-zero if the rule list is outdated, zero otherwise.
+ */
+
+int mpm_rule_list_unpublish(char *name);
+
+/*! \fn int mpm_rule_list_unpublish(char *name)
+ *  \brief Removes the shared memory segments of the name. Attached rule
+ *         lists are not affected, but no more lists can be attached.
+ *  \param name name passed to mpm_rule_list_publish.
+ *  \return MPM_NO_ERROR on success.
+ */
+
 #endif // mpm_h
@@ -0,0 +1,153 @@
+/* Copyright (C) 2012 Open Information Security Foundation
+ *
+ * You can copy, redistribute or modify this Program under the terms of
+ * the GNU General Public License version 2 as published by the Free
+ * Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/**
+ * \file
+ *
+ * \author Zoltan Herczeg <zherczeg@inf.u-szeged.hu>
+ */
+
+#include "mpm_internal.h"
+
+/* ----------------------------------------------------------------------- */
+/*                         Bit parallel simulation.                        */
+/* ----------------------------------------------------------------------- */
+
+/* The terms of the patterns are the positions of a Glushkov automaton,
+   and a set of active terms is stored in a bit set. A matching step is:
+
+     matching terms = active terms & terms of the character class
+     active terms = non-newline start terms | followers of the matching terms
+
+   The followers are computed by looking up each 8 bit chunk of the
+   matching terms in a table, so a step takes constant time regardless
+   of the number of states of the equivalent DFA. */
+
+int mpm_private_compile_bit_parallel(mpm_re *re, mpm_size *consumed_memory, mpm_uint32 flags)
+{
+    mpm_bit_parallel *bit_parallel;
+    mpm_uint32 **term_map;
+    mpm_uint32 *word_code;
+    mpm_uint32 *class_terms;
+    mpm_uint32 *follow, *record;
+    mpm_uint32 no_terms = re->compile.next_term_index;
+    mpm_uint32 no_patterns = re->compile.next_id;
+    mpm_uint32 term_set_length, record_length, chunk_count, class_count;
+    mpm_uint32 i, j, term, chunk;
+    mpm_size size;
+
+    if (no_terms > BIT_PARALLEL_TERM_LIMIT)
+        return MPM_TERM_LIMIT;
+
+    /* The end states must fit into a single word. */
+    if (no_patterns > NARROW_PATTERN_LIMIT)
+        return MPM_PATTERN_LIMIT;
+
+    term_map = (mpm_uint32 **)malloc((no_terms > 0 ? no_terms : 1) * sizeof(mpm_uint32 *));
+    if (!term_map)
+        return MPM_NO_MEMORY;
+
+    term_set_length = (no_terms + 31) >> 5;
+    if (term_set_length == 0)
+        term_set_length = 1;
+    chunk_count = (no_terms + 7) >> 3;
+    if (chunk_count == 0)
+        chunk_count = 1;
+    /* The followers are followed by the reached end states. */
+    record_length = term_set_length + 1;
+
+    size = sizeof(mpm_bit_parallel) + chunk_count * 256 * record_length * sizeof(mpm_uint32)
+        + 256 * term_set_length * sizeof(mpm_uint32);
+    bit_parallel = (mpm_bit_parallel *)malloc(size);
+    if (!bit_parallel) {
+        free(term_map);
+        return MPM_NO_MEMORY;
+    }
+    memset(bit_parallel, 0, size);
+
+    bit_parallel->follow = (mpm_uint32 *)(bit_parallel + 1);
+    bit_parallel->term_set_length = term_set_length;
+    bit_parallel->chunk_count = chunk_count;
+    bit_parallel->all_end_states = (no_patterns >= 32) ? 0xffffffff : (((mpm_uint32)1 << no_patterns) - 1);
+
+    if (mpm_private_start_terms(re->compile.patterns, bit_parallel->start_sets + START_AT_BEGIN * BIT_PARALLEL_MAX_WORDS,
+            term_map, START_AT_BEGIN) != MPM_NO_ERROR) {
+        free(bit_parallel);
+        free(term_map);
+        return MPM_INTERNAL_ERROR;
+    }
+    mpm_private_start_terms(re->compile.patterns, bit_parallel->start_sets + START_AFTER_NON_NEWLINE * BIT_PARALLEL_MAX_WORDS,
+        NULL, START_AFTER_NON_NEWLINE);
+    mpm_private_start_terms(re->compile.patterns, bit_parallel->start_sets + START_AFTER_NEWLINE * BIT_PARALLEL_MAX_WORDS,
+        NULL, START_AFTER_NEWLINE);
+
+    /* Terms of each character class. */
+    class_count = mpm_private_char_classes(term_map, term_map + no_terms, bit_parallel->char_class);
+    class_terms = bit_parallel->follow + chunk_count * 256 * record_length;
+    bit_parallel->class_terms = class_terms;
+    for (i = 0; i < 256; i++) {
+        record = class_terms + bit_parallel->char_class[i] * term_set_length;
+        for (term = 0; term < no_terms; term++)
+            if (CHARSET_GETBIT(term_map[term], i))
+                DFA_SETBIT(record, term);
+    }
+
+    /* The followers of each single term are stored first (power of two
+       indices), and the other entries are computed from them. */
+    follow = bit_parallel->follow;
+    for (term = 0; term < no_terms; term++) {
+        record = follow + (((term >> 3) << 8) + (1 << (term & 0x7))) * record_length;
+        word_code = term_map[term] + CHAR_SET_SIZE;
+        if (word_code[0] != DFA_NO_DATA)
+            record[term_set_length] |= (mpm_uint32)1 << word_code[0];
+
+        word_code++;
+        while (word_code[0] != DFA_NO_DATA) {
+            DFA_SETBIT(record, word_code[0]);
+            word_code++;
+        }
+    }
+
+    for (chunk = 0; chunk < chunk_count; chunk++) {
+        record = follow + (chunk << 8) * record_length;
+        for (i = 3; i < 256; i++) {
+            /* The lowest bit is removed from i. */
+            if (!(i & (i - 1)))
+                continue;
+            for (j = 0; j < record_length; j++)
+                record[i * record_length + j] = record[(i & (i - 1)) * record_length + j]
+                    | record[(i & ~(i - 1)) * record_length + j];
+        }
+    }
+
+    free(term_map);
+
+#if defined MPM_VERBOSE && MPM_VERBOSE
+    if (flags & MPM_COMPILE_VERBOSE_STATS) {
+        printf("\nStatistics:\n  total patterns: %d, total terms: %d, character classes: %d\n  bit parallel tables: %d bytes\n",
+            (int)no_patterns, (int)no_terms, (int)class_count, (int)size);
+    }
+#endif
+
+    if (consumed_memory)
+        *consumed_memory = sizeof(mpm_re) + size;
+
+    mpm_private_free_patterns(re->compile.patterns);
+    re->flags = (re->flags & ~RE_MODE_COMPILE) | RE_BIT_PARALLEL;
+    re->run.bit_parallel = bit_parallel;
+    return MPM_NO_ERROR;
+}
@@ -43,7 +43,17 @@ typedef struct mpm_id_offset_map {
     mpm_uint32 offset;
 } mpm_id_offset_map;
 
-/* Items can only be added, but they never removed. */
+/* Items can only be added, but they never removed. Hence items and their
+   next state maps are allocated from large fragments, which are freed
+   together when the compilation is finished. */
+
+#define HASHMAP_FRAGMENT_SIZE (65536 - 2 * sizeof(void *))
+
+typedef struct mpm_hashmap_fragment {
+    struct mpm_hashmap_fragment *next;
+    /* Variable length member. */
+    void *data[1];
+} mpm_hashmap_fragment;
 
 typedef struct mpm_hashmap {
     /* The map is optimized for 32 bit words.
@@ -56,6 +66,10 @@ typedef struct mpm_hashmap {
     /* The mask must have the value of 2^n-1 */
     mpm_uint32 mask;
     mpm_hashitem **buckets;
+    /* Arena of the items and next state maps. */
+    mpm_hashmap_fragment *fragments;
+    mpm_uint8 *arena_next;
+    mpm_uint8 *arena_end;
     /* This term_set is added to the list by hashmap_insert. */
     mpm_uint32 *current;
 
@@ -64,6 +78,10 @@ typedef struct mpm_hashmap {
     mpm_uint32 *start;
     mpm_uint32 **term_map;
     mpm_uint32 **term_list;
+    /* Character sets and first characters of the character classes. */
+    mpm_uint32 class_count;
+    mpm_uint32 *class_chars;
+    mpm_uint8 *class_first_char;
     mpm_id_offset_map *id_offset_map;
     /* Not processed items. */
     mpm_hashitem *next_unprocessed;
@@ -81,7 +99,7 @@ static int hashmap_init(mpm_hashmap *map, mpm_uint32 term_set_length, mpm_uint32
 
     if (end_state_set_length <= 0)
         end_state_set_length = 1;
-    map->end_state_set_length = (term_set_length + 31) >> 5;
+    map->end_state_set_length = (end_state_set_length + 31) >> 5;
 
     map->record_size = (map->term_set_length + map->end_state_set_length) * sizeof(mpm_uint32);
     map->allocation_size = sizeof(mpm_hashitem) + map->record_size - sizeof(mpm_uint32);
@@ -91,10 +109,14 @@ static int hashmap_init(mpm_hashmap *map, mpm_uint32 term_set_length, mpm_uint32
     map->next_unprocessed = NULL;
 
     map->buckets = NULL;
+    map->fragments = NULL;
+    map->arena_next = NULL;
+    map->arena_end = NULL;
     map->current = NULL;
     map->start = NULL;
     map->term_map = NULL;
     map->term_list = NULL;
+    map->class_chars = NULL;
     map->id_offset_map = NULL;
 
     /* Allocating memory. */
@@ -119,34 +141,52 @@ static int hashmap_init(mpm_hashmap *map, mpm_uint32 term_set_length, mpm_uint32
 
 static void hashmap_free(mpm_hashmap *map)
 {
-    mpm_hashitem *item;
-    mpm_hashitem *next;
-    mpm_hashitem **buckets;
-    mpm_uint32 i;
+    mpm_hashmap_fragment *fragment = map->fragments;
+    mpm_hashmap_fragment *next;
 
-    if (map->buckets) {
-        buckets = map->buckets;
-        for (i = map->mask + 1; i > 0; i--) {
-            item = buckets[i - 1];
-            while (item) {
-                next = item->next;
-                if (item->next_state_map)
-                    free(item->next_state_map);
-                free(item);
-                item = next;
-            }
-        }
-        free(map->buckets);
+    while (fragment) {
+        next = fragment->next;
+        free(fragment);
+        fragment = next;
     }
 
+    if (map->buckets)
+        free(map->buckets);
+
     if (map->current)
         free(map->current);
     if (map->term_map)
         free(map->term_map);
+    if (map->class_chars)
+        free(map->class_chars);
     if (map->id_offset_map)
         free(map->id_offset_map);
 }
 
+static void * hashmap_alloc(mpm_hashmap *map, mpm_size size)
+{
+    mpm_hashmap_fragment *fragment;
+    mpm_size fragment_size;
+    void *data;
+
+    size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    if (size > (mpm_size)(map->arena_end - map->arena_next)) {
+        /* Large blocks get their own fragment. */
+        fragment_size = size > HASHMAP_FRAGMENT_SIZE ? size : HASHMAP_FRAGMENT_SIZE;
+        fragment = (mpm_hashmap_fragment *)malloc(sizeof(mpm_hashmap_fragment) - sizeof(void *) + fragment_size);
+        if (!fragment)
+            return NULL;
+        fragment->next = map->fragments;
+        map->fragments = fragment;
+        map->arena_next = (mpm_uint8 *)fragment->data;
+        map->arena_end = map->arena_next + fragment_size;
+    }
+
+    data = map->arena_next;
+    map->arena_next += size;
+    return data;
+}
+
 static mpm_uint32 hashmap_insert(mpm_hashmap *map)
 {
     mpm_uint32 record_size = map->record_size;
@@ -180,7 +220,7 @@ static mpm_uint32 hashmap_insert(mpm_hashmap *map)
     }
 
     /* Inserting a new item. */
-    item = (mpm_hashitem *)malloc(map->allocation_size);
+    item = (mpm_hashitem *)hashmap_alloc(map, map->allocation_size);
     if (!item)
         return DFA_NO_DATA;
 
@@ -342,6 +382,804 @@ static void hashmap_stats(mpm_hashmap *map)
 /*                                Main function.                           */
 /* ----------------------------------------------------------------------- */
 
+/* Sets the terms, which can be matched first after the start_type position
+   (START_AT_BEGIN, START_AFTER_NON_NEWLINE or START_AFTER_NEWLINE). Anchored
+   patterns can only match at the beginning, and the starting [\r\n] of
+   multiline patterns is skipped at the beginning of a line. The term_map
+   is filled with the address of each term if it is not NULL. */
+int mpm_private_start_terms(mpm_re_pattern *pattern, mpm_uint32 *term_set, mpm_uint32 **term_map, mpm_uint32 start_type)
+{
+    mpm_uint32 *word_code;
+    mpm_uint32 **term, **last_term;
+
+    while (pattern) {
+        if ((pattern->flags & PATTERN_ANCHORED) && start_type != START_AT_BEGIN) {
+            pattern = pattern->next;
+            continue;
+        }
+
+        word_code = pattern->word_code + pattern->term_range_size + 1;
+        if ((pattern->flags & PATTERN_MULTILINE) && start_type != START_AFTER_NON_NEWLINE) {
+            if (word_code[0] == DFA_NO_DATA || word_code[1] != DFA_NO_DATA)
+                return MPM_INTERNAL_ERROR;
+            DFA_SETBIT(term_set, word_code[0]);
+            word_code = pattern->word_code + pattern->word_code[word_code[0] - pattern->term_range_start];
+            word_code += CHAR_SET_SIZE + 1;
+        }
+        while (word_code[0] != DFA_NO_DATA) {
+            DFA_SETBIT(term_set, word_code[0]);
+            word_code++;
+        }
+
+        if (term_map) {
+            term = term_map + pattern->term_range_start;
+            word_code = pattern->word_code;
+            last_term = term + pattern->term_range_size;
+            while (term < last_term)
+                *term++ = pattern->word_code + *word_code++;
+        }
+        pattern = pattern->next;
+    }
+    return MPM_NO_ERROR;
+}
+
+/* Characters, which are either members or non-members of all terms, are
+   indistinguishable by the state machine. These characters form a class,
+   and the states store one transition for each class. */
+mpm_uint32 mpm_private_char_classes(mpm_uint32 **term, mpm_uint32 **last_term, mpm_uint8 *char_class)
+{
+    mpm_uint32 split_class[256 * 2];
+    mpm_uint32 class_count = 1;
+    mpm_uint32 new_class_count, i, index;
+
+    memset(char_class, 0, CHAR_CLASS_TABLE_SIZE);
+    while (term < last_term && class_count < 256) {
+        /* Each class is split into members and non-members. */
+        memset(split_class, 0xff, class_count * 2 * sizeof(mpm_uint32));
+        new_class_count = 0;
+        for (i = 0; i < 256; i++) {
+            index = (char_class[i] << 1) | (CHARSET_GETBIT(term[0], i) ? 1 : 0);
+            if (split_class[index] == DFA_NO_DATA)
+                split_class[index] = new_class_count++;
+            char_class[i] = split_class[index];
+        }
+        class_count = new_class_count;
+        term++;
+    }
+    return class_count;
+}
+
+/* Size of the relative offset table of a state. The size is rounded
+   up, so the end states of each state are aligned to 4 bytes. */
+#define OFFSET_TABLE_SIZE(item, state_map_size, offset_size) \
+    (((((item)->next_state_map_size - (state_map_size)) / sizeof(mpm_uint32)) * (offset_size) + 3) & ~0x3)
+
+/* Computes the offset of each state, and returns with the total size of
+   the states, or DFA_NO_DATA if the state machine is too big. Absorbing
+   states are moved after all other states, so the matchers can detect
+   them easily. */
+static mpm_uint32 compute_state_offsets(mpm_hashmap *map, mpm_uint32 state_map_size,
+    mpm_uint32 offset_size, mpm_uint32 *absorbing_offset)
+{
+    mpm_id_offset_map *id_offset;
+    mpm_id_offset_map *last_id_offset = map->id_offset_map + map->item_count;
+    mpm_hashitem *item;
+    mpm_uint32 offset = 0;
+    mpm_uint32 i, j, table_size;
+
+    for (i = 0; i < 2; i++) {
+        if (i == 1)
+            *absorbing_offset = offset;
+
+        id_offset = map->id_offset_map;
+        while (id_offset < last_id_offset) {
+            item = id_offset->item;
+            j = item->next_state_map_size == state_map_size + sizeof(mpm_uint32)
+                && ((mpm_uint32 *)(item->next_state_map + state_map_size))[0] == item->id;
+
+            if (i == j) {
+                /* The state_map is preceded by the relative offsets and the end states. */
+                table_size = OFFSET_TABLE_SIZE(item, state_map_size, offset_size);
+                id_offset->offset = offset + table_size + sizeof(mpm_uint32);
+                /* The end states are stored in a single word (see RE_WIDE_END_STATES). */
+                offset += table_size + sizeof(mpm_uint32) + state_map_size;
+                if (offset > 0x7fffffff)
+                    return DFA_NO_DATA;
+            }
+            id_offset++;
+        }
+    }
+    return offset;
+}
+
+/* Returns non-zero, if all relative offsets can be encoded in offset_size bytes. */
+static int state_offsets_fit(mpm_hashmap *map, mpm_uint32 state_map_size, mpm_uint32 offset_size)
+{
+    mpm_id_offset_map *id_offset = map->id_offset_map;
+    mpm_id_offset_map *last_id_offset = id_offset + map->item_count;
+    mpm_uint32 *id_index, *last_id_index;
+    int32_t limit = 1 << (offset_size * 8 - 1);
+    int32_t relative_offset;
+
+    while (id_offset < last_id_offset) {
+        id_index = (mpm_uint32 *)(id_offset->item->next_state_map + state_map_size);
+        last_id_index = (mpm_uint32 *)(id_offset->item->next_state_map + id_offset->item->next_state_map_size);
+        do {
+            relative_offset = (int32_t)map->id_offset_map[id_index[0]].offset - (int32_t)id_offset->offset;
+            if (relative_offset < -limit || relative_offset >= limit)
+                return 0;
+            id_index++;
+        } while (id_index < last_id_index);
+        id_offset++;
+    }
+    return 1;
+}
+
+/* Returns with the word offset of the end state set of each state (see
+   RE_WIDE_END_STATES) in the end_state_offsets array indexed by state id,
+   and with the sets in end_state_sets. Equal sets are stored only once. */
+static int intern_end_state_sets(mpm_hashmap *map, mpm_uint32 *end_state_offsets,
+    mpm_uint32 **end_state_sets, mpm_uint32 *end_state_sets_size)
+{
+    mpm_id_offset_map *id_offset = map->id_offset_map;
+    mpm_id_offset_map *last_id_offset = id_offset + map->item_count;
+    mpm_uint32 length = map->end_state_set_length;
+    mpm_uint32 *sets, *end_states, *buckets;
+    mpm_uint32 next_offset, mask, hash, i;
+
+    /* Each state adds at most one new set. */
+    sets = (mpm_uint32 *)malloc((map->item_count + 1) * length * sizeof(mpm_uint32));
+    if (!sets)
+        return MPM_NO_MEMORY;
+
+    mask = 0xff;
+    while (mask < map->item_count * 2)
+        mask = (mask << 1) | 0x1;
+    buckets = (mpm_uint32 *)malloc((mask + 1) * sizeof(mpm_uint32));
+    if (!buckets) {
+        free(sets);
+        return MPM_NO_MEMORY;
+    }
+    memset(buckets, 0xff, (mask + 1) * sizeof(mpm_uint32));
+
+    memset(sets, 0, length * sizeof(mpm_uint32));
+    next_offset = length;
+
+    while (id_offset < last_id_offset) {
+        end_states = id_offset->item->term_set + map->term_set_length;
+        hash = 0;
+        for (i = 0; i < length; i++)
+            hash = (hash * 31) ^ end_states[i];
+
+        if (!hash && !memcmp(end_states, sets, length * sizeof(mpm_uint32))) {
+            end_state_offsets[id_offset->item->id] = 0;
+            id_offset++;
+            continue;
+        }
+
+        /* Open addressing with linear probing. */
+        hash &= mask;
+        while (buckets[hash] != DFA_NO_DATA
+                && memcmp(end_states, sets + buckets[hash], length * sizeof(mpm_uint32)) != 0)
+            hash = (hash + 1) & mask;
+
+        if (buckets[hash] == DFA_NO_DATA) {
+            buckets[hash] = next_offset;
+            memcpy(sets + next_offset, end_states, length * sizeof(mpm_uint32));
+            next_offset += length;
+        }
+        end_state_offsets[id_offset->item->id] = buckets[hash];
+        id_offset++;
+    }
+
+    free(buckets);
+    *end_state_sets = (mpm_uint32 *)realloc(sets, next_offset * sizeof(mpm_uint32));
+    if (!*end_state_sets)
+        *end_state_sets = sets;
+    *end_state_sets_size = next_offset * sizeof(mpm_uint32);
+    return MPM_NO_ERROR;
+}
+
+/* Returns with the id of the next state of the item for a character class. */
+#define NEXT_STATE_ID(item, state_map_size, class_index) \
+    (((mpm_uint32 *)((item)->next_state_map + (state_map_size)))[(item)->next_state_map[class_index]])
+
+/* Assigns a new class to each state. Two states get the same class if their
+   end state sets are equal (first iteration) or if their current classes and
+   the classes of their next states are equal. The classes are numbered in
+   the order of their lowest state ids. Returns with the number of classes. */
+static mpm_uint32 split_state_classes(mpm_hashmap *map, mpm_uint32 state_map_size,
+    mpm_uint32 *classes, mpm_uint32 *new_classes, mpm_uint32 *buckets, mpm_uint32 mask)
+{
+    mpm_id_offset_map *id_offset_map = map->id_offset_map;
+    mpm_uint32 end_state_set_length = map->end_state_set_length;
+    mpm_uint32 class_count = map->class_count;
+    mpm_hashitem *item, *other;
+    mpm_uint32 *end_states;
+    mpm_uint32 id, hash, i, next_class;
+
+    memset(buckets, 0xff, (mask + 1) * sizeof(mpm_uint32));
+    next_class = 0;
+
+    for (id = 0; id < map->item_count; id++) {
+        item = id_offset_map[id].item;
+        hash = 0;
+        if (!classes) {
+            end_states = item->term_set + map->term_set_length;
+            for (i = 0; i < end_state_set_length; i++)
+                hash = (hash * 31) ^ end_states[i];
+        } else {
+            hash = classes[id];
+            for (i = 0; i < class_count; i++)
+                hash = (hash * 31) ^ classes[NEXT_STATE_ID(item, state_map_size, i)];
+        }
+
+        /* Open addressing with linear probing. */
+        hash &= mask;
+        while (buckets[hash] != DFA_NO_DATA) {
+            other = id_offset_map[buckets[hash]].item;
+            if (!classes) {
+                if (memcmp(item->term_set + map->term_set_length, other->term_set + map->term_set_length,
+                        end_state_set_length * sizeof(mpm_uint32)) == 0)
+                    break;
+            } else if (classes[id] == classes[buckets[hash]]) {
+                for (i = 0; i < class_count; i++)
+                    if (classes[NEXT_STATE_ID(item, state_map_size, i)] != classes[NEXT_STATE_ID(other, state_map_size, i)])
+                        break;
+                if (i == class_count)
+                    break;
+            }
+            hash = (hash + 1) & mask;
+        }
+
+        if (buckets[hash] == DFA_NO_DATA) {
+            buckets[hash] = id;
+            new_classes[id] = next_class++;
+        } else
+            new_classes[id] = new_classes[buckets[hash]];
+    }
+    return next_class;
+}
+
+/* Merges the equivalent states using Moore's algorithm. The state with
+   the lowest id represents its class, so the start state keeps its id.
+   The ids in the state_ids array are updated to their new values. */
+static int minimize_states(mpm_hashmap *map, mpm_uint32 state_map_size,
+    mpm_uint32 *state_ids, mpm_uint32 state_id_count)
+{
+    mpm_id_offset_map *id_offset_map = map->id_offset_map;
+    mpm_uint8 id_map[256];
+    mpm_uint32 id_indices[256];
+    mpm_hashitem *item;
+    mpm_uint32 *classes, *new_classes, *buckets, *tmp;
+    mpm_uint32 id, i, j, mask, state_count, new_state_count, id_count, next_id;
+
+    classes = (mpm_uint32 *)malloc(map->item_count * 2 * sizeof(mpm_uint32));
+    if (!classes)
+        return MPM_NO_MEMORY;
+    new_classes = classes + map->item_count;
+
+    mask = 0xff;
+    while (mask < map->item_count * 2)
+        mask = (mask << 1) | 0x1;
+    buckets = (mpm_uint32 *)malloc((mask + 1) * sizeof(mpm_uint32));
+    if (!buckets) {
+        free(classes);
+        return MPM_NO_MEMORY;
+    }
+
+    /* The number of classes only grows, and the partition
+       is stable when the number of classes is unchanged. */
+    state_count = split_state_classes(map, state_map_size, NULL, classes, buckets, mask);
+    while (1) {
+        new_state_count = split_state_classes(map, state_map_size, classes, new_classes, buckets, mask);
+        tmp = classes;
+        classes = new_classes;
+        new_classes = tmp;
+        if (new_state_count == state_count)
+            break;
+        state_count = new_state_count;
+    }
+    free(buckets);
+
+    if (state_count == map->item_count) {
+        free(classes < new_classes ? classes : new_classes);
+        return MPM_NO_ERROR;
+    }
+
+    /* The first state of each class is kept, and its next states are
+       replaced by their representatives. Duplicated targets are removed. */
+    next_id = 0;
+    for (id = 0; id < map->item_count; id++) {
+        if (classes[id] != next_id)
+            continue;
+        next_id++;
+
+        item = id_offset_map[id].item;
+        memset(id_map, 0, state_map_size);
+        id_count = 0;
+        for (i = 0; i < map->class_count; i++) {
+            id_indices[id_count] = classes[NEXT_STATE_ID(item, state_map_size, i)];
+            j = 0;
+            while (id_indices[j] != id_indices[id_count])
+                j++;
+            if (j == id_count)
+                id_count++;
+            id_map[i] = (mpm_uint8)j;
+        }
+
+        memcpy(item->next_state_map, id_map, state_map_size);
+        memcpy(item->next_state_map + state_map_size, id_indices, id_count * sizeof(mpm_uint32));
+        item->next_state_map_size = state_map_size + id_count * sizeof(mpm_uint32);
+        item->id = classes[id];
+        id_offset_map[item->id].item = item;
+    }
+
+    for (i = 0; i < state_id_count; i++)
+        state_ids[i] = classes[state_ids[i]];
+
+    map->item_count = state_count;
+    free(classes < new_classes ? classes : new_classes);
+    return MPM_NO_ERROR;
+}
+
+/* Passes the next state of each state and character class, and
+   the end states of each state to mpm_private_compile_default. */
+static int compile_default_transitions(mpm_re *re, mpm_hashmap *map, mpm_uint8 *char_class,
+    mpm_uint32 state_map_size, mpm_uint32 *start_states, mpm_size *consumed_memory, mpm_uint32 flags)
+{
+    mpm_uint32 class_count = map->class_count;
+    mpm_uint32 *next_states, *end_states;
+    mpm_hashitem *item;
+    mpm_uint32 id, i;
+    int error_code;
+
+    next_states = (mpm_uint32 *)malloc(map->item_count * (class_count + 1) * sizeof(mpm_uint32));
+    if (!next_states)
+        return MPM_NO_MEMORY;
+    end_states = next_states + map->item_count * class_count;
+
+    for (id = 0; id < map->item_count; id++) {
+        item = map->id_offset_map[id].item;
+        for (i = 0; i < class_count; i++)
+            next_states[id * class_count + i] = NEXT_STATE_ID(item, state_map_size, i);
+        end_states[id] = item->term_set[map->term_set_length];
+    }
+
+    error_code = mpm_private_compile_default(re, next_states, end_states, map->item_count, class_count,
+        char_class, start_states, consumed_memory, flags);
+    free(next_states);
+    return error_code;
+}
+
+/* ----------------------------------------------------------------------- */
+/*                          Computing transitions.                         */
+/* ----------------------------------------------------------------------- */
+
+/* Each transition is stored as the set of consumed characters followed
+   by the term set of the next state (record_size bytes). */
+#define TRANSITION_LENGTH(map) (CHAR_SET_SIZE + ((map)->record_size >> 2))
+
+/* The character classes are computed once for all terms, so the
+   transitions can be computed by refining the classes. */
+static int init_char_classes(mpm_hashmap *map, mpm_uint8 *char_class, mpm_uint32 class_count)
+{
+    mpm_uint32 i;
+
+    map->class_count = class_count;
+    map->class_chars = (mpm_uint32 *)malloc(class_count * (CHAR_SET_SIZE * sizeof(mpm_uint32) + 1));
+    if (!map->class_chars)
+        return 1;
+    map->class_first_char = (mpm_uint8 *)(map->class_chars + class_count * CHAR_SET_SIZE);
+
+    memset(map->class_chars, 0, class_count * CHAR_SET_SIZE * sizeof(mpm_uint32));
+    memset(map->class_first_char, 0xff, class_count);
+    for (i = 255; i != DFA_NO_DATA; i--) {
+        DFA_SETBIT(map->class_chars + char_class[i] * CHAR_SET_SIZE, i);
+        map->class_first_char[char_class[i]] = i;
+    }
+    return 0;
+}
+
+/* Computes the transitions of a state without modifying the hash map, so
+   the transitions of multiple states can be computed at the same time.
+   The part array contains the transition index of each character class. */
+static int compute_transitions(mpm_hashmap *map, mpm_uint32 *term_set, mpm_uint32 **term_list,
+    mpm_uint32 *transitions, mpm_uint8 *part, mpm_uint32 *transition_count)
+{
+    mpm_uint32 *word_code;
+    mpm_uint32 *bit_set, *bit_set_end;
+    mpm_uint32 *consumed_chars, *current;
+    mpm_uint32 **term, **last_term;
+    mpm_uint8 first_class[256];
+    mpm_uint32 split_part[256 * 2];
+    mpm_uint32 class_count = map->class_count;
+    mpm_uint32 part_count, new_part_count, index, first_char;
+    mpm_uint32 term_base, term_bits, i, j;
+    mpm_uint32 transition_length = TRANSITION_LENGTH(map);
+
+    /* Decoding the set of terms. */
+    last_term = term_list;
+    term_base = 0;
+    bit_set = term_set;
+    bit_set_end = bit_set + map->term_set_length;
+    while (bit_set < bit_set_end) {
+        term_bits = *bit_set++;
+        if (term_bits == 0) {
+            term_base += 32;
+            continue;
+        }
+
+        do {
+            if (term_bits & 0x1)
+                *last_term++ = map->term_map[term_base];
+            term_bits >>= 1;
+            term_base++;
+            /* The loop stops when term_base is divisible by 32. */
+        } while (term_base & 0x1f);
+    }
+
+    /* Partition refinement: the character classes are split by each
+       active term into members and non-members. The parts are numbered
+       in the order of their first character, and each part is a
+       transition. A term contains either all or none of the characters
+       of a class, so the first character represents the whole class. */
+    memset(part, 0, class_count);
+    part_count = 1;
+    first_class[0] = 0;
+    for (term = term_list; term < last_term && part_count < class_count; term++) {
+        memset(split_part, 0xff, part_count * 2 * sizeof(mpm_uint32));
+        new_part_count = 0;
+        for (i = 0; i < class_count; i++) {
+            index = (part[i] << 1) | (CHARSET_GETBIT(term[0], map->class_first_char[i]) ? 1 : 0);
+            if (split_part[index] == DFA_NO_DATA) {
+                split_part[index] = new_part_count;
+                first_class[new_part_count++] = i;
+            }
+            part[i] = split_part[index];
+        }
+        part_count = new_part_count;
+    }
+
+    for (i = 0; i < part_count; i++) {
+        consumed_chars = transitions + i * transition_length;
+        memset(consumed_chars, 0, CHAR_SET_SIZE * sizeof(mpm_uint32));
+        memcpy(consumed_chars + CHAR_SET_SIZE, map->start, map->record_size);
+    }
+
+    for (i = 0; i < class_count; i++) {
+        consumed_chars = transitions + part[i] * transition_length;
+        bit_set = map->class_chars + i * CHAR_SET_SIZE;
+        for (j = 0; j < CHAR_SET_SIZE; j++)
+            consumed_chars[j] |= bit_set[j];
+    }
+
+    /* Get the list of reachable states. */
+    for (i = 0; i < part_count; i++) {
+        current = transitions + i * transition_length + CHAR_SET_SIZE;
+        first_char = map->class_first_char[first_class[i]];
+
+        for (term = term_list; term < last_term; term++) {
+            if (!CHARSET_GETBIT(term[0], first_char))
+                continue;
+
+            word_code = term[0] + CHAR_SET_SIZE;
+            if (word_code[0] != DFA_NO_DATA)
+                DFA_SETBIT(current + map->term_set_length, word_code[0]);
+
+            word_code ++;
+            while (word_code[0] != DFA_NO_DATA) {
+                DFA_SETBIT(current, word_code[0]);
+                word_code++;
+            }
+        }
+    }
+
+    *transition_count = part_count;
+    return MPM_NO_ERROR;
+}
+
+/* Inserts the next states into the hash map in the order of the
+   transitions, and creates the next state map of the item. */
+static int add_transitions(mpm_hashmap *map, mpm_hashitem *item, mpm_uint32 *transitions,
+    mpm_uint8 *part, mpm_uint32 transition_count, mpm_uint32 state_map_size, mpm_uint32 flags)
+{
+    mpm_uint8 id_map[256];
+    mpm_uint8 part_id_index[256];
+    mpm_uint32 id_indices[256];
+    mpm_uint32 *id_index, *last_id_index;
+    mpm_uint32 transition_length = TRANSITION_LENGTH(map);
+    mpm_uint32 i, id, part_index;
+
+#if defined MPM_VERBOSE && MPM_VERBOSE
+    if (flags & MPM_COMPILE_VERBOSE) {
+        printf("Processing %4d: ", item->id);
+        print_terms(map, item->term_set);
+    }
+#endif
+
+    last_id_index = id_indices;
+    memset(id_map, 0, state_map_size);
+
+    for (part_index = 0; part_index < transition_count; part_index++) {
+        memcpy(map->current, transitions + CHAR_SET_SIZE, map->record_size);
+        id = hashmap_insert(map);
+        if (id == DFA_NO_DATA)
+            return MPM_NO_MEMORY;
+
+#if defined MPM_VERBOSE && MPM_VERBOSE
+        if (flags & MPM_COMPILE_VERBOSE) {
+            printf("  For [");
+            mpm_private_print_char_range((mpm_uint8 *)transitions);
+            printf("] next state: %d\n", (int)id);
+        }
+#endif
+
+        /* Search wheter the ID index is used. */
+        id_index = id_indices;
+        while (id_index < last_id_index) {
+            if (*id_index == id)
+                break;
+            id_index ++;
+        }
+
+        if (id_index == last_id_index)
+            *last_id_index++ = id;
+
+        part_id_index[part_index] = id_index - id_indices;
+        transitions += transition_length;
+    }
+
+    for (i = 0; i < map->class_count; i++)
+        id_map[i] = part_id_index[part[i]];
+
+    i = (last_id_index - id_indices) * sizeof(mpm_uint32);
+    item->next_state_map_size = state_map_size + i;
+    item->next_state_map = (mpm_uint8 *)hashmap_alloc(map, state_map_size + i);
+    if (!item->next_state_map)
+        return MPM_NO_MEMORY;
+
+    memcpy(item->next_state_map, id_map, state_map_size);
+    memcpy(item->next_state_map + state_map_size, id_indices, i);
+    return MPM_NO_ERROR;
+}
+
+/* The multi-threaded version processes the unprocessed states in batches.
+   The transitions of a batch are computed by a pool of threads, which is
+   started once for each mpm_compile call. The next states are inserted by
+   the calling thread, and the states are renumbered at the end (see
+   renumber_states), so the result equals the single threaded version. */
+#define COMPILE_BATCH_SIZE 64
+
+typedef struct transition_batch {
+    mpm_hashmap *map;
+    mpm_hashitem *items[COMPILE_BATCH_SIZE];
+    mpm_uint32 transition_counts[COMPILE_BATCH_SIZE];
+    mpm_uint8 parts[COMPILE_BATCH_SIZE][256];
+    int error_codes[COMPILE_BATCH_SIZE];
+    mpm_uint32 item_count;
+    /* Size of the transitions of an item (in words). */
+    mpm_uint32 transitions_size;
+    mpm_uint32 *transitions;
+} transition_batch;
+
+#if defined MPM_THREADS && MPM_THREADS
+
+typedef struct transition_pool {
+    pthread_mutex_t lock;
+    /* Signaled when a new batch is available or the pool is stopped. */
+    pthread_cond_t start;
+    /* Signaled when the last thread finished the current batch. */
+    pthread_cond_t done;
+    pthread_t threads[MAX_THREADS];
+    mpm_uint32 thread_count;
+    /* Increased for each batch. */
+    mpm_uint32 generation;
+    /* Number of threads which still compute the current batch. */
+    mpm_uint32 running;
+    int stop;
+} transition_pool;
+
+#endif
+
+typedef struct transition_worker {
+    transition_batch *batch;
+    mpm_uint32 **term_list;
+    /* Items first_item, first_item + item_step, ... are computed. */
+    mpm_uint32 first_item;
+    mpm_uint32 item_step;
+#if defined MPM_THREADS && MPM_THREADS
+    transition_pool *pool;
+#endif
+} transition_worker;
+
+static void compute_batch_transitions(transition_worker *worker)
+{
+    transition_batch *batch = worker->batch;
+    mpm_uint32 i;
+
+    for (i = worker->first_item; i < batch->item_count; i += worker->item_step)
+        batch->error_codes[i] = compute_transitions(batch->map, batch->items[i]->term_set, worker->term_list,
+            batch->transitions + i * batch->transitions_size, batch->parts[i], batch->transition_counts + i);
+}
+
+#if defined MPM_THREADS && MPM_THREADS
+
+static void * transition_thread(void *arg)
+{
+    transition_worker *worker = (transition_worker *)arg;
+    transition_pool *pool = worker->pool;
+    mpm_uint32 generation = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (!pool->stop && pool->generation == generation)
+            pthread_cond_wait(&pool->start, &pool->lock);
+        if (pool->stop)
+            break;
+        generation = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        compute_batch_transitions(worker);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->running == 0)
+            pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/* Starts at most no_threads - 1 threads. Worker 0 is the calling thread,
+   and the batches are divided between the calling thread and the started
+   threads (which can be less than no_threads - 1). */
+static int start_transition_pool(transition_pool *pool, transition_worker *workers, mpm_uint32 no_threads)
+{
+    mpm_uint32 i;
+
+    pool->thread_count = 0;
+    pool->generation = 0;
+    pool->running = 0;
+    pool->stop = 0;
+
+    if (pthread_mutex_init(&pool->lock, NULL) != 0)
+        return MPM_NO_MEMORY;
+    if (pthread_cond_init(&pool->start, NULL) != 0) {
+        pthread_mutex_destroy(&pool->lock);
+        return MPM_NO_MEMORY;
+    }
+    if (pthread_cond_init(&pool->done, NULL) != 0) {
+        pthread_cond_destroy(&pool->start);
+        pthread_mutex_destroy(&pool->lock);
+        return MPM_NO_MEMORY;
+    }
+
+    for (i = 1; i < no_threads; i++) {
+        workers[i].pool = pool;
+        if (pthread_create(pool->threads + pool->thread_count, NULL, transition_thread, workers + i) != 0)
+            break;
+        pool->thread_count++;
+    }
+
+    /* The workers only read their item range after the first batch is started. */
+    for (i = 0; i <= pool->thread_count; i++)
+        workers[i].item_step = pool->thread_count + 1;
+    return MPM_NO_ERROR;
+}
+
+static void compute_batch(transition_pool *pool, transition_worker *workers)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->generation++;
+    pool->running = pool->thread_count;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    compute_batch_transitions(workers);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->running > 0)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void stop_transition_pool(transition_pool *pool)
+{
+    mpm_uint32 i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->thread_count; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->start);
+    pthread_mutex_destroy(&pool->lock);
+}
+
+#endif /* MPM_THREADS */
+
+/* The single threaded version processes the first unprocessed state, and
+   the new states are inserted after it. Hence the numbering of a batched
+   construction differs. This function replays the single threaded order
+   on the completed state machine, and assigns the same ids to the states.
+   The first start_state_count states are inserted before the processing. */
+static int renumber_states(mpm_hashmap *map, mpm_uint32 start_state_count, mpm_uint32 state_map_size)
+{
+    mpm_hashitem **items;
+    mpm_uint32 *new_ids;
+    mpm_uint32 *next_ids;
+    mpm_hashitem *item;
+    mpm_uint32 *id_index, *last_id_index;
+    mpm_uint32 i, head, id, next_id, item_count = map->item_count;
+
+    items = (mpm_hashitem **)malloc(item_count * sizeof(mpm_hashitem *));
+    new_ids = (mpm_uint32 *)malloc(item_count * 2 * sizeof(mpm_uint32));
+    if (!items || !new_ids) {
+        if (items)
+            free(items);
+        if (new_ids)
+            free(new_ids);
+        return MPM_NO_MEMORY;
+    }
+    next_ids = new_ids + item_count;
+
+    for (i = map->mask + 1; i > 0; i--) {
+        item = map->buckets[i - 1];
+        while (item) {
+            items[item->id] = item;
+            item = item->next;
+        }
+    }
+
+    for (i = 0; i < item_count; i++)
+        new_ids[i] = DFA_NO_DATA;
+
+    /* The unprocessed list of the start states (see hashmap_insert). */
+    head = 0;
+    new_ids[0] = 0;
+    next_ids[0] = DFA_NO_DATA;
+    for (i = 1; i < start_state_count; i++) {
+        new_ids[i] = i;
+        next_ids[i] = next_ids[0];
+        next_ids[0] = i;
+    }
+    next_id = start_state_count;
+
+    while (head != DFA_NO_DATA) {
+        item = items[head];
+        id_index = (mpm_uint32 *)(item->next_state_map + state_map_size);
+        last_id_index = (mpm_uint32 *)(item->next_state_map + item->next_state_map_size);
+
+        /* The id indices are ordered by their first insertion. */
+        for (; id_index < last_id_index; id_index++) {
+            id = *id_index;
+            if (new_ids[id] == DFA_NO_DATA) {
+                new_ids[id] = next_id++;
+                next_ids[id] = next_ids[head];
+                next_ids[head] = id;
+            }
+        }
+        head = next_ids[head];
+    }
+
+    for (i = 0; i < item_count; i++) {
+        item = items[i];
+        item->id = new_ids[i];
+        id_index = (mpm_uint32 *)(item->next_state_map + state_map_size);
+        last_id_index = (mpm_uint32 *)(item->next_state_map + item->next_state_map_size);
+        for (; id_index < last_id_index; id_index++)
+            *id_index = new_ids[*id_index];
+    }
+
+    free(items);
+    free(new_ids);
+    return next_id == item_count ? MPM_NO_ERROR : MPM_INTERNAL_ERROR;
+}
+
 /* Accessing members of the hash map. */
 #define MAP(id) (map_data.id)
 
@@ -352,24 +1190,42 @@ int mpm_compile(mpm_re *re, mpm_size *consumed_memory, mpm_uint32 flags)
     mpm_re_pattern *pattern;
     mpm_hashitem *item;
     mpm_id_offset_map *id_offset, *last_id_offset;
-    mpm_uint32 *word_code;
-    mpm_uint32 *bit_set, *bit_set_end, *other_bit_set;
-    mpm_uint32 term_base, term_bits;
-    mpm_uint32 **term, **last_term;
     mpm_uint32 *id_index, *last_id_index;
-    mpm_uint8 *compiled_pattern;
-    mpm_uint8 id_map[256];
-    mpm_uint32 id_indices[256];
-    mpm_uint32 available_chars[CHAR_SET_SIZE];
-    mpm_uint32 consumed_chars[CHAR_SET_SIZE];
-    mpm_uint32 state_map_size = (re->flags & RE_CHAR_SET_256) ? 256 : 128;
-    mpm_uint32 non_newline_offset, newline_offset;
-    mpm_uint32 i, j, id, offset, pattern_flags;
+    mpm_uint8 *compiled_pattern, *state_map;
+    mpm_uint8 *next_offset;
+    int32_t relative_offset;
+    mpm_uint8 char_class[CHAR_CLASS_TABLE_SIZE];
+    mpm_uint32 class_count, state_map_size;
+    mpm_uint32 start_offset, non_newline_offset, newline_offset, absorbing_offset, all_end_states;
+    mpm_uint32 i, offset, offset_size, pattern_flags;
+    mpm_uint32 state_count, state_ids[2], start_states[3];
+    mpm_uint32 skip_char_count, skip_index;
+    mpm_uint8 skip_chars[SKIP_MAX_CHARS];
+    mpm_uint32 *end_state_offsets, *end_state_sets;
+    mpm_uint32 end_state_sets_size;
+    transition_batch batch;
+    transition_worker workers[MAX_THREADS];
+#if defined MPM_THREADS && MPM_THREADS
+    transition_pool pool;
+#endif
+    mpm_uint32 **term_lists;
+    mpm_uint32 no_threads, batch_size, start_state_count;
+    int has_absorbing_state, error_code;
 
     if (!(re->flags & RE_MODE_COMPILE))
         return MPM_RE_ALREADY_COMPILED;
 
-    if (hashmap_init(map, re->compile.next_term_index, re->compile.next_id - 1)) {
+    if (flags & MPM_COMPILE_LAZY)
+        return mpm_private_compile_lazy(re, consumed_memory, flags);
+
+    if (flags & MPM_COMPILE_BIT_PARALLEL)
+        return mpm_private_compile_bit_parallel(re, consumed_memory, flags);
+
+    /* The end states must fit into a single word. */
+    if ((flags & MPM_COMPILE_DEFAULT_TRANSITIONS) && re->compile.next_id > NARROW_PATTERN_LIMIT)
+        return MPM_PATTERN_LIMIT;
+
+    if (hashmap_init(map, re->compile.next_term_index, re->compile.next_id)) {
         hashmap_free(map);
         return MPM_NO_MEMORY;
     }
@@ -384,36 +1240,24 @@ int mpm_compile(mpm_re *re, mpm_size *consumed_memory, mpm_uint32 flags)
 #endif
 
     /* Initialize data structures. */
-    memset(MAP(start), 0, MAP(record_size));
+    /* Only the last word is stored if RE_WIDE_END_STATES is set. */
+    all_end_states = 0xffffffff;
+    if ((re->compile.next_id & 0x1f) || re->compile.next_id == 0)
+        all_end_states = ((mpm_uint32)1 << (re->compile.next_id & 0x1f)) - 1;
     pattern = re->compile.patterns;
     pattern_flags = 0;
-    non_newline_offset = 0;
-    newline_offset = 0;
-    /* Possible start positions. Anchored matches are included,
-       and the starting [\r\n] is skipped for multiline matches. */
     while (pattern) {
         pattern_flags |= pattern->flags;
-        word_code = pattern->word_code + pattern->term_range_size + 1;
-        if (pattern->flags & PATTERN_MULTILINE) {
-            if (word_code[0] == DFA_NO_DATA || word_code[1] != DFA_NO_DATA) {
-                hashmap_free(map);
-                return MPM_INTERNAL_ERROR;
-            }
-            DFA_SETBIT(MAP(start), word_code[0]);
-            word_code = pattern->word_code + pattern->word_code[word_code[0] - pattern->term_range_start];
-            word_code += CHAR_SET_SIZE + 1;
-        }
-        while (word_code[0] != DFA_NO_DATA) {
-            DFA_SETBIT(MAP(start), word_code[0]);
-            word_code++;
-        }
-        term = MAP(term_map) + pattern->term_range_start;
-        word_code = pattern->word_code;
-        last_term = term + pattern->term_range_size;
-        while (term < last_term)
-            *term++ = pattern->word_code + *word_code++;
         pattern = pattern->next;
     }
+    non_newline_offset = 0;
+    newline_offset = 0;
+
+    memset(MAP(start), 0, MAP(record_size));
+    if (mpm_private_start_terms(re->compile.patterns, MAP(start), MAP(term_map), START_AT_BEGIN) != MPM_NO_ERROR) {
+        hashmap_free(map);
+        return MPM_INTERNAL_ERROR;
+    }
 
     memcpy(MAP(current), MAP(start), MAP(record_size));
     if (hashmap_insert(map) == DFA_NO_DATA) {
@@ -421,28 +1265,19 @@ int mpm_compile(mpm_re *re, mpm_size *consumed_memory, mpm_uint32 flags)
         return MPM_NO_MEMORY;
     }
 
+    /* All terms are assigned to term_map by now. The size of
+       the state_map is rounded up to keep the offsets aligned. */
+    class_count = mpm_private_char_classes(MAP(term_map), MAP(term_map) + re->compile.next_term_index, char_class);
+    state_map_size = (class_count + 3) & ~0x3;
+
+    if (init_char_classes(map, char_class, class_count)) {
+        hashmap_free(map);
+        return MPM_NO_MEMORY;
+    }
+
     if (pattern_flags & (PATTERN_ANCHORED | PATTERN_MULTILINE)) {
-        /* Possible start positions after a non-newline. Anchored matches are skipped. */
         memset(MAP(start), 0, MAP(record_size));
-        pattern = re->compile.patterns;
-        while (pattern) {
-            if (pattern->flags & PATTERN_ANCHORED) {
-                pattern = pattern->next;
-                continue;
-            }
-
-            word_code = pattern->word_code + pattern->term_range_size + 1;
-            while (word_code[0] != DFA_NO_DATA) {
-                DFA_SETBIT(MAP(start), word_code[0]);
-                word_code++;
-            }
-            term = MAP(term_map) + pattern->term_range_start;
-            word_code = pattern->word_code;
-            last_term = term + pattern->term_range_size;
-            while (term < last_term)
-                *term++ = pattern->word_code + *word_code++;
-            pattern = pattern->next;
-        }
+        mpm_private_start_terms(re->compile.patterns, MAP(start), NULL, START_AFTER_NON_NEWLINE);
 
         memcpy(MAP(current), MAP(start), MAP(record_size));
         non_newline_offset = hashmap_insert(map);
@@ -454,33 +1289,8 @@ int mpm_compile(mpm_re *re, mpm_size *consumed_memory, mpm_uint32 flags)
     }
 
     if (pattern_flags & PATTERN_MULTILINE) {
-        /* Possible start positions after a newline. Anchored matches are skipped,
-           and the starting [\r\n] is skipped for multiline matches. */
         memset(MAP(current), 0, MAP(record_size));
-        pattern = re->compile.patterns;
-        while (pattern) {
-            if (pattern->flags & PATTERN_ANCHORED) {
-                pattern = pattern->next;
-                continue;
-            }
-
-            word_code = pattern->word_code + pattern->term_range_size + 1;
-            if (pattern->flags & PATTERN_MULTILINE) {
-                DFA_SETBIT(MAP(current), word_code[0]);
-                word_code = pattern->word_code + pattern->word_code[word_code[0] - pattern->term_range_start];
-                word_code += CHAR_SET_SIZE + 1;
-            }
-            while (word_code[0] != DFA_NO_DATA) {
-                DFA_SETBIT(MAP(current), word_code[0]);
-                word_code++;
-            }
-            term = MAP(term_map) + pattern->term_range_start;
-            word_code = pattern->word_code;
-            last_term = term + pattern->term_range_size;
-            while (term < last_term)
-                *term++ = pattern->word_code + *word_code++;
-            pattern = pattern->next;
-        }
+        mpm_private_start_terms(re->compile.patterns, MAP(current), NULL, START_AFTER_NEWLINE);
 
         newline_offset = hashmap_insert(map);
         if (newline_offset == DFA_NO_DATA) {
@@ -489,137 +1299,93 @@ int mpm_compile(mpm_re *re, mpm_size *consumed_memory, mpm_uint32 flags)
         }
     }
 
-    do {
-#if defined MPM_VERBOSE && MPM_VERBOSE
-        if (flags & MPM_COMPILE_VERBOSE) {
-            printf("Processing %4d: ", MAP(next_unprocessed)->id);
-            print_terms(map, MAP(next_unprocessed)->term_set);
-        }
+    /* A single state is processed in each step by the single threaded version. */
+    no_threads = GET_THREADS(flags);
+#if !(defined MPM_THREADS && MPM_THREADS)
+    no_threads = 1;
 #endif
+    if (no_threads < 1)
+        no_threads = 1;
+    batch_size = no_threads > 1 ? COMPILE_BATCH_SIZE : 1;
+    start_state_count = MAP(item_count);
+
+    batch.map = map;
+    batch.transitions_size = class_count * TRANSITION_LENGTH(map);
+    batch.transitions = (mpm_uint32 *)malloc(batch_size * batch.transitions_size * sizeof(mpm_uint32));
+    term_lists = NULL;
+    if (batch.transitions && no_threads > 1)
+        term_lists = (mpm_uint32 **)malloc((no_threads - 1) * re->compile.next_term_index * sizeof(mpm_uint32 *));
+    if (!batch.transitions || (no_threads > 1 && !term_lists)) {
+        if (batch.transitions)
+            free(batch.transitions);
+        hashmap_free(map);
+        return MPM_NO_MEMORY;
+    }
 
-        /* Decoding the set of terms. */
-        last_term = MAP(term_list);
-        term_base = 0;
-        bit_set = MAP(next_unprocessed)->term_set;
-        bit_set_end = bit_set + MAP(term_set_length);
-        while (bit_set < bit_set_end) {
-            term_bits = *bit_set++;
-            if (term_bits == 0) {
-                term_base += 32;
-                continue;
-            }
-
-            do {
-                if (term_bits & 0x1)
-                    *last_term++ = MAP(term_map)[term_base];
-                term_bits >>= 1;
-                term_base++;
-                /* The loop stops when term_base is divisible by 32. */
-            } while (term_base & 0x1f);
-        }
-
-        memset(available_chars, 0xff, CHAR_SET_SIZE * sizeof(mpm_uint32));
-        last_id_index = id_indices;
-
-        for (i = 0; i < state_map_size; i++) {
-            if (!CHARSET_GETBIT(available_chars, i))
-                continue;
-
-            /* Get those characters, which have the same bit set,
-               and the list of reachable states. */
-            memset(consumed_chars, 0xff, CHAR_SET_SIZE * sizeof(mpm_uint32));
-            memcpy(MAP(current), MAP(start), MAP(record_size));
-            term = MAP(term_list);
-
-            while (term < last_term) {
-                bit_set = term[0];
-                bit_set_end = bit_set + CHAR_SET_SIZE;
-                other_bit_set = consumed_chars;
-
-                if (CHARSET_GETBIT(bit_set, i)) {
-                    while (bit_set < bit_set_end)
-                        *other_bit_set++ &= *bit_set++;
-
-                    word_code = term[0] + CHAR_SET_SIZE;
-                    if (word_code[0] != DFA_NO_DATA)
-                        DFA_SETBIT(MAP(current) + MAP(term_set_length), word_code[0]);
-
-                    word_code ++;
-                    while (word_code[0] != DFA_NO_DATA) {
-                        DFA_SETBIT(MAP(current), word_code[0]);
-                        word_code++;
-                    }
-                } else {
-                    while (bit_set < bit_set_end)
-                        *other_bit_set++ &= ~(*bit_set++);
-                }
-
-                term++;
-            }
-
-            bit_set = consumed_chars;
-            bit_set_end = bit_set + CHAR_SET_SIZE;
-            other_bit_set = available_chars;
-            while (bit_set < bit_set_end) {
-                /* Sanity check. */
-                if (~other_bit_set[0] & bit_set[0]) {
-                    hashmap_free(map);
-                    return MPM_INTERNAL_ERROR;
-                }
-                *other_bit_set++ -= *bit_set++;
-            }
-
-            id = hashmap_insert(map);
-            if (id == DFA_NO_DATA) {
-                hashmap_free(map);
-                return MPM_NO_MEMORY;
-            }
+    for (i = 0; i < no_threads; i++) {
+        workers[i].batch = &batch;
+        workers[i].term_list = i == 0 ? MAP(term_list) : term_lists + (i - 1) * re->compile.next_term_index;
+        workers[i].first_item = i;
+        workers[i].item_step = 1;
+    }
 
-#if defined MPM_VERBOSE && MPM_VERBOSE
-            if (flags & MPM_COMPILE_VERBOSE) {
-                printf("  For [");
-                mpm_private_print_char_range((mpm_uint8 *)consumed_chars);
-                printf("] next state: %d\n", (int)id);
-            }
+#if defined MPM_THREADS && MPM_THREADS
+    if (no_threads > 1 && start_transition_pool(&pool, workers, no_threads) != MPM_NO_ERROR) {
+        free(batch.transitions);
+        free(term_lists);
+        hashmap_free(map);
+        return MPM_NO_MEMORY;
+    }
 #endif
 
-            /* Search wheter the ID index is used. */
-            id_index = id_indices;
-            while (id_index < last_id_index) {
-                if (*id_index == id) {
-                    id = id_index - id_indices;
-                    break;
-                }
-                id_index ++;
-            }
-
-            if (id_index == last_id_index)
-                *last_id_index++ = id;
-
-            id = id_index - id_indices;
-            for (j = 0; j < state_map_size; j++)
-                if (CHARSET_GETBIT(consumed_chars, j))
-                    id_map[j] = id;
-        }
-
-        i = (last_id_index - id_indices) * sizeof(mpm_uint32);
-        MAP(next_unprocessed)->next_state_map_size = state_map_size + i;
-        MAP(next_unprocessed)->next_state_map = (mpm_uint8 *)malloc(state_map_size + i);
-        if (!MAP(next_unprocessed)->next_state_map) {
-            hashmap_free(map);
-            return MPM_NO_MEMORY;
+    error_code = MPM_NO_ERROR;
+    do {
+        item = MAP(next_unprocessed);
+        batch.item_count = 0;
+        do {
+            batch.items[batch.item_count++] = item;
+            item = item->next_unprocessed;
+        } while (item && batch.item_count < batch_size);
+
+#if defined MPM_THREADS && MPM_THREADS
+        if (no_threads > 1) {
+            compute_batch(&pool, workers);
+            /* The new states are inserted after the remaining states. */
+            MAP(next_unprocessed) = item;
+        } else
+#endif
+            compute_batch_transitions(workers);
+
+        for (i = 0; i < batch.item_count; i++) {
+            error_code = batch.error_codes[i];
+            if (error_code == MPM_NO_ERROR)
+                error_code = add_transitions(map, batch.items[i], batch.transitions + i * batch.transitions_size,
+                    batch.parts[i], batch.transition_counts[i], state_map_size, flags);
+            if (error_code == MPM_NO_ERROR && ((MAP(item_count) > STATE_LIMIT)
+                    || ((flags & MPM_COMPILE_SMALL_MACHINE) && (MAP(item_count) > STATE_LIMIT / 4))))
+                error_code = MPM_STATE_MACHINE_LIMIT;
+            if (error_code != MPM_NO_ERROR)
+                break;
         }
 
-        memcpy(MAP(next_unprocessed)->next_state_map, id_map, state_map_size);
-        memcpy(MAP(next_unprocessed)->next_state_map + state_map_size, id_indices, i);
+        if (no_threads == 1)
+            MAP(next_unprocessed) = MAP(next_unprocessed)->next_unprocessed;
+    } while (error_code == MPM_NO_ERROR && MAP(next_unprocessed));
 
-        if ((MAP(item_count) > STATE_LIMIT) || ((flags & MPM_COMPILE_SMALL_MACHINE) && (MAP(item_count) > STATE_LIMIT / 4))) {
-            hashmap_free(map);
-            return MPM_STATE_MACHINE_LIMIT;
-        }
+#if defined MPM_THREADS && MPM_THREADS
+    if (no_threads > 1)
+        stop_transition_pool(&pool);
+#endif
 
-        MAP(next_unprocessed) = MAP(next_unprocessed)->next_unprocessed;
-    } while (MAP(next_unprocessed));
+    free(batch.transitions);
+    if (term_lists)
+        free(term_lists);
+    if (error_code == MPM_NO_ERROR && no_threads > 1)
+        error_code = renumber_states(map, start_state_count, state_map_size);
+    if (error_code != MPM_NO_ERROR) {
+        hashmap_free(map);
+        return error_code;
+    }
 
     if (hashmap_sanity_check(map)) {
         hashmap_free(map);
@@ -652,55 +1418,151 @@ int mpm_compile(mpm_re *re, mpm_size *consumed_memory, mpm_uint32 flags)
         }
     }
 
-    id_offset = MAP(id_offset_map);
-    last_id_offset = id_offset + MAP(item_count);
-    offset = 0;
-    /* Calculate state offsets. */
-    while (id_offset < last_id_offset) {
-        id_offset->offset = offset;
-        /* At the moment we only support 32 end states. */
-        offset += sizeof(mpm_uint32) + id_offset->item->next_state_map_size;
-        if (offset > 0x7fffffff) {
+    state_count = MAP(item_count);
+    if (flags & MPM_COMPILE_MINIMIZE) {
+        state_ids[0] = non_newline_offset;
+        state_ids[1] = newline_offset;
+        if (minimize_states(map, state_map_size, state_ids, 2) != MPM_NO_ERROR) {
+            hashmap_free(map);
+            return MPM_NO_MEMORY;
+        }
+        non_newline_offset = state_ids[0];
+        newline_offset = state_ids[1];
+    }
+
+    if (flags & MPM_COMPILE_DEFAULT_TRANSITIONS) {
+        start_states[START_AT_BEGIN] = 0;
+        start_states[START_AFTER_NON_NEWLINE] = non_newline_offset;
+        start_states[START_AFTER_NEWLINE] = newline_offset;
+        error_code = compile_default_transitions(re, map, char_class, state_map_size, start_states, consumed_memory, flags);
+        hashmap_free(map);
+        return error_code;
+    }
+
+    last_id_offset = MAP(id_offset_map) + MAP(item_count);
+    /* The narrowest offset encoding is selected, which can represent all transitions. */
+    offset_size = 1;
+    while (1) {
+        offset = compute_state_offsets(map, state_map_size, offset_size, &absorbing_offset);
+        if (offset == DFA_NO_DATA) {
             hashmap_free(map);
             return MPM_STATE_MACHINE_LIMIT;
         }
-        id_offset++;
+        if (offset_size == sizeof(int32_t) || state_offsets_fit(map, state_map_size, offset_size))
+            break;
+        offset_size <<= 1;
     }
+    has_absorbing_state = absorbing_offset < offset;
+
+    /* Characters which leave the non-newline start state. The matching
+       usually stays in this state, so these characters can be searched
+       by a fast scan. The start state must not be absorbing. */
+    item = MAP(id_offset_map)[non_newline_offset].item;
+    id_index = (mpm_uint32 *)(item->next_state_map + state_map_size);
+    last_id_index = (mpm_uint32 *)(item->next_state_map + item->next_state_map_size);
+    skip_index = 0;
+    while (id_index + skip_index < last_id_index && id_index[skip_index] != item->id)
+        skip_index++;
+
+    skip_char_count = 256;
+    if (id_index + skip_index < last_id_index && last_id_index - id_index > 1) {
+        skip_char_count = 0;
+        for (i = 0; i < 256; i++) {
+            if (item->next_state_map[char_class[i]] == skip_index)
+                continue;
+            if (skip_char_count < SKIP_MAX_CHARS)
+                skip_chars[skip_char_count] = i;
+            skip_char_count++;
+        }
+        /* The vector compare always uses SKIP_MAX_CHARS characters. */
+        for (i = skip_char_count; i < SKIP_MAX_CHARS; i++)
+            skip_chars[i] = skip_chars[0];
+    }
+
+    start_offset = MAP(id_offset_map)[0].offset;
     non_newline_offset = MAP(id_offset_map)[non_newline_offset].offset;
     newline_offset = MAP(id_offset_map)[newline_offset].offset;
 
+    end_state_offsets = NULL;
+    end_state_sets = NULL;
+    end_state_sets_size = 0;
+    if (re->compile.next_id > NARROW_PATTERN_LIMIT) {
+        end_state_offsets = (mpm_uint32 *)malloc(MAP(item_count) * sizeof(mpm_uint32));
+        if (!end_state_offsets) {
+            hashmap_free(map);
+            return MPM_NO_MEMORY;
+        }
+        if (intern_end_state_sets(map, end_state_offsets, &end_state_sets, &end_state_sets_size) != MPM_NO_ERROR) {
+            free(end_state_offsets);
+            hashmap_free(map);
+            return MPM_NO_MEMORY;
+        }
+    }
+
 #if defined MPM_VERBOSE && MPM_VERBOSE
     if (flags & MPM_COMPILE_VERBOSE_STATS) {
         i = sizeof(mpm_uint32) + (MAP(item_count) * sizeof(mpm_uint32) * 256);
-        printf("  total patterns: %d, total terms: %d, number of states: %d\n  compression save: %.2lf%% (%d bytes instead of %d bytes)\n",
-            (int)re->compile.next_id, (int)re->compile.next_term_index, (int)MAP(item_count),
-            (1.0 - ((double)offset / (double)i)) * 100.0, offset, (int)i);
+        printf("  total patterns: %d, total terms: %d, number of states: %d, character classes: %d\n  offset size: %d bits, compression save: %.2lf%% (%d bytes instead of %d bytes)\n",
+            (int)re->compile.next_id, (int)re->compile.next_term_index, (int)MAP(item_count), (int)class_count, (int)(offset_size * 8),
+            (1.0 - ((double)(CHAR_CLASS_TABLE_SIZE + offset) / (double)i)) * 100.0, (int)(CHAR_CLASS_TABLE_SIZE + offset), (int)i);
+        if (state_count != MAP(item_count))
+            printf("  minimization removed %d states\n", (int)(state_count - MAP(item_count)));
+        if (end_state_sets)
+            printf("  end state sets: %d (%d bytes)\n", (int)(end_state_sets_size / (MAP(end_state_set_length) * sizeof(mpm_uint32))),
+                (int)end_state_sets_size);
     }
 #endif
 
     if (consumed_memory)
-        *consumed_memory = sizeof(mpm_re) + offset;
+        *consumed_memory = sizeof(mpm_re) + CHAR_CLASS_TABLE_SIZE + offset + end_state_sets_size;
 
-    compiled_pattern = (mpm_uint8 *)malloc(offset);
+    compiled_pattern = (mpm_uint8 *)malloc(CHAR_CLASS_TABLE_SIZE + offset);
     if (!compiled_pattern) {
+        if (end_state_sets) {
+            free(end_state_offsets);
+            free(end_state_sets);
+        }
         hashmap_free(map);
         return MPM_NO_MEMORY;
     }
 
+    memcpy(compiled_pattern, char_class, CHAR_CLASS_TABLE_SIZE);
+    /* The alignment gaps are cleared, so the saved files are reproducible. */
+    memset(compiled_pattern + CHAR_CLASS_TABLE_SIZE, 0, offset);
+
     id_offset = MAP(id_offset_map);
     while (id_offset < last_id_offset) {
-        id_index = (mpm_uint32 *)(id_offset->item->next_state_map + state_map_size);
-        last_id_index = (mpm_uint32 *)(id_offset->item->next_state_map + id_offset->item->next_state_map_size);
-        offset = id_offset->offset;
+        item = id_offset->item;
+        state_map = compiled_pattern + CHAR_CLASS_TABLE_SIZE + id_offset->offset;
+        id_index = (mpm_uint32 *)(item->next_state_map + state_map_size);
+        last_id_index = (mpm_uint32 *)(item->next_state_map + item->next_state_map_size);
+
+        /* Resolve the states to physical offsets, which are stored in reverse order. */
+        next_offset = state_map - sizeof(mpm_uint32);
         do {
-            /* Resolve the states to physical offsets. */
-            id_index[0] = MAP(id_offset_map)[id_index[0]].offset - offset;
+            relative_offset = (int32_t)MAP(id_offset_map)[id_index[0]].offset - (int32_t)id_offset->offset;
+            next_offset -= offset_size;
+            switch (offset_size) {
+            case 1:
+                *(int8_t *)next_offset = (int8_t)relative_offset;
+                break;
+            case 2:
+                *(int16_t *)next_offset = (int16_t)relative_offset;
+                break;
+            default:
+                *(int32_t *)next_offset = relative_offset;
+                break;
+            }
             id_index++;
         } while (id_index < last_id_index);
 
         /* Combine the the state descriptor. */
-        ((mpm_uint32 *)(compiled_pattern + id_offset->offset))[0] = id_offset->item->term_set[MAP(term_set_length)];
-        memcpy(compiled_pattern + id_offset->offset + sizeof(mpm_uint32), id_offset->item->next_state_map, id_offset->item->next_state_map_size);
+        if (end_state_offsets)
+            ((mpm_uint32 *)state_map)[-1] = end_state_offsets[item->id];
+        else
+            ((mpm_uint32 *)state_map)[-1] = item->term_set[MAP(term_set_length)];
+        for (i = 0; i < state_map_size; i++)
+            state_map[i] = STATE_MAP_INDEX(item->next_state_map[i]);
         id_offset++;
     }
 
@@ -710,9 +1572,34 @@ int mpm_compile(mpm_re *re, mpm_size *consumed_memory, mpm_uint32 flags)
     if (re->compile.patterns)
         mpm_private_free_patterns(re->compile.patterns);
 
+    re->run.end_state_sets = end_state_sets;
+    re->run.end_state_set_length = 1;
+    re->run.end_state_sets_size = end_state_sets_size;
+    if (end_state_sets) {
+        free(end_state_offsets);
+        re->run.end_state_set_length = MAP(end_state_set_length);
+        re->flags |= RE_WIDE_END_STATES;
+    }
+
     re->run.compiled_pattern = compiled_pattern;
+    re->run.compiled_size = CHAR_CLASS_TABLE_SIZE + offset;
+    re->run.start_offset = start_offset;
     re->run.non_newline_offset = non_newline_offset;
     re->run.newline_offset = newline_offset;
+    re->run.absorbing_offset = absorbing_offset;
+    re->run.all_end_states = all_end_states;
+    if (has_absorbing_state)
+        re->flags |= RE_HAS_ABSORBING_STATE;
+    if (offset_size == 1)
+        re->flags |= RE_OFFSET_8;
+    else if (offset_size == 2)
+        re->flags |= RE_OFFSET_16;
+    if (skip_char_count <= SKIP_MAX_CHARS) {
+        re->run.skip_char_count = skip_char_count;
+        re->run.skip_index = STATE_MAP_INDEX(skip_index);
+        memcpy(re->run.skip_chars, skip_chars, SKIP_MAX_CHARS);
+        re->flags |= RE_SKIP_START_STATE;
+    }
 
     return MPM_NO_ERROR;
 }
@@ -0,0 +1,262 @@
+/* Copyright (C) 2012 Open Information Security Foundation
+ *
+ * You can copy, redistribute or modify this Program under the terms of
+ * the GNU General Public License version 2 as published by the Free
+ * Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/**
+ * \file
+ *
+ * \author Zoltan Herczeg <zherczeg@inf.u-szeged.hu>
+ */
+
+
+#include "mpm_internal.h"
+
+/* ----------------------------------------------------------------------- */
+/*                      Default transition compression.                    */
+/* ----------------------------------------------------------------------- */
+
+/* A state only stores the transitions which differ from the transitions of
+   its default state, and the other transitions are looked up in the default
+   state (which may have a default state as well). The default states are
+   selected from the states with lower ids, so the chains have no cycles, and
+   the length of the chains is limited by DEFAULT_TRANSITION_MAX_HOPS.
+
+   Comparing all pairs of states is too expensive, so the candidates are the
+   start states, the next states, and the previous DEFAULT_CANDIDATE_WINDOW
+   states of a state. Neighbouring states are usually created from similar
+   term sets, so they share most of their transitions.
+
+   Most states have only a few distinct next states. These states are packed:
+   the index of the next state is stored for each class in a few bits, so no
+   default states are visited. The smallest encoding is selected for each
+   state, and the dense encoding is preferred when the sizes are equal. */
+
+#define DEFAULT_CANDIDATE_WINDOW 32
+#define DEFAULT_PACKED_MAX_TARGETS 16
+
+/* Size of a state in words. */
+#define SPARSE_STATE_SIZE(count) \
+    (DEFAULT_STATE_HEADER_SIZE + (((count) + 3) >> 2) + (count))
+#define DENSE_STATE_SIZE(class_count) \
+    (DEFAULT_STATE_HEADER_SIZE + (class_count))
+#define PACKED_INDEX_WORDS(class_count, shift) \
+    ((((class_count) << (shift)) + 31) >> 5)
+#define PACKED_STATE_SIZE(class_count, shift, target_count) \
+    (DEFAULT_STATE_HEADER_SIZE + PACKED_INDEX_WORDS(class_count, shift) + (target_count))
+
+static mpm_uint32 count_differences(mpm_uint32 *next_states, mpm_uint32 *other_next_states, mpm_uint32 class_count)
+{
+    mpm_uint32 i, count = 0;
+
+    for (i = 0; i < class_count; i++)
+        if (next_states[i] != other_next_states[i])
+            count++;
+    return count;
+}
+
+/* Collects the distinct next states in the order of the classes. Returns
+   with DEFAULT_PACKED_MAX_TARGETS + 1 if there are more next states. */
+static mpm_uint32 collect_targets(mpm_uint32 *next_states, mpm_uint32 class_count, mpm_uint32 *targets)
+{
+    mpm_uint32 i, j, target_count = 0;
+
+    for (i = 0; i < class_count; i++) {
+        for (j = 0; j < target_count; j++)
+            if (targets[j] == next_states[i])
+                break;
+        if (j < target_count)
+            continue;
+        if (target_count == DEFAULT_PACKED_MAX_TARGETS)
+            return DEFAULT_PACKED_MAX_TARGETS + 1;
+        targets[target_count++] = next_states[i];
+    }
+    return target_count;
+}
+
+/* Returns with the log2 of the number of bits of an index. */
+static mpm_uint32 packed_shift(mpm_uint32 target_count)
+{
+    if (target_count <= 2)
+        return 0;
+    return target_count <= 4 ? 1 : 2;
+}
+
+int mpm_private_compile_default(mpm_re *re, mpm_uint32 *next_states, mpm_uint32 *end_states,
+    mpm_uint32 state_count, mpm_uint32 class_count, mpm_uint8 *char_class, mpm_uint32 *start_states,
+    mpm_size *consumed_memory, mpm_uint32 flags)
+{
+    mpm_default_dfa *default_dfa;
+    mpm_uint32 *defaults, *depths, *offsets, *checked;
+    mpm_uint32 *state_next_states, *state, *next_offsets;
+    mpm_uint32 targets[DEFAULT_PACKED_MAX_TARGETS];
+    mpm_uint8 *classes;
+    mpm_uint32 id, candidate, best, best_count, count, offset, size_words, i, j, shift, bit;
+    mpm_size size;
+#if defined MPM_VERBOSE && MPM_VERBOSE
+    mpm_uint32 default_count = 0, packed_count = 0, max_depth = 0;
+#endif
+
+    defaults = (mpm_uint32 *)malloc(state_count * 4 * sizeof(mpm_uint32));
+    if (!defaults)
+        return MPM_NO_MEMORY;
+    depths = defaults + state_count;
+    offsets = depths + state_count;
+    checked = offsets + state_count;
+    memset(checked, 0xff, state_count * sizeof(mpm_uint32));
+
+    offset = 0;
+    for (id = 0; id < state_count; id++) {
+        state_next_states = next_states + id * class_count;
+        best = DFA_NO_DATA;
+        best_count = class_count;
+
+        for (i = 0; i < 3 + class_count + DEFAULT_CANDIDATE_WINDOW; i++) {
+            if (i < 3)
+                candidate = start_states[i];
+            else if (i < 3 + class_count)
+                candidate = state_next_states[i - 3];
+            else
+                candidate = id - (i - 3 - class_count) - 1;
+
+            /* Unsigned comparison: the window may start before the first state. */
+            if (candidate >= id || checked[candidate] == id || depths[candidate] >= DEFAULT_TRANSITION_MAX_HOPS)
+                continue;
+            checked[candidate] = id;
+
+            count = count_differences(state_next_states, next_states + candidate * class_count, class_count);
+            if (count < best_count || (count == best_count && best != DFA_NO_DATA && depths[candidate] < depths[best])) {
+                best = candidate;
+                best_count = count;
+            }
+        }
+
+        defaults[id] = DEFAULT_STATE_DENSE;
+        depths[id] = 0;
+        size_words = DENSE_STATE_SIZE(class_count);
+
+        count = collect_targets(state_next_states, class_count, targets);
+        if (count <= DEFAULT_PACKED_MAX_TARGETS
+                && PACKED_STATE_SIZE(class_count, packed_shift(count), count) < size_words) {
+            defaults[id] = DEFAULT_STATE_PACKED;
+            size_words = PACKED_STATE_SIZE(class_count, packed_shift(count), count);
+        }
+
+        if (best != DFA_NO_DATA && SPARSE_STATE_SIZE(best_count) < size_words) {
+            defaults[id] = best;
+            depths[id] = depths[best] + 1;
+            size_words = SPARSE_STATE_SIZE(best_count);
+        }
+
+#if defined MPM_VERBOSE && MPM_VERBOSE
+        if (defaults[id] == DEFAULT_STATE_PACKED)
+            packed_count++;
+        else if (defaults[id] != DEFAULT_STATE_DENSE) {
+            default_count++;
+            if (depths[id] > max_depth)
+                max_depth = depths[id];
+        }
+#endif
+
+        offsets[id] = offset;
+        offset += size_words;
+        if (offset >= DEFAULT_STATE_PACKED) {
+            free(defaults);
+            return MPM_STATE_MACHINE_LIMIT;
+        }
+    }
+
+    size = sizeof(mpm_default_dfa) + offset * sizeof(mpm_uint32);
+    default_dfa = (mpm_default_dfa *)malloc(size);
+    if (!default_dfa) {
+        free(defaults);
+        return MPM_NO_MEMORY;
+    }
+
+    default_dfa->states = (mpm_uint32 *)(default_dfa + 1);
+    default_dfa->states_size = offset * sizeof(mpm_uint32);
+    for (i = 0; i < 3; i++)
+        default_dfa->start_offsets[i] = offsets[start_states[i]];
+    default_dfa->all_end_states = (re->compile.next_id >= 32) ? 0xffffffff : (((mpm_uint32)1 << re->compile.next_id) - 1);
+    memcpy(default_dfa->char_class, char_class, CHAR_CLASS_TABLE_SIZE);
+
+    for (id = 0; id < state_count; id++) {
+        state_next_states = next_states + id * class_count;
+        state = default_dfa->states + offsets[id];
+        state[DEFAULT_STATE_END_STATES] = end_states[id];
+
+        if (defaults[id] == DEFAULT_STATE_DENSE) {
+            state[DEFAULT_STATE_INFO] = DEFAULT_STATE_DENSE;
+            for (i = 0; i < class_count; i++)
+                state[DEFAULT_STATE_HEADER_SIZE + i] = offsets[state_next_states[i]];
+            continue;
+        }
+
+        if (defaults[id] == DEFAULT_STATE_PACKED) {
+            count = collect_targets(state_next_states, class_count, targets);
+            shift = packed_shift(count);
+            size_words = PACKED_INDEX_WORDS(class_count, shift);
+            state[DEFAULT_STATE_INFO] = (size_words << 26) | (shift << 24) | DEFAULT_STATE_PACKED;
+            memset(state + DEFAULT_STATE_HEADER_SIZE, 0, size_words * sizeof(mpm_uint32));
+
+            for (i = 0; i < class_count; i++) {
+                j = 0;
+                while (targets[j] != state_next_states[i])
+                    j++;
+                bit = i << shift;
+                state[DEFAULT_STATE_HEADER_SIZE + (bit >> 5)] |= j << (bit & 0x1f);
+            }
+
+            next_offsets = state + DEFAULT_STATE_HEADER_SIZE + size_words;
+            for (j = 0; j < count; j++)
+                next_offsets[j] = offsets[targets[j]];
+            continue;
+        }
+
+        count = count_differences(state_next_states, next_states + defaults[id] * class_count, class_count);
+        state[DEFAULT_STATE_INFO] = (count << 24) | offsets[defaults[id]];
+        classes = (mpm_uint8 *)(state + DEFAULT_STATE_HEADER_SIZE);
+        next_offsets = state + DEFAULT_STATE_HEADER_SIZE + ((count + 3) >> 2);
+        memset(classes, 0, ((count + 3) >> 2) * sizeof(mpm_uint32));
+
+        j = 0;
+        for (i = 0; i < class_count; i++) {
+            if (state_next_states[i] != next_states[defaults[id] * class_count + i]) {
+                classes[j] = (mpm_uint8)i;
+                next_offsets[j] = offsets[state_next_states[i]];
+                j++;
+            }
+        }
+    }
+
+    free(defaults);
+
+#if defined MPM_VERBOSE && MPM_VERBOSE
+    if (flags & MPM_COMPILE_VERBOSE_STATS) {
+        printf("  states with default state: %d, packed states: %d, longest default chain: %d\n"
+            "  default transitions: %d bytes instead of %d bytes\n",
+            (int)default_count, (int)packed_count, (int)max_depth, (int)(offset * sizeof(mpm_uint32)),
+            (int)(state_count * DENSE_STATE_SIZE(class_count) * sizeof(mpm_uint32)));
+    }
+#endif
+
+    if (consumed_memory)
+        *consumed_memory = sizeof(mpm_re) + size;
+
+    mpm_private_free_patterns(re->compile.patterns);
+    re->flags = (re->flags & ~RE_MODE_COMPILE) | RE_DEFAULT_TRANSITIONS;
+    re->run.default_dfa = default_dfa;
+    return MPM_NO_ERROR;
+}
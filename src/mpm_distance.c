@@ -24,8 +24,13 @@
 #include "mpm_internal.h"
 
 #define DISTANCE_TRESHOLD 20
+/* Distance of patterns, which have nothing in common. */
+#define NO_DISTANCE -128
+/* Groups with more than 32 patterns use wide end state sets, which reduce
+   the number of state machines, but cannot be interleaved (see mpm_exec4). */
+#define GROUP_SIZE_LIMIT 128
 
-static mpm_uint8 population_count[256] = {
+static const mpm_uint8 population_count[256] = {
     0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
     1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
     1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
@@ -81,7 +86,7 @@ int mpm_distance(mpm_re *re1, mpm_size index1, mpm_re *re2, mpm_size index2)
 
     /* The rate of a pattern */
     if ((pattern1->flags & PATTERN_HAS_REPEAT) != (pattern2->flags & PATTERN_HAS_REPEAT))
-        return -128;
+        return NO_DISTANCE;
 
     /* We choose the smaller string as base to decrease memory consumption.  */
     if (pattern1->term_range_size <= pattern2->term_range_size) {
@@ -310,7 +315,7 @@ static int split_group(int *distance_matrix, mpm_size distance_matrix_size,
             }
         }
 
-    if (no_items <= 32 && max_distance < DISTANCE_TRESHOLD) {
+    if (no_items <= GROUP_SIZE_LIMIT && max_distance < DISTANCE_TRESHOLD) {
         if (no_items <= 2)
             return MPM_NO_ERROR;
 
@@ -383,21 +388,265 @@ static int split_group(int *distance_matrix, mpm_size distance_matrix_size,
 }
 
 #undef DISTANCE_TRESHOLD
+#undef GROUP_SIZE_LIMIT
 #undef DISTANCE
 
-int mpm_clustering(mpm_cluster_item *items, mpm_size no_items, mpm_uint32 flags)
+/* Larger item sets are partitioned by partition_items first, since
+   the distance matrix has no_items * no_items elements. */
+#define DENSE_CLUSTERING_LIMIT 2048
+
+/* MinHash signatures of the patterns: the shingles are the hashes of
+   two consecutive character sets. The signature is divided into bands
+   of SIGNATURE_BAND_SIZE values, and the patterns are put into a bucket
+   for each band. Patterns are likely similar if they share a bucket. */
+#define SIGNATURE_SIZE 8
+#define SIGNATURE_BAND_SIZE 1
+
+static mpm_uint32 hash_char_set(mpm_uint32 *char_set)
 {
-    mpm_size x, y;
-    mpm_uint32 next_index, prev_group;
+    mpm_uint32 hash = 2166136261u;
+    int i;
+
+    for (i = 0; i < CHAR_SET_SIZE; i++)
+        hash = (hash ^ char_set[i]) * 16777619u;
+    return hash;
+}
+
+static void compute_signature(mpm_re_pattern *pattern, mpm_uint32 *signature)
+{
+    mpm_uint32 *word_code = pattern->word_code;
+    mpm_uint32 i, j, shingle, previous, value;
+
+    for (j = 0; j < SIGNATURE_SIZE; j++)
+        signature[j] = 0xffffffff;
+
+    previous = 0;
+    for (i = 0; i < pattern->term_range_size; i++) {
+        shingle = hash_char_set(word_code + word_code[i]);
+        value = previous;
+        previous = shingle;
+        if (i == 0 && pattern->term_range_size > 1)
+            continue;
+        shingle = (shingle ^ (value * 0x9e3779b1u));
+
+        for (j = 0; j < SIGNATURE_SIZE; j++) {
+            value = (shingle ^ (j * 0x85ebca6bu)) * 0xcc9e2d51u;
+            value ^= value >> 15;
+            value *= 0x1b873593u;
+            value ^= value >> 13;
+            if (value < signature[j])
+                signature[j] = value;
+        }
+    }
+}
+
+typedef struct lsh_bucket_item {
+    mpm_uint32 hash;
+    mpm_uint32 index;
+} lsh_bucket_item;
+
+static int compare_bucket_items(const void *a, const void *b)
+{
+    const lsh_bucket_item *item1 = (const lsh_bucket_item *)a;
+    const lsh_bucket_item *item2 = (const lsh_bucket_item *)b;
+
+    if (item1->hash != item2->hash)
+        return item1->hash < item2->hash ? -1 : 1;
+    return item1->index < item2->index ? -1 : (item1->index > item2->index);
+}
+
+/* Only repeating patterns are filtered, since the distance of other
+   patterns depends on their common prefix, which is fast to compute.
+   The candidate pairs of repeating patterns (which share at least one
+   bucket) are marked by 1 in the upper triangle of the distance matrix,
+   and all other elements are set to 0. The buckets of a band are the
+   runs of equal band hashes after sorting. */
+static int mark_lsh_candidates(mpm_cluster_item *items, mpm_size no_items, int *distance_matrix)
+{
+    mpm_uint32 *signatures, *signature;
+    lsh_bucket_item *bucket_items;
+    mpm_size i, j, x, y, first, count;
+    mpm_uint32 hash;
+    int band;
+
+    for (y = 0; y < no_items; y++)
+        for (x = y + 1; x < no_items; x++)
+            distance_matrix[y * no_items + x] = 0;
+
+    signatures = (mpm_uint32 *)malloc(no_items * SIGNATURE_SIZE * sizeof(mpm_uint32));
+    bucket_items = (lsh_bucket_item *)malloc(no_items * sizeof(lsh_bucket_item));
+    if (!signatures || !bucket_items) {
+        if (signatures)
+            free(signatures);
+        if (bucket_items)
+            free(bucket_items);
+        return MPM_NO_MEMORY;
+    }
+
+    for (i = 0; i < no_items; i++)
+        if (items[i].re->compile.patterns->flags & PATTERN_HAS_REPEAT)
+            compute_signature(items[i].re->compile.patterns, signatures + i * SIGNATURE_SIZE);
+
+    for (band = 0; band < SIGNATURE_SIZE; band += SIGNATURE_BAND_SIZE) {
+        count = 0;
+        for (i = 0; i < no_items; i++) {
+            if (!(items[i].re->compile.patterns->flags & PATTERN_HAS_REPEAT))
+                continue;
+            signature = signatures + i * SIGNATURE_SIZE + band;
+            hash = 2166136261u;
+            for (j = 0; j < SIGNATURE_BAND_SIZE; j++)
+                hash = (hash ^ signature[j]) * 16777619u;
+            bucket_items[count].hash = hash;
+            bucket_items[count].index = i;
+            count++;
+        }
+
+        qsort(bucket_items, count, sizeof(lsh_bucket_item), compare_bucket_items);
+
+        /* The indices are increasing in each bucket. */
+        for (first = 0; first < count; first = i) {
+            for (i = first + 1; i < count && bucket_items[i].hash == bucket_items[first].hash; i++)
+                for (j = first; j < i; j++)
+                    distance_matrix[bucket_items[j].index * no_items + bucket_items[i].index] = 1;
+        }
+    }
+
+    free(signatures);
+    free(bucket_items);
+    return MPM_NO_ERROR;
+}
+
+typedef struct distance_rows {
+    mpm_cluster_item *items;
     int *distance_matrix;
     int *rate_vector;
-    int distance, return_value;
+    mpm_size no_items;
+    /* Rows first_row, first_row + row_step, ... are computed. */
+    mpm_size first_row;
+    mpm_size row_step;
+    int return_value;
+    mpm_uint32 flags;
+} distance_rows;
+
+/* Computes the upper triangle of the selected rows. Since each element
+   is computed independently, the result does not depend on the number
+   of threads. Interleaved rows give each thread similar work. */
+static void * compute_distance_rows(void *arg)
+{
+    distance_rows *rows = (distance_rows *)arg;
+    mpm_cluster_item *items = rows->items;
+    int *rate_vector = rows->rate_vector;
+    int *distance_matrix = rows->distance_matrix;
+    mpm_size no_items = rows->no_items;
+    mpm_size x, y;
+    int distance;
 #if defined MPM_VERBOSE && MPM_VERBOSE
     mpm_size count = 0, max = 0;
+
+    if (rows->flags & MPM_CLUSTERING_VERBOSE) {
+        max = ((no_items * (no_items - 1)) / 2) >> 10;
+        printf("Generate distance matrix: 0%%");
+        fflush(stdout);
+    }
 #endif
 
-    if (!items || no_items <= 0 || no_items > 65535)
-        return MPM_INVALID_ARGS;
+    for (y = rows->first_row; y < no_items; y += rows->row_step) {
+        for (x = y + 1; x < no_items; x++) {
+            /* Repeating patterns outside of a common bucket are not compared. */
+            if ((rows->flags & MPM_CLUSTERING_LSH) && !distance_matrix[y * no_items + x]
+                    && (items[x].re->compile.patterns->flags & items[y].re->compile.patterns->flags & PATTERN_HAS_REPEAT))
+                distance = NO_DISTANCE;
+            else
+                distance = mpm_distance(items[x].re, 0, items[y].re, 0);
+            if (distance > 0) {
+                rows->return_value = distance;
+                return NULL;
+            }
+            distance_matrix[y * no_items + x] = (-distance) * rate_vector[x] * rate_vector[y];
+#if defined MPM_VERBOSE && MPM_VERBOSE
+            if (rows->flags & MPM_CLUSTERING_VERBOSE) {
+                count++;
+                if (!(count & 0x3ff)) {
+                    printf("\rGenerate distance matrix: %d%%", (int)((count >> 10) * 100 / max));
+                    fflush(stdout);
+                }
+            }
+#endif
+        }
+    }
+    return NULL;
+}
+
+static int compute_distance_matrix(mpm_cluster_item *items, mpm_size no_items,
+    int *distance_matrix, int *rate_vector, mpm_uint32 flags)
+{
+    distance_rows rows[MAX_THREADS];
+#if defined MPM_THREADS && MPM_THREADS
+    pthread_t threads[MAX_THREADS];
+    int started[MAX_THREADS];
+#endif
+    mpm_size no_threads, i, x, y;
+    int return_value;
+
+    if (flags & MPM_CLUSTERING_LSH) {
+        return_value = mark_lsh_candidates(items, no_items, distance_matrix);
+        if (return_value != MPM_NO_ERROR)
+            return return_value;
+    }
+
+    no_threads = GET_THREADS(flags);
+    if (no_threads < 1 || no_items < 64)
+        no_threads = 1;
+    if (no_threads > no_items)
+        no_threads = no_items;
+
+    for (i = 0; i < no_threads; i++) {
+        rows[i].items = items;
+        rows[i].distance_matrix = distance_matrix;
+        rows[i].rate_vector = rate_vector;
+        rows[i].no_items = no_items;
+        rows[i].first_row = i;
+        rows[i].row_step = no_threads;
+        rows[i].return_value = MPM_NO_ERROR;
+        /* Progress is only displayed by the single threaded version. */
+        rows[i].flags = no_threads == 1 ? flags : (flags & ~MPM_CLUSTERING_VERBOSE);
+    }
+
+#if defined MPM_THREADS && MPM_THREADS
+    for (i = 1; i < no_threads; i++)
+        started[i] = pthread_create(threads + i, NULL, compute_distance_rows, rows + i) == 0;
+    compute_distance_rows(rows);
+    for (i = 1; i < no_threads; i++) {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        else
+            compute_distance_rows(rows + i);
+    }
+#else
+    for (i = 0; i < no_threads; i++)
+        compute_distance_rows(rows + i);
+#endif
+
+    for (i = 0; i < no_threads; i++)
+        if (rows[i].return_value != MPM_NO_ERROR)
+            return rows[i].return_value;
+
+    for (y = 0; y < no_items; y++) {
+        items[y].group_id = y;
+        distance_matrix[y * no_items + y] = 0;
+        for (x = 0; x < y; x++)
+            distance_matrix[y * no_items + x] = distance_matrix[x * no_items + y];
+    }
+    return MPM_NO_ERROR;
+}
+
+static int cluster_dense(mpm_cluster_item *items, mpm_size no_items, mpm_uint32 *next_group_id, mpm_uint32 flags)
+{
+    mpm_size x;
+    mpm_uint32 next_index, prev_group;
+    int *distance_matrix;
+    int *rate_vector;
+    int return_value;
 
     rate_vector = (int *)malloc(no_items * sizeof(int));
     if (!rate_vector)
@@ -414,52 +663,15 @@ int mpm_clustering(mpm_cluster_item *items, mpm_size no_items, mpm_uint32 flags)
         printf("Rating patterns\n");
 #endif
 
-    for (x = 0; x < no_items; x++) {
-        y = !(items[x].re->flags & RE_MODE_COMPILE);
-        if (y || items[x].re->compile.next_id != 1) {
-            free(distance_matrix);
-            free(rate_vector);
-            return y ? MPM_RE_ALREADY_COMPILED : MPM_INVALID_ARGS;
-        }
+    for (x = 0; x < no_items; x++)
         rate_vector[x] = mpm_private_rating(items[x].re->compile.patterns);
-    }
-
-#if defined MPM_VERBOSE && MPM_VERBOSE
-    if (flags & MPM_CLUSTERING_VERBOSE) {
-        max = ((no_items * (no_items - 1)) / 2) >> 10;
-        printf("Generate distance matrix: 0%%");
-        fflush(stdout);
-    }
-#endif
-
-    for (y = 0; y < no_items; y++) {
-        items[y].group_id = y;
-        for (x = 0; x < no_items; x++) {
-             if (y < x) {
-                 distance = mpm_distance(items[x].re, 0, items[y].re, 0);
-                 if (distance > 0) {
-                     free(distance_matrix);
-                     free(rate_vector);
-                     return distance;
-                 }
-                 distance_matrix[y * no_items + x] = (-distance) * rate_vector[x] * rate_vector[y];
-#if defined MPM_VERBOSE && MPM_VERBOSE
-                 if (flags & MPM_CLUSTERING_VERBOSE) {
-                     count++;
-                     if (!(count & 0x3ff)) {
-                         printf("\rGenerate distance matrix: %d%%", (int)((count >> 10) * 100 / max));
-                         fflush(stdout);
-                     }
-                 }
-#endif
-             } else if (y > x)
-                 distance_matrix[y * no_items + x] = distance_matrix[x * no_items + y];
-             else
-                 distance_matrix[y * no_items + x] = 0;
-        }
-    }
 
+    return_value = compute_distance_matrix(items, no_items, distance_matrix, rate_vector, flags);
     free(rate_vector);
+    if (return_value != MPM_NO_ERROR) {
+        free(distance_matrix);
+        return return_value;
+    }
 
 #if defined MPM_VERBOSE && MPM_VERBOSE
     if (flags & MPM_CLUSTERING_VERBOSE)
@@ -472,7 +684,7 @@ int mpm_clustering(mpm_cluster_item *items, mpm_size no_items, mpm_uint32 flags)
         return return_value;
     }
 
-    next_index = 0;
+    next_index = *next_group_id;
     prev_group = items[0].group_id & ~0xffff;
     while (no_items--) {
         if ((items[0].group_id & ~0xffff) != prev_group) {
@@ -482,12 +694,153 @@ int mpm_clustering(mpm_cluster_item *items, mpm_size no_items, mpm_uint32 flags)
             items[0].group_id = next_index;
         items++;
     }
+    *next_group_id = next_index + 1;
+
+    free(distance_matrix);
+    return MPM_NO_ERROR;
+}
+
+/* The rate of the items is stored in their group_id during partitioning. */
+static int pivot_distance(mpm_cluster_item *item, mpm_cluster_item *pivot, int *distance)
+{
+    int return_value;
+
+    if (item->re == pivot->re) {
+        *distance = 0;
+        return MPM_NO_ERROR;
+    }
+
+    return_value = mpm_distance(item->re, 0, pivot->re, 0);
+    if (return_value > 0)
+        return return_value;
+    *distance = (-return_value) * (int)item->group_id * (int)pivot->group_id;
+    return MPM_NO_ERROR;
+}
+
+static int find_farthest(mpm_cluster_item *items, mpm_size no_items, mpm_cluster_item *pivot, mpm_cluster_item *result)
+{
+    mpm_size i;
+    int distance, max_distance, return_value;
+
+    *result = items[0];
+    max_distance = -1;
+    for (i = 0; i < no_items; i++) {
+        if ((return_value = pivot_distance(items + i, pivot, &distance)) != MPM_NO_ERROR)
+            return return_value;
+        if (distance > max_distance) {
+            max_distance = distance;
+            *result = items[i];
+        }
+    }
+    return MPM_NO_ERROR;
+}
+
+/* Splits the items into two parts around two distant pivots until the
+   parts are small enough for cluster_dense. Each split needs only
+   3 * no_items distance computations and no extra memory. */
+static int partition_items(mpm_cluster_item *items, mpm_size no_items, mpm_uint32 *next_group_id, mpm_uint32 flags)
+{
+    mpm_size left, right;
+    mpm_cluster_item left_pivot, right_pivot, item;
+    int even, distance_left, distance_right, return_value;
+
+    while (no_items > DENSE_CLUSTERING_LIMIT) {
+        if ((return_value = find_farthest(items, no_items, items, &left_pivot)) != MPM_NO_ERROR)
+            return return_value;
+        if ((return_value = find_farthest(items, no_items, &left_pivot, &right_pivot)) != MPM_NO_ERROR)
+            return return_value;
+
+        left = 0;
+        right = no_items;
+        even = 1;
+        while (left < right) {
+            if ((return_value = pivot_distance(items + left, &left_pivot, &distance_left)) != MPM_NO_ERROR)
+                return return_value;
+            if ((return_value = pivot_distance(items + left, &right_pivot, &distance_right)) != MPM_NO_ERROR)
+                return return_value;
+
+            if ((distance_left < distance_right) || (distance_left == distance_right && even))
+                left++;
+            else {
+                right--;
+                item = items[right];
+                items[right] = items[left];
+                items[left] = item;
+            }
+            even ^= 1;
+        }
+
+        /* Happens when all items have the same distance. */
+        if (left == 0 || left == no_items)
+            left = no_items >> 1;
 
+        /* Only the smaller part is processed recursively. */
+        if (left < no_items - left) {
+            if ((return_value = partition_items(items, left, next_group_id, flags)) != MPM_NO_ERROR)
+                return return_value;
+            items += left;
+            no_items -= left;
+        } else {
+            if ((return_value = partition_items(items + left, no_items - left, next_group_id, flags)) != MPM_NO_ERROR)
+                return return_value;
+            no_items = left;
+        }
+    }
+
+    return cluster_dense(items, no_items, next_group_id, flags & ~MPM_CLUSTERING_VERBOSE);
+}
+
+int mpm_clustering(mpm_cluster_item *items, mpm_size no_items, mpm_uint32 flags)
+{
+    mpm_size x;
+    mpm_uint32 next_group_id, prev_group;
+    int return_value;
+
+    if (!items || no_items <= 0)
+        return MPM_INVALID_ARGS;
+
+    for (x = 0; x < no_items; x++) {
+        if (!(items[x].re->flags & RE_MODE_COMPILE))
+            return MPM_RE_ALREADY_COMPILED;
+        if (items[x].re->compile.next_id != 1)
+            return MPM_INVALID_ARGS;
+    }
+
+    next_group_id = 0;
+    if (no_items <= DENSE_CLUSTERING_LIMIT)
+        return_value = cluster_dense(items, no_items, &next_group_id, flags);
+    else {
 #if defined MPM_VERBOSE && MPM_VERBOSE
-    if (flags & MPM_CLUSTERING_VERBOSE)
+        if (flags & MPM_CLUSTERING_VERBOSE)
+            printf("Partitioning %d patterns\n", (int)no_items);
+#endif
+
+        for (x = 0; x < no_items; x++)
+            items[x].group_id = mpm_private_rating(items[x].re->compile.patterns);
+        return_value = partition_items(items, no_items, &next_group_id, flags);
+
+        /* The parts are not clustered in their order. */
+        if (return_value == MPM_NO_ERROR) {
+            next_group_id = 0;
+            prev_group = items[0].group_id;
+            for (x = 0; x < no_items; x++) {
+                if (items[x].group_id != prev_group) {
+                    prev_group = items[x].group_id;
+                    next_group_id++;
+                }
+                items[x].group_id = next_group_id;
+            }
+        }
+    }
+
+#if defined MPM_VERBOSE && MPM_VERBOSE
+    if (return_value == MPM_NO_ERROR && (flags & MPM_CLUSTERING_VERBOSE))
         printf("Clustering is done\n");
 #endif
 
-    free(distance_matrix);
-    return MPM_NO_ERROR;
+    return return_value;
 }
+
+#undef DENSE_CLUSTERING_LIMIT
+#undef SIGNATURE_SIZE
+#undef SIGNATURE_BAND_SIZE
@@ -23,6 +23,13 @@
 
 #include "mpm_internal.h"
 
+#if defined __SSE2__ && defined __GNUC__
+#include <emmintrin.h>
+#define SKIP_USE_SSE2 1
+#else
+#define SKIP_USE_SSE2 0
+#endif
+
 /* ----------------------------------------------------------------------- */
 /*                           NFA generator functions.                      */
 /* ----------------------------------------------------------------------- */
@@ -30,97 +37,714 @@
 #define GET_END_STATES(map) \
     (((mpm_uint32*)(map))[-1])
 
-#define GET_NEXT_OFFSET(map, offset, index) \
-    (((int32_t*)((map) + (offset)))[index])
+/* The index is STATE_MAP_INDEX of the relative offset. The offset_type
+   is selected by RE_OFFSET_MASK: int8_t, int16_t or int32_t. */
+#define GET_NEXT_OFFSET(map, index, offset_type) \
+    (((offset_type*)((map) - sizeof(mpm_uint32) - 256 * sizeof(offset_type)))[index])
 
 #define NEXT_STATE_MAP(map, offset) \
     ((map) + (offset))
 
-int mpm_exec(mpm_re *re, mpm_char8 *subject, mpm_size length, mpm_size offset, mpm_uint32 *result)
+/* The states are stored after the character class table. */
+#define STATE_MAP_BASE(re) \
+    ((re)->run.compiled_pattern + CHAR_CLASS_TABLE_SIZE)
+
+/* The matchers check whether they can stop early after each block. */
+#define EXEC_BLOCK_SIZE 256
+
+/* No more end states can be reached, so the matching can be stopped. */
+#define IS_FINISHED(map, result, absorbing_map, all_end_states) \
+    ((map) >= (absorbing_map) || ((result) | GET_END_STATES(map)) == (all_end_states))
+
+#define EXEC_SINGLE_LOOP(ABSORBING_CHECK, SKIP_CHECK, OFFSET_TYPE) \
+    do { \
+        /* The squence is optimized for performance. */ \
+        current_class = char_class[*(mpm_uint8 *)subject]; \
+        next_offset = state_map[current_class]; \
+        SKIP_CHECK \
+        end_states = GET_END_STATES(state_map); \
+        next_offset = GET_NEXT_OFFSET(state_map, next_offset, OFFSET_TYPE); \
+        subject++; \
+        current_result |= end_states; \
+        state_map = NEXT_STATE_MAP(state_map, next_offset); \
+        ABSORBING_CHECK \
+    } while (--block_length);
+
+#define CHECK_ABSORBING \
+        if (state_map >= absorbing_state_map) \
+            break;
+
+/* The scan is started only if the current character does not leave the start
+   state. The remaining part of the subject is scanned, but the block boundaries
+   are kept, so IS_FINISHED is still checked regularly. The start state has no
+   end states, since patterns which match the empty string are rejected. */
+#define CHECK_START_STATE \
+        if (state_map == skip_state_map && next_offset == skip_index) { \
+            block_end = subject + block_length; \
+            subject = skip_start_state(re, subject, subject_end); \
+            if (subject >= block_end) { \
+                length = subject_end - subject; \
+                if (length == 0) \
+                    break; \
+                block_length = length > EXEC_BLOCK_SIZE ? EXEC_BLOCK_SIZE : length; \
+                length -= block_length; \
+            } else \
+                block_length = block_end - subject; \
+            current_class = char_class[*(mpm_uint8 *)subject]; \
+            next_offset = state_map[current_class]; \
+        }
+
+#define NO_CHECK
+
+/* All combinations of the matcher flags for an offset size. */
+#define EXEC_SINGLE_CASES(OFFSET_FLAG, OFFSET_TYPE) \
+        case (OFFSET_FLAG): \
+            EXEC_SINGLE_LOOP(NO_CHECK, NO_CHECK, OFFSET_TYPE); \
+            break; \
+        case (OFFSET_FLAG) | RE_HAS_ABSORBING_STATE: \
+            EXEC_SINGLE_LOOP(CHECK_ABSORBING, NO_CHECK, OFFSET_TYPE); \
+            break; \
+        case (OFFSET_FLAG) | RE_SKIP_START_STATE: \
+            EXEC_SINGLE_LOOP(NO_CHECK, CHECK_START_STATE, OFFSET_TYPE); \
+            break; \
+        case (OFFSET_FLAG) | RE_HAS_ABSORBING_STATE | RE_SKIP_START_STATE: \
+            EXEC_SINGLE_LOOP(CHECK_ABSORBING, CHECK_START_STATE, OFFSET_TYPE); \
+            break;
+
+/* Returns with the first character, which leaves the non-newline start state. */
+static mpm_char8 * skip_start_state(mpm_re *re, mpm_char8 *subject, mpm_char8 *subject_end)
 {
-    mpm_uint32 current_character;
     mpm_uint8 *state_map;
+    mpm_uint8 *char_class;
+    mpm_uint8 skip_index;
+
+    if (re->run.skip_char_count == 1) {
+        subject = (mpm_char8 *)memchr(subject, re->run.skip_chars[0], subject_end - subject);
+        return subject ? subject : subject_end;
+    }
+
+#if SKIP_USE_SSE2
+    {
+        __m128i char0 = _mm_set1_epi8((char)re->run.skip_chars[0]);
+        __m128i char1 = _mm_set1_epi8((char)re->run.skip_chars[1]);
+        __m128i char2 = _mm_set1_epi8((char)re->run.skip_chars[2]);
+        __m128i char3 = _mm_set1_epi8((char)re->run.skip_chars[3]);
+        __m128i char4 = _mm_set1_epi8((char)re->run.skip_chars[4]);
+        __m128i char5 = _mm_set1_epi8((char)re->run.skip_chars[5]);
+        __m128i char6 = _mm_set1_epi8((char)re->run.skip_chars[6]);
+        __m128i char7 = _mm_set1_epi8((char)re->run.skip_chars[7]);
+        __m128i data;
+        int mask;
+
+        while (subject + 16 <= subject_end) {
+            data = _mm_loadu_si128((__m128i *)subject);
+            mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(data, char0), _mm_cmpeq_epi8(data, char1)),
+                _mm_or_si128(_mm_cmpeq_epi8(data, char2), _mm_cmpeq_epi8(data, char3))), _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(data, char4), _mm_cmpeq_epi8(data, char5)),
+                _mm_or_si128(_mm_cmpeq_epi8(data, char6), _mm_cmpeq_epi8(data, char7)))));
+            if (mask)
+                return subject + __builtin_ctz(mask);
+            subject += 16;
+        }
+    }
+#endif
+
+    /* Remaining characters (or no SSE2 support). The loads
+       of the table scan do not depend on each other. */
+    state_map = STATE_MAP_BASE(re) + re->run.non_newline_offset;
+    char_class = re->run.compiled_pattern;
+    skip_index = re->run.skip_index;
+    while (subject < subject_end) {
+        if (state_map[char_class[*(mpm_uint8 *)subject]] != skip_index)
+            break;
+        subject++;
+    }
+    return subject;
+}
+
+/* Runs the state machine from state_map, and returns with the last state.
+   The end states of the last state are not added to the result. */
+static mpm_uint8 * exec_single(mpm_re *re, mpm_uint8 *state_map, mpm_char8 *subject, mpm_size length, mpm_uint32 *result)
+{
+    mpm_uint8 *char_class;
+    mpm_uint32 current_class;
     int32_t next_offset;
     mpm_uint32 current_result;
     mpm_uint32 end_states;
+    mpm_uint8 *absorbing_state_map;
+    mpm_uint8 *skip_state_map;
+    mpm_char8 *subject_end, *block_end;
+    mpm_uint32 all_end_states;
+    int32_t skip_index;
+    mpm_size block_length;
+
+    current_result = *result;
+    char_class = re->run.compiled_pattern;
+    absorbing_state_map = STATE_MAP_BASE(re) + re->run.absorbing_offset;
+    skip_state_map = STATE_MAP_BASE(re) + re->run.non_newline_offset;
+    subject_end = subject + length;
+    skip_index = re->run.skip_index;
+    all_end_states = re->run.all_end_states;
+
+    do {
+        block_length = length > EXEC_BLOCK_SIZE ? EXEC_BLOCK_SIZE : length;
+        length -= block_length;
+
+        switch (re->flags & (RE_HAS_ABSORBING_STATE | RE_SKIP_START_STATE | RE_OFFSET_MASK)) {
+        EXEC_SINGLE_CASES(RE_OFFSET_8, int8_t)
+        EXEC_SINGLE_CASES(RE_OFFSET_16, int16_t)
+        EXEC_SINGLE_CASES(0, int32_t)
+        }
+
+        if (IS_FINISHED(state_map, current_result, absorbing_state_map, all_end_states))
+            break;
+    } while (length > 0);
+
+    *result = current_result;
+    return state_map;
+}
+
+static mpm_uint8 * start_state_map(mpm_re *re, mpm_char8 *subject, mpm_size offset)
+{
+    /* Subject must point to the starting position. */
+    mpm_uint8 *state_map = STATE_MAP_BASE(re);
+    if (offset == 0)
+        return state_map + re->run.start_offset;
+    if (subject[-1] == '\n' || subject[-1] == '\r')
+        return state_map + re->run.newline_offset;
+    return state_map + re->run.non_newline_offset;
+}
+
+/* ----------------------------------------------------------------------- */
+/*                           Wide end state sets.                          */
+/* ----------------------------------------------------------------------- */
+
+static void add_end_state_set(mpm_uint32 *result, mpm_uint32 *end_state_set, mpm_uint32 length)
+{
+    do {
+        *result++ |= *end_state_set++;
+    } while (--length);
+}
+
+static int wide_result_is_full(mpm_re *re, mpm_uint32 *result)
+{
+    mpm_uint32 last = re->run.end_state_set_length - 1;
+    mpm_uint32 i;
+
+    for (i = 0; i < last; i++)
+        if (result[i] != 0xffffffff)
+            return 0;
+    return result[last] == re->run.all_end_states;
+}
+
+/* Same as EXEC_SINGLE_LOOP, except the end state word is the offset of
+   an end state set, which is only added when an accepting state is left. */
+#define EXEC_WIDE_LOOP(SKIP_CHECK, OFFSET_TYPE) \
+    do { \
+        current_class = char_class[*(mpm_uint8 *)subject]; \
+        next_offset = state_map[current_class]; \
+        SKIP_CHECK \
+        end_states = GET_END_STATES(state_map); \
+        next_offset = GET_NEXT_OFFSET(state_map, next_offset, OFFSET_TYPE); \
+        subject++; \
+        if (end_states) \
+            add_end_state_set(result, end_state_sets + end_states, end_state_set_length); \
+        state_map = NEXT_STATE_MAP(state_map, next_offset); \
+        CHECK_ABSORBING \
+    } while (--block_length);
+
+#define EXEC_WIDE_CASES(OFFSET_FLAG, OFFSET_TYPE) \
+        case (OFFSET_FLAG): \
+            EXEC_WIDE_LOOP(NO_CHECK, OFFSET_TYPE); \
+            break; \
+        case (OFFSET_FLAG) | RE_SKIP_START_STATE: \
+            EXEC_WIDE_LOOP(CHECK_START_STATE, OFFSET_TYPE); \
+            break;
+
+/* Same as exec_single for state machines with wide end state sets. The result
+   buffer has end_state_set_length words. Absorbing states are always checked,
+   since the check is cheap compared to the other work. */
+static mpm_uint8 * exec_wide(mpm_re *re, mpm_uint8 *state_map, mpm_char8 *subject, mpm_size length, mpm_uint32 *result)
+{
+    mpm_uint8 *char_class;
+    mpm_uint32 current_class;
+    int32_t next_offset;
+    mpm_uint32 end_states;
+    mpm_uint32 *end_state_sets;
+    mpm_uint32 end_state_set_length;
+    mpm_uint8 *absorbing_state_map;
+    mpm_uint8 *skip_state_map;
+    mpm_char8 *subject_end, *block_end;
+    int32_t skip_index;
+    mpm_size block_length;
+
+    char_class = re->run.compiled_pattern;
+    end_state_sets = re->run.end_state_sets;
+    end_state_set_length = re->run.end_state_set_length;
+    absorbing_state_map = STATE_MAP_BASE(re) + re->run.absorbing_offset;
+    skip_state_map = STATE_MAP_BASE(re) + re->run.non_newline_offset;
+    subject_end = subject + length;
+    skip_index = re->run.skip_index;
+
+    do {
+        block_length = length > EXEC_BLOCK_SIZE ? EXEC_BLOCK_SIZE : length;
+        length -= block_length;
+
+        switch (re->flags & (RE_SKIP_START_STATE | RE_OFFSET_MASK)) {
+        EXEC_WIDE_CASES(RE_OFFSET_8, int8_t)
+        EXEC_WIDE_CASES(RE_OFFSET_16, int16_t)
+        EXEC_WIDE_CASES(0, int32_t)
+        }
+
+        if (state_map >= absorbing_state_map || wide_result_is_full(re, result))
+            break;
+    } while (length > 0);
+
+    return state_map;
+}
+
+/* ----------------------------------------------------------------------- */
+/*                           Lazy state machines.                          */
+/* ----------------------------------------------------------------------- */
+
+static mpm_lazy_state * lazy_start_state(mpm_re *re, mpm_char8 *subject, mpm_size offset)
+{
+    /* Subject must point to the starting position. */
+    if (offset == 0)
+        return mpm_private_lazy_start_state(re->run.lazy_dfa, START_AT_BEGIN);
+    if (subject[-1] == '\n' || subject[-1] == '\r')
+        return mpm_private_lazy_start_state(re->run.lazy_dfa, START_AFTER_NEWLINE);
+    return mpm_private_lazy_start_state(re->run.lazy_dfa, START_AFTER_NON_NEWLINE);
+}
+
+/* Same as exec_single, except the missing transitions are computed on demand. */
+static mpm_uint32 exec_lazy(mpm_re *re, mpm_char8 *subject, mpm_size length, mpm_size offset)
+{
+    mpm_lazy_dfa *lazy_dfa = re->run.lazy_dfa;
+    mpm_uint8 *char_class = lazy_dfa->char_class;
+    mpm_lazy_state *state, *next_state;
+    mpm_uint32 current_class;
+    mpm_uint32 current_result = 0;
+    mpm_uint32 all_end_states = lazy_dfa->all_end_states;
+    mpm_size block_length;
+
+    state = lazy_start_state(re, subject, offset);
+
+    do {
+        block_length = length > EXEC_BLOCK_SIZE ? EXEC_BLOCK_SIZE : length;
+        length -= block_length;
+
+        do {
+            current_class = char_class[*(mpm_uint8 *)subject];
+            next_state = state->next_state[current_class];
+            current_result |= state->end_states;
+            if (!next_state)
+                next_state = mpm_private_lazy_next_state(lazy_dfa, state, current_class);
+            state = next_state;
+            subject++;
+        } while (--block_length);
+
+        if ((current_result | state->end_states) == all_end_states)
+            break;
+    } while (length > 0);
+
+    return current_result | state->end_states;
+}
+
+/* ----------------------------------------------------------------------- */
+/*                          Bit parallel matching.                         */
+/* ----------------------------------------------------------------------- */
+
+static void bit_parallel_start_terms(mpm_re *re, mpm_char8 *subject, mpm_size offset, mpm_uint32 *active_terms)
+{
+    /* Subject must point to the starting position. */
+    mpm_uint32 start_type = START_AFTER_NON_NEWLINE;
+    if (offset == 0)
+        start_type = START_AT_BEGIN;
+    else if (subject[-1] == '\n' || subject[-1] == '\r')
+        start_type = START_AFTER_NEWLINE;
+    memcpy(active_terms, re->run.bit_parallel->start_sets + start_type * BIT_PARALLEL_MAX_WORDS,
+        BIT_PARALLEL_MAX_WORDS * sizeof(mpm_uint32));
+}
+
+/* Computes the active terms after current_char, and returns with the reached end states. */
+static mpm_uint32 bit_parallel_step(mpm_bit_parallel *bit_parallel, mpm_uint32 *active_terms, mpm_uint32 current_char)
+{
+    mpm_uint32 term_set_length = bit_parallel->term_set_length;
+    mpm_uint32 record_length = term_set_length + 1;
+    mpm_uint32 *class_terms = bit_parallel->class_terms + bit_parallel->char_class[current_char] * term_set_length;
+    mpm_uint32 *start_terms = bit_parallel->start_sets + START_AFTER_NON_NEWLINE * BIT_PARALLEL_MAX_WORDS;
+    mpm_uint32 *follow, *record;
+    mpm_uint32 matching_terms[BIT_PARALLEL_MAX_WORDS];
+    mpm_uint32 end_states = 0;
+    mpm_uint32 i, j, bits;
+
+    for (i = 0; i < term_set_length; i++) {
+        matching_terms[i] = active_terms[i] & class_terms[i];
+        active_terms[i] = start_terms[i];
+    }
+
+    for (i = 0; i < term_set_length; i++) {
+        bits = matching_terms[i];
+        /* Four chunks for each word. */
+        follow = bit_parallel->follow + ((i << 2) << 8) * record_length;
+        while (bits) {
+            if (bits & 0xff) {
+                record = follow + (bits & 0xff) * record_length;
+                for (j = 0; j < term_set_length; j++)
+                    active_terms[j] |= record[j];
+                end_states |= record[term_set_length];
+            }
+            bits >>= 8;
+            follow += 256 * record_length;
+        }
+    }
+    return end_states;
+}
+
+/* Same as bit_parallel_step, except the active terms are kept in a register. */
+static mpm_uint32 exec_bit_parallel_word(mpm_bit_parallel *bit_parallel, mpm_char8 *subject, mpm_size length, mpm_uint32 active_terms)
+{
+    mpm_uint8 *char_class = bit_parallel->char_class;
+    mpm_uint32 *class_terms = bit_parallel->class_terms;
+    mpm_uint32 *follow;
+    mpm_uint32 *record;
+    mpm_uint32 start_terms = bit_parallel->start_sets[START_AFTER_NON_NEWLINE * BIT_PARALLEL_MAX_WORDS];
+    mpm_uint32 current_result = 0;
+    mpm_uint32 all_end_states = bit_parallel->all_end_states;
+    mpm_uint32 matching_terms;
+    mpm_size block_length;
+
+    do {
+        block_length = length > EXEC_BLOCK_SIZE ? EXEC_BLOCK_SIZE : length;
+        length -= block_length;
+
+        do {
+            matching_terms = active_terms & class_terms[char_class[*(mpm_uint8 *)subject]];
+            active_terms = start_terms;
+            follow = bit_parallel->follow;
+            while (matching_terms) {
+                record = follow + ((matching_terms & 0xff) << 1);
+                active_terms |= record[0];
+                current_result |= record[1];
+                matching_terms >>= 8;
+                follow += 256 * 2;
+            }
+            subject++;
+        } while (--block_length);
+
+        if (current_result == all_end_states)
+            break;
+    } while (length > 0);
+
+    return current_result;
+}
+
+static mpm_uint32 exec_bit_parallel(mpm_re *re, mpm_char8 *subject, mpm_size length, mpm_size offset)
+{
+    mpm_bit_parallel *bit_parallel = re->run.bit_parallel;
+    mpm_uint32 active_terms[BIT_PARALLEL_MAX_WORDS];
+    mpm_uint32 current_result = 0;
+    mpm_uint32 all_end_states = bit_parallel->all_end_states;
+    mpm_size block_length;
+
+    bit_parallel_start_terms(re, subject, offset, active_terms);
+
+    if (bit_parallel->term_set_length == 1)
+        return exec_bit_parallel_word(bit_parallel, subject, length, active_terms[0]);
+
+    do {
+        block_length = length > EXEC_BLOCK_SIZE ? EXEC_BLOCK_SIZE : length;
+        length -= block_length;
+
+        do {
+            current_result |= bit_parallel_step(bit_parallel, active_terms, *(mpm_uint8 *)subject);
+            subject++;
+        } while (--block_length);
+
+        if (current_result == all_end_states)
+            break;
+    } while (length > 0);
+
+    return current_result;
+}
+
+/* ----------------------------------------------------------------------- */
+/*                           Default transitions.                          */
+/* ----------------------------------------------------------------------- */
+
+static mpm_uint32 * default_start_state(mpm_re *re, mpm_char8 *subject, mpm_size offset)
+{
+    mpm_default_dfa *default_dfa = re->run.default_dfa;
+
+    /* Subject must point to the starting position. */
+    if (offset == 0)
+        return default_dfa->states + default_dfa->start_offsets[START_AT_BEGIN];
+    if (subject[-1] == '\n' || subject[-1] == '\r')
+        return default_dfa->states + default_dfa->start_offsets[START_AFTER_NEWLINE];
+    return default_dfa->states + default_dfa->start_offsets[START_AFTER_NON_NEWLINE];
+}
+
+/* The default states are visited until the transition is found. The
+   length of the chain is limited by DEFAULT_TRANSITION_MAX_HOPS. */
+static mpm_uint32 * default_next_state(mpm_uint32 *states, mpm_uint32 *state, mpm_uint32 current_class)
+{
+    mpm_uint32 info = state[DEFAULT_STATE_INFO];
+    mpm_uint8 *classes;
+    mpm_uint32 count, bit, i;
+
+    while (1) {
+        if (DEFAULT_STATE_OFFSET(info) == DEFAULT_STATE_DENSE)
+            return states + state[DEFAULT_STATE_HEADER_SIZE + current_class];
+
+        if (DEFAULT_STATE_OFFSET(info) == DEFAULT_STATE_PACKED) {
+            bit = current_class << DEFAULT_PACKED_SHIFT(info);
+            i = (state[DEFAULT_STATE_HEADER_SIZE + (bit >> 5)] >> (bit & 0x1f))
+                & ((1 << (1 << DEFAULT_PACKED_SHIFT(info))) - 1);
+            return states + state[DEFAULT_STATE_HEADER_SIZE + DEFAULT_PACKED_WORDS(info) + i];
+        }
+
+        count = DEFAULT_STATE_COUNT(info);
+        classes = (mpm_uint8 *)(state + DEFAULT_STATE_HEADER_SIZE);
+        for (i = 0; i < count; i++)
+            if (classes[i] == current_class)
+                return states + state[DEFAULT_STATE_HEADER_SIZE + ((count + 3) >> 2) + i];
+        state = states + DEFAULT_STATE_OFFSET(info);
+        info = state[DEFAULT_STATE_INFO];
+    }
+}
+
+/* Same as exec_single, except the transitions may be stored by the default states. */
+static mpm_uint32 exec_default(mpm_re *re, mpm_char8 *subject, mpm_size length, mpm_size offset)
+{
+    mpm_default_dfa *default_dfa = re->run.default_dfa;
+    mpm_uint8 *char_class = default_dfa->char_class;
+    mpm_uint32 *states = default_dfa->states;
+    mpm_uint32 *state;
+    mpm_uint32 current_result = 0;
+    mpm_uint32 all_end_states = default_dfa->all_end_states;
+    mpm_size block_length;
+
+    state = default_start_state(re, subject, offset);
+
+    do {
+        block_length = length > EXEC_BLOCK_SIZE ? EXEC_BLOCK_SIZE : length;
+        length -= block_length;
+
+        do {
+            current_result |= state[DEFAULT_STATE_END_STATES];
+            state = default_next_state(states, state, char_class[*(mpm_uint8 *)subject]);
+            subject++;
+        } while (--block_length);
+
+        if ((current_result | state[DEFAULT_STATE_END_STATES]) == all_end_states)
+            break;
+    } while (length > 0);
+
+    return current_result | state[DEFAULT_STATE_END_STATES];
+}
+
+/* ----------------------------------------------------------------------- */
+/*                             Simple matching.                            */
+/* ----------------------------------------------------------------------- */
+
+int mpm_exec(mpm_re *re, mpm_char8 *subject, mpm_size length, mpm_size offset, mpm_uint32 *result)
+{
+    mpm_uint8 *state_map;
+    mpm_uint32 current_result;
 
     if (re->flags & RE_MODE_COMPILE)
         return MPM_RE_IS_NOT_COMPILED;
 
     length -= offset;
     subject += offset;
+
+    if (re->flags & RE_WIDE_END_STATES) {
+        memset(result, 0, re->run.end_state_set_length * sizeof(mpm_uint32));
+        if (length == 0)
+            return MPM_NO_ERROR;
+        state_map = exec_wide(re, start_state_map(re, subject, offset), subject, length, result);
+        add_end_state_set(result, re->run.end_state_sets + GET_END_STATES(state_map), re->run.end_state_set_length);
+        return MPM_NO_ERROR;
+    }
+
     if (length == 0) {
         result[0] = 0;
         return MPM_NO_ERROR;
     }
 
-    /* Simple matcher. */
-    state_map = re->run.compiled_pattern + sizeof(mpm_uint32);
-    current_result = 0;
-    if (offset > 0) {
-        if (subject[-1] == '\n' || subject[-1] == '\r')
-            state_map += re->run.newline_offset;
-        else
-            state_map += re->run.non_newline_offset;
+    if (re->flags & RE_LAZY) {
+        result[0] = exec_lazy(re, subject, length, offset);
+        return MPM_NO_ERROR;
     }
 
-    if (!(re->flags & RE_CHAR_SET_256)) {
-        do {
-            /* The squence is optimized for performance. */
-            current_character = *(mpm_uint8 *)subject;
-            next_offset = state_map[current_character <= 127 ? current_character : 127];
-            end_states = GET_END_STATES(state_map);
-            next_offset = GET_NEXT_OFFSET(state_map, 128, next_offset);
-            subject++;
-            current_result |= end_states;
-            state_map = NEXT_STATE_MAP(state_map, next_offset);
-        } while (--length);
-    } else {
-        do {
-            /* The squence is optimized for performance. */
-            current_character = *(mpm_uint8 *)subject;
-            next_offset = state_map[current_character];
-            end_states = GET_END_STATES(state_map);
-            next_offset = GET_NEXT_OFFSET(state_map, 256, next_offset);
-            subject++;
-            current_result |= end_states;
-            state_map = NEXT_STATE_MAP(state_map, next_offset);
-        } while (--length);
+    if (re->flags & RE_BIT_PARALLEL) {
+        result[0] = exec_bit_parallel(re, subject, length, offset);
+        return MPM_NO_ERROR;
     }
 
+    if (re->flags & RE_DEFAULT_TRANSITIONS) {
+        result[0] = exec_default(re, subject, length, offset);
+        return MPM_NO_ERROR;
+    }
+
+    /* Simple matcher. */
+    state_map = start_state_map(re, subject, offset);
+    current_result = 0;
+
+    state_map = exec_single(re, state_map, subject, length, &current_result);
+
     result[0] = current_result | GET_END_STATES(state_map);
     return MPM_NO_ERROR;
 }
 
-#define EXEC4_MAIN_LOOP(TEST0, LEN0, TEST1, LEN1, TEST2, LEN2, TEST3, LEN3) \
-    do { \
-        /* The squence is optimized for performance. */ \
-        current_character = *(mpm_uint8 *)subject; \
-        next_offset0 = state_map0[(TEST0)]; \
-        next_offset1 = state_map1[(TEST1)]; \
-        next_offset2 = state_map2[(TEST2)]; \
-        next_offset3 = state_map3[(TEST3)]; \
-        end_states0 = GET_END_STATES(state_map0); \
-        end_states1 = GET_END_STATES(state_map1); \
-        end_states2 = GET_END_STATES(state_map2); \
-        end_states3 = GET_END_STATES(state_map3); \
-        next_offset0 = GET_NEXT_OFFSET(state_map0, (LEN0), next_offset0); \
-        next_offset1 = GET_NEXT_OFFSET(state_map1, (LEN1), next_offset1); \
-        next_offset2 = GET_NEXT_OFFSET(state_map2, (LEN2), next_offset2); \
-        next_offset3 = GET_NEXT_OFFSET(state_map3, (LEN3), next_offset3); \
-        subject++; \
-        current_result0 |= end_states0; \
-        current_result1 |= end_states1; \
-        current_result2 |= end_states2; \
-        current_result3 |= end_states3; \
-        state_map0 = NEXT_STATE_MAP(state_map0, next_offset0); \
-        state_map1 = NEXT_STATE_MAP(state_map1, next_offset1); \
-        state_map2 = NEXT_STATE_MAP(state_map2, next_offset2); \
-        state_map3 = NEXT_STATE_MAP(state_map3, next_offset3); \
-    } while (--length);
+/* ----------------------------------------------------------------------- */
+/*                             Stream matching.                            */
+/* ----------------------------------------------------------------------- */
+
+/* Returns MPM_NO_ERROR if re can be matched by the stream functions. */
+static int stream_supported(mpm_re *re)
+{
+    if (re->flags & RE_MODE_COMPILE)
+        return MPM_RE_IS_NOT_COMPILED;
+
+    /* The current state of a lazy re can be dropped between two segments, and
+       the active terms of a bit parallel re or the wide end state sets do not
+       fit into the stream. Default transitions are not supported either. */
+    if (re->flags & (RE_LAZY | RE_BIT_PARALLEL | RE_WIDE_END_STATES | RE_DEFAULT_TRANSITIONS))
+        return MPM_INVALID_ARGS;
+
+    return MPM_NO_ERROR;
+}
+
+int mpm_stream_begin(mpm_re *re, mpm_stream *stream)
+{
+    int error_code = stream_supported(re);
+
+    if (error_code != MPM_NO_ERROR)
+        return error_code;
+
+    /* Offsets are relative to the first state. */
+    stream->state_offset = re->run.start_offset;
+    stream->result = 0;
+    return MPM_NO_ERROR;
+}
+
+int mpm_stream_feed(mpm_re *re, mpm_stream *stream, mpm_char8 *subject, mpm_size length)
+{
+    mpm_uint8 *state_map;
+    mpm_uint8 *state_map_base;
+    int error_code = stream_supported(re);
+
+    if (error_code != MPM_NO_ERROR)
+        return error_code;
+
+    if (length == 0)
+        return MPM_NO_ERROR;
+
+    state_map_base = STATE_MAP_BASE(re);
+    state_map = exec_single(re, state_map_base + stream->state_offset, subject, length, &stream->result);
+    stream->state_offset = state_map - state_map_base;
+    return MPM_NO_ERROR;
+}
+
+int mpm_stream_end(mpm_re *re, mpm_stream *stream, mpm_uint32 *result)
+{
+    int error_code = stream_supported(re);
+
+    if (error_code != MPM_NO_ERROR)
+        return error_code;
+
+    /* The end states of the last state has not been added so far. */
+    result[0] = stream->result | GET_END_STATES(STATE_MAP_BASE(re) + stream->state_offset);
+    return MPM_NO_ERROR;
+}
+
+/* ----------------------------------------------------------------------- */
+/*                     Matching multiple state machines.                   */
+/* ----------------------------------------------------------------------- */
+
+/* The steps of a single lane. The lanes are interleaved by the main loops,
+   so the independent memory loads of the lanes can be executed in parallel. */
+#define LANE_GET_INDEX(k) \
+        next_offset##k = state_map##k[char_class##k[current_character]];
+#define LANE_GET_END_STATES(k) \
+        end_states##k = GET_END_STATES(state_map##k);
+#define LANE_GET_NEXT_OFFSET(k, OFFSET_TYPE) \
+        next_offset##k = GET_NEXT_OFFSET(state_map##k, next_offset##k, OFFSET_TYPE);
+#define LANE_ADD_END_STATES(k) \
+        current_result##k |= end_states##k;
+#define LANE_NEXT_STATE_MAP(k) \
+        state_map##k = NEXT_STATE_MAP(state_map##k, next_offset##k);
 
-#define T128 (current_character <= 127) ? current_character : 127
-#define T256 current_character
+#define LANE_INIT(k) \
+    state_map##k = start_state_map(re[k], subject, offset); \
+    absorbing_state_map##k = STATE_MAP_BASE(re[k]) + re[k]->run.absorbing_offset; \
+    char_class##k = re[k]->run.compiled_pattern; \
+    current_result##k = 0;
+
+#define LANE_FINISHED(k) \
+    IS_FINISHED(state_map##k, current_result##k, absorbing_state_map##k, re[k]->run.all_end_states)
+
+#define LANE_RESULT(k) \
+    results[k] = current_result##k | GET_END_STATES(state_map##k);
+
+/* Returns with the RE_OFFSET_MASK flags of the state machines, or -1 if they use
+   different offset sizes or any of them is lazy, bit parallel or uses default
+   transitions. Dummy state machines can be combined with any offset size. */
+static int common_offset_size(mpm_re **re, int count)
+{
+    int offset_size = -1;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (re[i]->flags & RE_ANY_OFFSET)
+            continue;
+        if (re[i]->flags & (RE_LAZY | RE_BIT_PARALLEL | RE_DEFAULT_TRANSITIONS))
+            return -1;
+        if (offset_size == -1)
+            offset_size = re[i]->flags & RE_OFFSET_MASK;
+        else if (offset_size != (int)(re[i]->flags & RE_OFFSET_MASK))
+            return -1;
+    }
+    return offset_size == -1 ? 0 : offset_size;
+}
+
+/* The interleaved matchers require the same offset size, and cannot match
+   lazy, bit parallel or default transition state machines. */
+static void exec_each(mpm_re **re, int count, mpm_char8 *subject, mpm_size length, mpm_size offset, mpm_uint32 *results)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+        mpm_exec(re[i], subject, length, offset, results + i);
+}
+
+#define EXEC4_LOOP(OFFSET_TYPE) \
+    do { \
+        block_length = length > EXEC_BLOCK_SIZE ? EXEC_BLOCK_SIZE : length; \
+        length -= block_length; \
+        \
+        do { \
+            /* The squence is optimized for performance. */ \
+            current_character = *(mpm_uint8 *)subject; \
+            LANE_GET_INDEX(0) LANE_GET_INDEX(1) \
+            LANE_GET_INDEX(2) LANE_GET_INDEX(3) \
+            LANE_GET_END_STATES(0) LANE_GET_END_STATES(1) \
+            LANE_GET_END_STATES(2) LANE_GET_END_STATES(3) \
+            LANE_GET_NEXT_OFFSET(0, OFFSET_TYPE) LANE_GET_NEXT_OFFSET(1, OFFSET_TYPE) \
+            LANE_GET_NEXT_OFFSET(2, OFFSET_TYPE) LANE_GET_NEXT_OFFSET(3, OFFSET_TYPE) \
+            subject++; \
+            LANE_ADD_END_STATES(0) LANE_ADD_END_STATES(1) \
+            LANE_ADD_END_STATES(2) LANE_ADD_END_STATES(3) \
+            LANE_NEXT_STATE_MAP(0) LANE_NEXT_STATE_MAP(1) \
+            LANE_NEXT_STATE_MAP(2) LANE_NEXT_STATE_MAP(3) \
+        } while (--block_length); \
+        \
+        if (LANE_FINISHED(0) && LANE_FINISHED(1) && LANE_FINISHED(2) && LANE_FINISHED(3)) \
+            break; \
+    } while (length > 0);
 
 int mpm_exec4(mpm_re **re, mpm_char8 *subject, mpm_size length, mpm_size offset, mpm_uint32 *results)
 {
@@ -129,11 +753,25 @@ int mpm_exec4(mpm_re **re, mpm_char8 *subject, mpm_size length, mpm_size offset,
     int32_t next_offset0, next_offset1, next_offset2, next_offset3;
     mpm_uint32 current_result0, current_result1, current_result2, current_result3;
     mpm_uint32 end_states0, end_states1, end_states2, end_states3;
+    mpm_uint8 *absorbing_state_map0, *absorbing_state_map1, *absorbing_state_map2, *absorbing_state_map3;
+    mpm_uint8 *char_class0, *char_class1, *char_class2, *char_class3;
+    mpm_size block_length;
+    int offset_size;
 
     if ((re[0]->flags & RE_MODE_COMPILE) || (re[1]->flags & RE_MODE_COMPILE)
             || (re[2]->flags & RE_MODE_COMPILE) || (re[3]->flags & RE_MODE_COMPILE))
         return MPM_RE_IS_NOT_COMPILED;
 
+    /* The results of wide end state sets do not fit into a single word. */
+    if ((re[0]->flags | re[1]->flags | re[2]->flags | re[3]->flags) & RE_WIDE_END_STATES)
+        return MPM_INVALID_ARGS;
+
+    offset_size = common_offset_size(re, 4);
+    if (offset_size == -1) {
+        exec_each(re, 4, subject, length, offset, results);
+        return MPM_NO_ERROR;
+    }
+
     length -= offset;
     subject += offset;
     if (length == 0) {
@@ -145,96 +783,610 @@ int mpm_exec4(mpm_re **re, mpm_char8 *subject, mpm_size length, mpm_size offset,
     }
 
     /* Simple matcher. */
-    state_map0 = re[0]->run.compiled_pattern + sizeof(mpm_uint32);
-    state_map1 = re[1]->run.compiled_pattern + sizeof(mpm_uint32);
-    state_map2 = re[2]->run.compiled_pattern + sizeof(mpm_uint32);
-    state_map3 = re[3]->run.compiled_pattern + sizeof(mpm_uint32);
-    current_result0 = 0;
-    current_result1 = 0;
-    current_result2 = 0;
-    current_result3 = 0;
-    if (offset > 0) {
-        if (subject[-1] == '\n' || subject[-1] == '\r') {
-            state_map0 += re[0]->run.newline_offset;
-            state_map1 += re[1]->run.newline_offset;
-            state_map2 += re[2]->run.newline_offset;
-            state_map3 += re[3]->run.newline_offset;
-        } else {
-            state_map0 += re[0]->run.non_newline_offset;
-            state_map1 += re[1]->run.non_newline_offset;
-            state_map2 += re[2]->run.non_newline_offset;
-            state_map3 += re[3]->run.non_newline_offset;
-        }
-    }
+    LANE_INIT(0) LANE_INIT(1) LANE_INIT(2) LANE_INIT(3)
 
-    switch (((re[0]->flags & RE_CHAR_SET_256) >> 1)
-            | (re[1]->flags & RE_CHAR_SET_256)
-            | ((re[2]->flags & RE_CHAR_SET_256) << 1)
-            | ((re[3]->flags & RE_CHAR_SET_256) << 2)) {
-    case 0x0:
-        EXEC4_MAIN_LOOP(T128, 128, T128, 128, T128, 128, T128, 128);
-        break;
-    case 0x1:
-        EXEC4_MAIN_LOOP(T256, 256, T128, 128, T128, 128, T128, 128);
+    switch (offset_size) {
+    case RE_OFFSET_8:
+        EXEC4_LOOP(int8_t);
         break;
-    case 0x2:
-        EXEC4_MAIN_LOOP(T128, 128, T256, 256, T128, 128, T128, 128);
+    case RE_OFFSET_16:
+        EXEC4_LOOP(int16_t);
         break;
-    case 0x3:
-        EXEC4_MAIN_LOOP(T256, 256, T256, 256, T128, 128, T128, 128);
+    default:
+        EXEC4_LOOP(int32_t);
         break;
-    case 0x4:
-        EXEC4_MAIN_LOOP(T128, 128, T128, 128, T256, 256, T128, 128);
+    }
+
+    LANE_RESULT(0) LANE_RESULT(1) LANE_RESULT(2) LANE_RESULT(3)
+    return MPM_NO_ERROR;
+}
+
+#define EXEC8_LOOP(OFFSET_TYPE) \
+    do { \
+        block_length = length > EXEC_BLOCK_SIZE ? EXEC_BLOCK_SIZE : length; \
+        length -= block_length; \
+        \
+        do { \
+            /* The squence is optimized for performance. */ \
+            current_character = *(mpm_uint8 *)subject; \
+            LANE_GET_INDEX(0) LANE_GET_INDEX(1) \
+            LANE_GET_INDEX(2) LANE_GET_INDEX(3) \
+            LANE_GET_INDEX(4) LANE_GET_INDEX(5) \
+            LANE_GET_INDEX(6) LANE_GET_INDEX(7) \
+            LANE_GET_END_STATES(0) LANE_GET_END_STATES(1) \
+            LANE_GET_END_STATES(2) LANE_GET_END_STATES(3) \
+            LANE_GET_END_STATES(4) LANE_GET_END_STATES(5) \
+            LANE_GET_END_STATES(6) LANE_GET_END_STATES(7) \
+            LANE_GET_NEXT_OFFSET(0, OFFSET_TYPE) LANE_GET_NEXT_OFFSET(1, OFFSET_TYPE) \
+            LANE_GET_NEXT_OFFSET(2, OFFSET_TYPE) LANE_GET_NEXT_OFFSET(3, OFFSET_TYPE) \
+            LANE_GET_NEXT_OFFSET(4, OFFSET_TYPE) LANE_GET_NEXT_OFFSET(5, OFFSET_TYPE) \
+            LANE_GET_NEXT_OFFSET(6, OFFSET_TYPE) LANE_GET_NEXT_OFFSET(7, OFFSET_TYPE) \
+            subject++; \
+            LANE_ADD_END_STATES(0) LANE_ADD_END_STATES(1) \
+            LANE_ADD_END_STATES(2) LANE_ADD_END_STATES(3) \
+            LANE_ADD_END_STATES(4) LANE_ADD_END_STATES(5) \
+            LANE_ADD_END_STATES(6) LANE_ADD_END_STATES(7) \
+            LANE_NEXT_STATE_MAP(0) LANE_NEXT_STATE_MAP(1) \
+            LANE_NEXT_STATE_MAP(2) LANE_NEXT_STATE_MAP(3) \
+            LANE_NEXT_STATE_MAP(4) LANE_NEXT_STATE_MAP(5) \
+            LANE_NEXT_STATE_MAP(6) LANE_NEXT_STATE_MAP(7) \
+        } while (--block_length); \
+        \
+        if (LANE_FINISHED(0) && LANE_FINISHED(1) && LANE_FINISHED(2) && LANE_FINISHED(3) \
+                && LANE_FINISHED(4) && LANE_FINISHED(5) && LANE_FINISHED(6) && LANE_FINISHED(7)) \
+            break; \
+    } while (length > 0);
+
+int mpm_exec8(mpm_re **re, mpm_char8 *subject, mpm_size length, mpm_size offset, mpm_uint32 *results)
+{
+    mpm_uint32 current_character;
+    mpm_uint8 *state_map0, *state_map1, *state_map2, *state_map3;
+    mpm_uint8 *state_map4, *state_map5, *state_map6, *state_map7;
+    int32_t next_offset0, next_offset1, next_offset2, next_offset3;
+    int32_t next_offset4, next_offset5, next_offset6, next_offset7;
+    mpm_uint32 current_result0, current_result1, current_result2, current_result3;
+    mpm_uint32 current_result4, current_result5, current_result6, current_result7;
+    mpm_uint32 end_states0, end_states1, end_states2, end_states3;
+    mpm_uint32 end_states4, end_states5, end_states6, end_states7;
+    mpm_uint8 *absorbing_state_map0, *absorbing_state_map1, *absorbing_state_map2, *absorbing_state_map3;
+    mpm_uint8 *absorbing_state_map4, *absorbing_state_map5, *absorbing_state_map6, *absorbing_state_map7;
+    mpm_uint8 *char_class0, *char_class1, *char_class2, *char_class3;
+    mpm_uint8 *char_class4, *char_class5, *char_class6, *char_class7;
+    mpm_size block_length;
+    int offset_size;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        if (re[i]->flags & RE_MODE_COMPILE)
+            return MPM_RE_IS_NOT_COMPILED;
+        /* The results of wide end state sets do not fit into a single word. */
+        if (re[i]->flags & RE_WIDE_END_STATES)
+            return MPM_INVALID_ARGS;
+    }
+
+    offset_size = common_offset_size(re, 8);
+    if (offset_size == -1) {
+        exec_each(re, 8, subject, length, offset, results);
+        return MPM_NO_ERROR;
+    }
+
+    length -= offset;
+    subject += offset;
+    if (length == 0) {
+        memset(results, 0, 8 * sizeof(mpm_uint32));
+        return MPM_NO_ERROR;
+    }
+
+    LANE_INIT(0) LANE_INIT(1) LANE_INIT(2) LANE_INIT(3)
+    LANE_INIT(4) LANE_INIT(5) LANE_INIT(6) LANE_INIT(7)
+
+    switch (offset_size) {
+    case RE_OFFSET_8:
+        EXEC8_LOOP(int8_t);
         break;
-    case 0x5:
-        EXEC4_MAIN_LOOP(T256, 256, T128, 128, T256, 256, T128, 128);
+    case RE_OFFSET_16:
+        EXEC8_LOOP(int16_t);
         break;
-    case 0x6:
-        EXEC4_MAIN_LOOP(T128, 128, T256, 256, T256, 256, T128, 128);
+    default:
+        EXEC8_LOOP(int32_t);
         break;
-    case 0x7:
-        EXEC4_MAIN_LOOP(T256, 256, T256, 256, T256, 256, T128, 128);
+    }
+
+    LANE_RESULT(0) LANE_RESULT(1) LANE_RESULT(2) LANE_RESULT(3)
+    LANE_RESULT(4) LANE_RESULT(5) LANE_RESULT(6) LANE_RESULT(7)
+    return MPM_NO_ERROR;
+}
+
+int mpm_execN(mpm_re **re, mpm_size count, mpm_char8 *subject, mpm_size length, mpm_size offset, mpm_uint32 *results)
+{
+    mpm_re *re_list[4];
+    mpm_uint32 re_results[4];
+    mpm_re *dummy_re;
+    mpm_size i;
+    int error_code;
+
+    /* The results of wide end state sets do not fit into a single word. */
+    for (i = 0; i < count; i++)
+        if (!(re[i]->flags & RE_MODE_COMPILE) && (re[i]->flags & RE_WIDE_END_STATES))
+            return MPM_INVALID_ARGS;
+
+    /* The widest matcher is selected, which fits to the remaining state machines. */
+    while (count >= 8) {
+        if ((error_code = mpm_exec8(re, subject, length, offset, results)) != MPM_NO_ERROR)
+            return error_code;
+        re += 8;
+        results += 8;
+        count -= 8;
+    }
+
+    if (count >= 4) {
+        if ((error_code = mpm_exec4(re, subject, length, offset, results)) != MPM_NO_ERROR)
+            return error_code;
+        re += 4;
+        results += 4;
+        count -= 4;
+    }
+
+    if (count == 1)
+        return mpm_exec(re[0], subject, length, offset, results);
+
+    if (count > 1) {
+        dummy_re = mpm_dummy_re();
+        for (i = 0; i < 4; i++)
+            re_list[i] = (i < count) ? re[i] : dummy_re;
+        if ((error_code = mpm_exec4(re_list, subject, length, offset, re_results)) != MPM_NO_ERROR)
+            return error_code;
+        memcpy(results, re_results, count * sizeof(mpm_uint32));
+    }
+    return MPM_NO_ERROR;
+}
+
+/* ----------------------------------------------------------------------- */
+/*                      Matching multiple subject strings.                 */
+/* ----------------------------------------------------------------------- */
+
+typedef struct batch_lane {
+    mpm_uint8 *state_map;
+    mpm_char8 *subject;
+    mpm_size length;
+    mpm_uint32 result;
+    mpm_size index;
+} batch_lane;
+
+#define BATCH_LANE_GET_CLASS(k) \
+        current_class##k = char_class[*(mpm_uint8 *)subject##k];
+#define BATCH_LANE_GET_INDEX(k) \
+        next_offset##k = state_map##k[current_class##k];
+#define BATCH_LANE_NEXT_SUBJECT(k) \
+        subject##k++;
+
+#define BATCH_LANE_LOAD(k) \
+    state_map##k = lanes[k].state_map; \
+    subject##k = lanes[k].subject; \
+    current_result##k = lanes[k].result;
+
+#define BATCH_LANE_STORE(k) \
+    lanes[k].state_map = state_map##k; \
+    lanes[k].subject = subject##k; \
+    lanes[k].length -= length; \
+    lanes[k].result = current_result##k;
+
+#define EXEC_BATCH4_LOOP(OFFSET_TYPE) \
+    do { \
+        /* The squence is optimized for performance. */ \
+        BATCH_LANE_GET_CLASS(0) BATCH_LANE_GET_CLASS(1) \
+        BATCH_LANE_GET_CLASS(2) BATCH_LANE_GET_CLASS(3) \
+        BATCH_LANE_GET_INDEX(0) BATCH_LANE_GET_INDEX(1) \
+        BATCH_LANE_GET_INDEX(2) BATCH_LANE_GET_INDEX(3) \
+        LANE_GET_END_STATES(0) LANE_GET_END_STATES(1) \
+        LANE_GET_END_STATES(2) LANE_GET_END_STATES(3) \
+        LANE_GET_NEXT_OFFSET(0, OFFSET_TYPE) LANE_GET_NEXT_OFFSET(1, OFFSET_TYPE) \
+        LANE_GET_NEXT_OFFSET(2, OFFSET_TYPE) LANE_GET_NEXT_OFFSET(3, OFFSET_TYPE) \
+        BATCH_LANE_NEXT_SUBJECT(0) BATCH_LANE_NEXT_SUBJECT(1) \
+        BATCH_LANE_NEXT_SUBJECT(2) BATCH_LANE_NEXT_SUBJECT(3) \
+        LANE_ADD_END_STATES(0) LANE_ADD_END_STATES(1) \
+        LANE_ADD_END_STATES(2) LANE_ADD_END_STATES(3) \
+        LANE_NEXT_STATE_MAP(0) LANE_NEXT_STATE_MAP(1) \
+        LANE_NEXT_STATE_MAP(2) LANE_NEXT_STATE_MAP(3) \
+    } while (--block_length);
+
+/* Runs four lanes for block_length characters. None of the lanes can
+   be shorter than block_length. */
+static void exec_batch4(mpm_re *re, batch_lane *lanes, mpm_size block_length)
+{
+    mpm_uint8 *char_class = re->run.compiled_pattern;
+    mpm_uint32 current_class0, current_class1, current_class2, current_class3;
+    mpm_uint8 *state_map0, *state_map1, *state_map2, *state_map3;
+    mpm_char8 *subject0, *subject1, *subject2, *subject3;
+    int32_t next_offset0, next_offset1, next_offset2, next_offset3;
+    mpm_uint32 current_result0, current_result1, current_result2, current_result3;
+    mpm_uint32 end_states0, end_states1, end_states2, end_states3;
+    mpm_size length = block_length;
+
+    BATCH_LANE_LOAD(0) BATCH_LANE_LOAD(1) BATCH_LANE_LOAD(2) BATCH_LANE_LOAD(3)
+
+    switch (re->flags & RE_OFFSET_MASK) {
+    case RE_OFFSET_8:
+        EXEC_BATCH4_LOOP(int8_t);
         break;
-    case 0x8:
-        EXEC4_MAIN_LOOP(T128, 128, T128, 128, T128, 128, T256, 256);
+    case RE_OFFSET_16:
+        EXEC_BATCH4_LOOP(int16_t);
         break;
-    case 0x9:
-        EXEC4_MAIN_LOOP(T256, 256, T128, 128, T128, 128, T256, 256);
+    default:
+        EXEC_BATCH4_LOOP(int32_t);
         break;
-    case 0xa:
-        EXEC4_MAIN_LOOP(T128, 128, T256, 256, T128, 128, T256, 256);
+    }
+
+    BATCH_LANE_STORE(0) BATCH_LANE_STORE(1) BATCH_LANE_STORE(2) BATCH_LANE_STORE(3)
+}
+
+int mpm_exec_batch(mpm_re *re, mpm_char8 **subjects, mpm_size *lengths, mpm_size count, mpm_uint32 *results)
+{
+    batch_lane lanes[4];
+    mpm_uint8 *absorbing_state_map;
+    mpm_uint32 all_end_states;
+    mpm_size next_subject, block_length;
+    int active_lanes, i;
+
+    if (re->flags & RE_MODE_COMPILE)
+        return MPM_RE_IS_NOT_COMPILED;
+
+    /* The results of wide end state sets do not fit into a single word. */
+    if (re->flags & RE_WIDE_END_STATES)
+        return MPM_INVALID_ARGS;
+
+    if (re->flags & (RE_LAZY | RE_BIT_PARALLEL | RE_DEFAULT_TRANSITIONS)) {
+        for (next_subject = 0; next_subject < count; next_subject++)
+            mpm_exec(re, subjects[next_subject], lengths[next_subject], 0, results + next_subject);
+        return MPM_NO_ERROR;
+    }
+
+    absorbing_state_map = STATE_MAP_BASE(re) + re->run.absorbing_offset;
+    all_end_states = re->run.all_end_states;
+    next_subject = 0;
+    active_lanes = 0;
+
+    while (1) {
+        /* Assign the next subjects to the free lanes. */
+        while (active_lanes < 4 && next_subject < count) {
+            if (lengths[next_subject] == 0) {
+                results[next_subject] = 0;
+                next_subject++;
+                continue;
+            }
+            lanes[active_lanes].state_map = STATE_MAP_BASE(re) + re->run.start_offset;
+            lanes[active_lanes].subject = subjects[next_subject];
+            lanes[active_lanes].length = lengths[next_subject];
+            lanes[active_lanes].result = 0;
+            lanes[active_lanes].index = next_subject;
+            active_lanes++;
+            next_subject++;
+        }
+
+        if (active_lanes < 4)
+            break;
+
+        /* Runs until the shortest lane ends. */
+        block_length = EXEC_BLOCK_SIZE;
+        for (i = 0; i < 4; i++)
+            if (lanes[i].length < block_length)
+                block_length = lanes[i].length;
+
+        exec_batch4(re, lanes, block_length);
+
+        /* Retire the finished lanes. */
+        i = 0;
+        while (i < active_lanes) {
+            if (lanes[i].length == 0 || IS_FINISHED(lanes[i].state_map, lanes[i].result, absorbing_state_map, all_end_states)) {
+                results[lanes[i].index] = lanes[i].result | GET_END_STATES(lanes[i].state_map);
+                active_lanes--;
+                lanes[i] = lanes[active_lanes];
+            } else
+                i++;
+        }
+    }
+
+    /* Not enough subjects for interleaving. */
+    for (i = 0; i < active_lanes; i++) {
+        lanes[i].state_map = exec_single(re, lanes[i].state_map, lanes[i].subject, lanes[i].length, &lanes[i].result);
+        results[lanes[i].index] = lanes[i].result | GET_END_STATES(lanes[i].state_map);
+    }
+    return MPM_NO_ERROR;
+}
+
+/* ----------------------------------------------------------------------- */
+/*                         Matching with callbacks.                        */
+/* ----------------------------------------------------------------------- */
+
+/* Returns non-zero if the matching should be stopped. */
+static int report_end_states(mpm_uint32 end_states, mpm_size end_offset,
+    mpm_match_callback callback, void *user_data)
+{
+    mpm_uint32 pattern_id = 0;
+
+    do {
+        if ((end_states & 0x1) && callback(pattern_id, end_offset, user_data))
+            return 1;
+        end_states >>= 1;
+        pattern_id++;
+    } while (end_states);
+    return 0;
+}
+
+/* Unlike the bitset matchers, the end states are checked for every character. */
+#define EXEC_CALLBACK_LOOP(OFFSET_TYPE) \
+    do { \
+        next_offset = state_map[char_class[*(mpm_uint8 *)subject]]; \
+        end_states = GET_END_STATES(state_map) & report_mask; \
+        next_offset = GET_NEXT_OFFSET(state_map, next_offset, OFFSET_TYPE); \
+        if (end_states) { \
+            if (report_end_states(end_states, subject - subject_start, callback, user_data)) \
+                return MPM_NO_ERROR; \
+            if (flags & MPM_EXEC_CALLBACK_FIRST) { \
+                report_mask &= ~end_states; \
+                if (!report_mask) \
+                    return MPM_NO_ERROR; \
+            } \
+        } \
+        subject++; \
+        state_map = NEXT_STATE_MAP(state_map, next_offset); \
+    } while (--length);
+
+static void exec_callback_lazy(mpm_re *re, mpm_char8 *subject, mpm_size length, mpm_size offset,
+    mpm_match_callback callback, void *user_data, mpm_uint32 flags)
+{
+    mpm_lazy_dfa *lazy_dfa = re->run.lazy_dfa;
+    mpm_lazy_state *state, *next_state;
+    mpm_char8 *subject_start = subject - offset;
+    mpm_uint32 current_class;
+    mpm_uint32 end_states;
+    mpm_uint32 report_mask = lazy_dfa->all_end_states;
+
+    state = lazy_start_state(re, subject, offset);
+    do {
+        current_class = lazy_dfa->char_class[*(mpm_uint8 *)subject];
+        end_states = state->end_states & report_mask;
+        if (end_states) {
+            if (report_end_states(end_states, subject - subject_start, callback, user_data))
+                return;
+            if (flags & MPM_EXEC_CALLBACK_FIRST) {
+                report_mask &= ~end_states;
+                if (!report_mask)
+                    return;
+            }
+        }
+        next_state = state->next_state[current_class];
+        if (!next_state)
+            next_state = mpm_private_lazy_next_state(lazy_dfa, state, current_class);
+        state = next_state;
+        subject++;
+    } while (--length);
+
+    end_states = state->end_states & report_mask;
+    if (end_states)
+        report_end_states(end_states, subject - subject_start, callback, user_data);
+}
+
+static void exec_callback_bit_parallel(mpm_re *re, mpm_char8 *subject, mpm_size length, mpm_size offset,
+    mpm_match_callback callback, void *user_data, mpm_uint32 flags)
+{
+    mpm_bit_parallel *bit_parallel = re->run.bit_parallel;
+    mpm_uint32 active_terms[BIT_PARALLEL_MAX_WORDS];
+    mpm_char8 *subject_start = subject - offset;
+    mpm_uint32 end_states;
+    mpm_uint32 report_mask = bit_parallel->all_end_states;
+
+    bit_parallel_start_terms(re, subject, offset, active_terms);
+    do {
+        end_states = bit_parallel_step(bit_parallel, active_terms, *(mpm_uint8 *)subject) & report_mask;
+        subject++;
+        if (end_states) {
+            if (report_end_states(end_states, subject - subject_start, callback, user_data))
+                return;
+            if (flags & MPM_EXEC_CALLBACK_FIRST) {
+                report_mask &= ~end_states;
+                if (!report_mask)
+                    return;
+            }
+        }
+    } while (--length);
+}
+
+static void exec_callback_default(mpm_re *re, mpm_char8 *subject, mpm_size length, mpm_size offset,
+    mpm_match_callback callback, void *user_data, mpm_uint32 flags)
+{
+    mpm_default_dfa *default_dfa = re->run.default_dfa;
+    mpm_uint32 *states = default_dfa->states;
+    mpm_uint32 *state;
+    mpm_char8 *subject_start = subject - offset;
+    mpm_uint32 end_states;
+    mpm_uint32 report_mask = default_dfa->all_end_states;
+
+    state = default_start_state(re, subject, offset);
+    do {
+        end_states = state[DEFAULT_STATE_END_STATES] & report_mask;
+        if (end_states) {
+            if (report_end_states(end_states, subject - subject_start, callback, user_data))
+                return;
+            if (flags & MPM_EXEC_CALLBACK_FIRST) {
+                report_mask &= ~end_states;
+                if (!report_mask)
+                    return;
+            }
+        }
+        state = default_next_state(states, state, default_dfa->char_class[*(mpm_uint8 *)subject]);
+        subject++;
+    } while (--length);
+
+    end_states = state[DEFAULT_STATE_END_STATES] & report_mask;
+    if (end_states)
+        report_end_states(end_states, subject - subject_start, callback, user_data);
+}
+
+/* Returns non-zero if the matching should be stopped. The reported patterns
+   are removed from the report_mask if MPM_EXEC_CALLBACK_FIRST is set, and
+   the matching is stopped when all patterns are reported. */
+static int report_end_state_set(mpm_uint32 *end_state_set, mpm_uint32 *report_mask, mpm_uint32 length,
+    mpm_size end_offset, mpm_match_callback callback, void *user_data, mpm_uint32 flags)
+{
+    mpm_uint32 end_states, pattern_id, i;
+
+    for (i = 0; i < length; i++) {
+        end_states = end_state_set[i] & report_mask[i];
+        if (!end_states)
+            continue;
+
+        pattern_id = i << 5;
+        do {
+            if ((end_states & 0x1) && callback(pattern_id, end_offset, user_data))
+                return 1;
+            end_states >>= 1;
+            pattern_id++;
+        } while (end_states);
+
+        if (flags & MPM_EXEC_CALLBACK_FIRST)
+            report_mask[i] &= ~end_state_set[i];
+    }
+
+    if (!(flags & MPM_EXEC_CALLBACK_FIRST))
+        return 0;
+
+    for (i = 0; i < length; i++)
+        if (report_mask[i])
+            return 0;
+    return 1;
+}
+
+#define EXEC_CALLBACK_WIDE_LOOP(OFFSET_TYPE) \
+    do { \
+        next_offset = state_map[char_class[*(mpm_uint8 *)subject]]; \
+        end_states = GET_END_STATES(state_map); \
+        next_offset = GET_NEXT_OFFSET(state_map, next_offset, OFFSET_TYPE); \
+        if (end_states && report_end_state_set(end_state_sets + end_states, report_mask, \
+                end_state_set_length, subject - subject_start, callback, user_data, flags)) \
+            return; \
+        subject++; \
+        state_map = NEXT_STATE_MAP(state_map, next_offset); \
+    } while (--length);
+
+static void exec_callback_wide(mpm_re *re, mpm_char8 *subject, mpm_size length, mpm_size offset,
+    mpm_match_callback callback, void *user_data, mpm_uint32 flags)
+{
+    mpm_uint8 *char_class = re->run.compiled_pattern;
+    mpm_uint32 *end_state_sets = re->run.end_state_sets;
+    mpm_uint32 end_state_set_length = re->run.end_state_set_length;
+    mpm_char8 *subject_start = subject - offset;
+    mpm_uint8 *state_map;
+    int32_t next_offset;
+    mpm_uint32 end_states;
+    mpm_uint32 report_mask[PATTERN_LIMIT / 32];
+
+    memset(report_mask, 0xff, (end_state_set_length - 1) * sizeof(mpm_uint32));
+    report_mask[end_state_set_length - 1] = re->run.all_end_states;
+    state_map = start_state_map(re, subject, offset);
+
+    switch (re->flags & RE_OFFSET_MASK) {
+    case RE_OFFSET_8:
+        EXEC_CALLBACK_WIDE_LOOP(int8_t);
         break;
-    case 0xb:
-        EXEC4_MAIN_LOOP(T256, 256, T256, 256, T128, 128, T256, 256);
+    case RE_OFFSET_16:
+        EXEC_CALLBACK_WIDE_LOOP(int16_t);
         break;
-    case 0xc:
-        EXEC4_MAIN_LOOP(T128, 128, T128, 128, T256, 256, T256, 256);
+    default:
+        EXEC_CALLBACK_WIDE_LOOP(int32_t);
         break;
-    case 0xd:
-        EXEC4_MAIN_LOOP(T256, 256, T128, 128, T256, 256, T256, 256);
+    }
+
+    end_states = GET_END_STATES(state_map);
+    if (end_states)
+        report_end_state_set(end_state_sets + end_states, report_mask, end_state_set_length,
+            subject - subject_start, callback, user_data, flags);
+}
+
+int mpm_exec_callback(mpm_re *re, mpm_char8 *subject, mpm_size length, mpm_size offset,
+    mpm_match_callback callback, void *user_data, mpm_uint32 flags)
+{
+    mpm_uint8 *char_class;
+    mpm_uint8 *state_map;
+    mpm_char8 *subject_start = subject;
+    int32_t next_offset;
+    mpm_uint32 end_states;
+    mpm_uint32 report_mask;
+
+    if (re->flags & RE_MODE_COMPILE)
+        return MPM_RE_IS_NOT_COMPILED;
+
+    if (!callback)
+        return MPM_INVALID_ARGS;
+
+    length -= offset;
+    subject += offset;
+    if (length == 0)
+        return MPM_NO_ERROR;
+
+    if (re->flags & RE_LAZY) {
+        exec_callback_lazy(re, subject, length, offset, callback, user_data, flags);
+        return MPM_NO_ERROR;
+    }
+
+    if (re->flags & RE_BIT_PARALLEL) {
+        exec_callback_bit_parallel(re, subject, length, offset, callback, user_data, flags);
+        return MPM_NO_ERROR;
+    }
+
+    if (re->flags & RE_DEFAULT_TRANSITIONS) {
+        exec_callback_default(re, subject, length, offset, callback, user_data, flags);
+        return MPM_NO_ERROR;
+    }
+
+    if (re->flags & RE_WIDE_END_STATES) {
+        exec_callback_wide(re, subject, length, offset, callback, user_data, flags);
+        return MPM_NO_ERROR;
+    }
+
+    report_mask = re->run.all_end_states;
+    state_map = start_state_map(re, subject, offset);
+
+    char_class = re->run.compiled_pattern;
+    switch (re->flags & RE_OFFSET_MASK) {
+    case RE_OFFSET_8:
+        EXEC_CALLBACK_LOOP(int8_t);
         break;
-    case 0xe:
-        EXEC4_MAIN_LOOP(T128, 128, T256, 256, T256, 256, T256, 256);
+    case RE_OFFSET_16:
+        EXEC_CALLBACK_LOOP(int16_t);
         break;
-    case 0xf:
-        EXEC4_MAIN_LOOP(T256, 256, T256, 256, T256, 256, T256, 256);
+    default:
+        EXEC_CALLBACK_LOOP(int32_t);
         break;
     }
 
-    results[0] = current_result0 | GET_END_STATES(state_map0);
-    results[1] = current_result1 | GET_END_STATES(state_map1);
-    results[2] = current_result2 | GET_END_STATES(state_map2);
-    results[3] = current_result3 | GET_END_STATES(state_map3);
+    end_states = GET_END_STATES(state_map) & report_mask;
+    if (end_states)
+        report_end_states(end_states, subject - subject_start, callback, user_data);
     return MPM_NO_ERROR;
 }
 
+/* All characters belong to the same class. The only state is absorbing, and
+   the all_end_states is zero, so the matching stops after the first block.
+   The relative offset is zero for all offset sizes. Both objects are fully
+   initialized at compile time, so they are never written at run time. */
+static mpm_uint8 dummy_compiled_pattern[CHAR_CLASS_TABLE_SIZE + sizeof(mpm_uint32) + sizeof(mpm_uint32) + 4] = {
+    [CHAR_CLASS_TABLE_SIZE + 2 * sizeof(mpm_uint32)] = STATE_MAP_INDEX(0)
+};
+
+static mpm_re dummy_state_machine = {
+    .flags = RE_ANY_OFFSET,
+    .run = {
+        .compiled_pattern = dummy_compiled_pattern,
+        .start_offset = 2 * sizeof(mpm_uint32),
+        .non_newline_offset = 2 * sizeof(mpm_uint32),
+        .newline_offset = 2 * sizeof(mpm_uint32)
+    }
+};
+
 mpm_re * mpm_dummy_re(void)
 {
-    static mpm_char8 compiled_pattern[sizeof(mpm_uint32) + 128 + sizeof(mpm_uint32)];
-    static mpm_re re;
-    /* Thread safe assignment. */
-    re.run.compiled_pattern = compiled_pattern;
-    return &re;
+    return &dummy_state_machine;
 }
 
 /* Offsets are stored as byte offsets, because shifting requires an extra instruction on many CPUs. */
@@ -244,14 +1396,18 @@ int mpm_exec_list(mpm_rule_list *rule_list, mpm_char8 *subject, mpm_size length,
 {
     pattern_list_item *next_pattern = rule_list->pattern_list;
     pattern_list_item *last_pattern = next_pattern + rule_list->pattern_list_length;
-    mpm_re *re_list[4];
+    mpm_re *re_list[8];
     pattern_list_item *pattern_list_last;
-    mpm_uint32 re_result[4];
+    /* Large enough for eight results or a wide end state set. */
+    mpm_uint32 re_result[PATTERN_LIMIT / 32];
     mpm_uint32 *re_result_next;
     mpm_uint32 result_bits;
+    mpm_uint32 remaining_bits;
     mpm_re *dummy_re = mpm_dummy_re();
     mpm_uint32 *rule_indices;
     mpm_uint32 rule_offset;
+    mpm_uint32 offset_size;
+    int i;
 
     switch (rule_list->result_length) {
     case 0:
@@ -276,29 +1432,41 @@ int mpm_exec_list(mpm_rule_list *rule_list, mpm_char8 *subject, mpm_size length,
     }
 
     do {
+        /* The interleaved matchers require the same offset size. The pattern
+           list is sorted by offset size, so these groups are usually long.
+           State machines with wide end state sets are matched one by one. */
+        offset_size = next_pattern->re->flags & (RE_OFFSET_MASK | RE_BIT_PARALLEL | RE_WIDE_END_STATES | RE_DEFAULT_TRANSITIONS);
+        pattern_list_last = next_pattern + 1;
+        while (pattern_list_last < last_pattern && pattern_list_last < next_pattern + 8
+                && !(offset_size & RE_WIDE_END_STATES)
+                && (pattern_list_last->re->flags & (RE_OFFSET_MASK | RE_BIT_PARALLEL | RE_WIDE_END_STATES | RE_DEFAULT_TRANSITIONS)) == offset_size)
+            pattern_list_last++;
+
         /* The first case should be the most frequent. */
-        if (next_pattern + 4 <= last_pattern) {
+        if (next_pattern + 8 == pattern_list_last) {
+            for (i = 0; i < 8; i++)
+                re_list[i] = next_pattern[i].re;
+            mpm_exec8(re_list, subject, length, offset, re_result);
+        } else if (next_pattern + 4 <= pattern_list_last) {
             re_list[0] = next_pattern[0].re;
             re_list[1] = next_pattern[1].re;
             re_list[2] = next_pattern[2].re;
             re_list[3] = next_pattern[3].re;
             mpm_exec4(re_list, subject, length, offset, re_result);
             pattern_list_last = next_pattern + 4;
-        } else if (next_pattern + 2 <= last_pattern) {
+        } else if (next_pattern + 2 <= pattern_list_last) {
             re_list[0] = next_pattern[0].re;
             re_list[1] = next_pattern[1].re;
-            re_list[2] = (next_pattern + 2 < last_pattern) ? next_pattern[2].re : dummy_re;
-            re_list[3] = (next_pattern + 3 < last_pattern) ? next_pattern[3].re : dummy_re;
+            re_list[2] = (next_pattern + 2 < pattern_list_last) ? next_pattern[2].re : dummy_re;
+            re_list[3] = dummy_re;
             mpm_exec4(re_list, subject, length, offset, re_result);
-            pattern_list_last = last_pattern;
-        } else {
+        } else
             mpm_exec(next_pattern->re, subject, length, offset, re_result);
-            pattern_list_last = last_pattern;
-        }
 
         re_result_next = re_result;
         do {
             result_bits = *re_result_next++;
+            remaining_bits = 32;
             rule_indices = next_pattern->rule_indices;
             while (1) {
                 if (result_bits & 0x1) {
@@ -316,6 +1484,11 @@ int mpm_exec_list(mpm_rule_list *rule_list, mpm_char8 *subject, mpm_size length,
                 if (rule_offset & RULE_LIST_END)
                     break;
                 result_bits >>= 1;
+                /* Only wide end state sets have more than 32 patterns. */
+                if (--remaining_bits == 0) {
+                    result_bits = *re_result_next++;
+                    remaining_bits = 32;
+                }
             }
             next_pattern++;
         } while (next_pattern < pattern_list_last);
@@ -27,6 +27,10 @@
 /* Must be the first include, since it must not depend on other header files. */
 #include "mpm.h"
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
@@ -35,11 +39,26 @@
 /* Verbose compilation. */
 #define MPM_VERBOSE 1
 
+/* Worker threads (requires pthreads). */
+#define MPM_THREADS 1
+
+#if defined MPM_THREADS && MPM_THREADS
+#include <pthread.h>
+#endif
+
 /* Get the length of the fixed size value. */
 #define GET_FIXED_SIZE(flags)  (((flags) >> 12) & 0xffff)
 
+/* Get the number of threads passed by MPM_CLUSTERING_THREADS or MPM_COMPILE_THREADS. */
+#define GET_THREADS(flags)     (((flags) >> 8) & 0xff)
+/* Maximum number of worker threads. */
+#define MAX_THREADS 255
+
 /* Maximum number of regular expressions. */
-#define PATTERN_LIMIT          32
+#define PATTERN_LIMIT          1024
+/* The end states of this many regular expressions fit into a single
+   word. Lazy and bit parallel state machines are limited to this. */
+#define NARROW_PATTERN_LIMIT   32
 
 /* Maximum number of states. */
 #define STATE_LIMIT            20000
@@ -92,13 +111,163 @@ typedef struct mpm_re_pattern {
 } mpm_re_pattern;
 
 #define RE_MODE_COMPILE        0x1
-/* Modify mpm_exec4 if you change this constant. */
+/* Characters above 127 are not handled as character 127. */
 #define RE_CHAR_SET_256        0x2
+/* The state machine has at least one absorbing state. */
+#define RE_HAS_ABSORBING_STATE 0x4
+/* The characters which leave the non-newline start state are searched by a fast scan. */
+#define RE_SKIP_START_STATE    0x8
+
+/* Size of the relative offsets. 32 bit offsets are used if none of them is set. */
+#define RE_OFFSET_8            0x10
+#define RE_OFFSET_16           0x20
+#define RE_OFFSET_MASK         (RE_OFFSET_8 | RE_OFFSET_16)
+/* The state machine can be used with any offset size (see mpm_dummy_re). */
+#define RE_ANY_OFFSET          0x40
+
+/* Maps each character to its character class. */
+#define CHAR_CLASS_TABLE_SIZE  256
+
+/* The state_map contains 255 - index, so the matchers can
+   compute the address of a relative offset without negation. */
+#define STATE_MAP_INDEX(index) (255 - (index))
+
+/* Maximum number of characters which leave the start state for RE_SKIP_START_STATE.
+   Larger sets are too frequent in the input to make the search worthwhile. */
+#define SKIP_MAX_CHARS         8
+
+/* The state machine is built during matching (see mpm_lazy.c). */
+#define RE_LAZY                0x80
+
+/* A state of a lazy state machine. */
+typedef struct mpm_lazy_state {
+    struct mpm_lazy_state *hash_next;
+    mpm_uint32 hash;
+    mpm_uint32 end_states;
+    /* Variable length member: the next state for each character class (NULL
+       if it is not computed yet), followed by the term set and end state set. */
+    struct mpm_lazy_state *next_state[1];
+} mpm_lazy_state;
+
+/* Term level representation and state cache of a lazy state machine. */
+typedef struct mpm_lazy_dfa {
+    mpm_re_pattern *patterns;
+    /* Address of each term, and the decoded list of the active terms. */
+    mpm_uint32 **term_map;
+    mpm_uint32 **term_list;
+    /* Term sets of the START_ types, followed by the next term set. */
+    mpm_uint32 *start_sets;
+    mpm_uint32 *current;
+    mpm_lazy_state *start_states[3];
+    mpm_lazy_state **buckets;
+    /* The states are allocated from the cache. */
+    mpm_uint8 *cache;
+    mpm_uint8 *cache_next;
+    mpm_uint8 *cache_end;
+    mpm_size cache_size;
+    mpm_size flush_count;
+    mpm_uint32 term_set_length;
+    mpm_uint32 record_size;
+    mpm_uint32 state_size;
+    mpm_uint32 class_count;
+    mpm_uint32 all_end_states;
+    mpm_uint8 char_class[CHAR_CLASS_TABLE_SIZE];
+    /* The first character of each class. */
+    mpm_uint8 class_chars[256];
+} mpm_lazy_dfa;
+
+#define LAZY_STATE_RECORD(dfa, state) \
+    ((mpm_uint32 *)((state)->next_state + (dfa)->class_count))
+
+/* The terms are simulated by bit parallel operations (see mpm_bit_parallel.c). */
+#define RE_BIT_PARALLEL        0x100
+
+/* Maximum number of terms of a bit parallel re. */
+#define BIT_PARALLEL_TERM_LIMIT 128
+#define BIT_PARALLEL_MAX_WORDS  (BIT_PARALLEL_TERM_LIMIT / 32)
+
+typedef struct mpm_bit_parallel {
+    /* For each 8 bit chunk of the terms, and each combination of the terms in
+       the chunk: union of the followers, followed by the reached end states. */
+    mpm_uint32 *follow;
+    /* Terms whose character set contains the class. */
+    mpm_uint32 *class_terms;
+    mpm_uint32 term_set_length;
+    mpm_uint32 chunk_count;
+    mpm_uint32 all_end_states;
+    /* Term sets of the START_ types. */
+    mpm_uint32 start_sets[3 * BIT_PARALLEL_MAX_WORDS];
+    mpm_uint8 char_class[CHAR_CLASS_TABLE_SIZE];
+} mpm_bit_parallel;
+
+/* More than NARROW_PATTERN_LIMIT patterns: the end state word of each state
+   is the word offset of its end state set in end_state_sets. The sets are
+   stored only once, and the empty set is stored at offset 0. */
+#define RE_WIDE_END_STATES     0x200
+
+/* Each state stores only the transitions which differ from the transitions
+   of its default state (see mpm_default.c). */
+#define RE_DEFAULT_TRANSITIONS 0x400
+
+/* Maximum number of default states visited for a character. */
+#define DEFAULT_TRANSITION_MAX_HOPS 4
+
+/* Each state is a sequence of 32 bit words:
+     - Reached end state bitset
+     - Number of stored transitions (highest 8 bits) and the word offset of
+       the default state, or a DEFAULT_STATE_DENSE or DEFAULT_STATE_PACKED tag
+     - If the state has a default state: the character class of each stored
+       transition (padded to 4 bytes), followed by the word offset of the next
+       state of each stored transition
+     - Dense states: the word offset of the next state of each class
+     - Packed states: the index of the next state of each class packed into
+       1, 2 or 4 bits (DEFAULT_PACKED_SHIFT is the log2 of the width), followed
+       by the word offset of each next state. The number of words of the
+       indices is stored in the highest 6 bits of the info word. */
+#define DEFAULT_STATE_END_STATES   0
+#define DEFAULT_STATE_INFO         1
+#define DEFAULT_STATE_HEADER_SIZE  2
+#define DEFAULT_STATE_DENSE        0xffffff
+#define DEFAULT_STATE_PACKED       0xfffffe
+#define DEFAULT_STATE_OFFSET(info) ((info) & 0xffffff)
+#define DEFAULT_STATE_COUNT(info)  ((info) >> 24)
+#define DEFAULT_PACKED_SHIFT(info) (((info) >> 24) & 0x3)
+#define DEFAULT_PACKED_WORDS(info) ((info) >> 26)
+
+typedef struct mpm_default_dfa {
+    mpm_uint32 *states;
+    /* Size of the states in bytes. */
+    mpm_uint32 states_size;
+    /* Word offsets of the START_ types. */
+    mpm_uint32 start_offsets[3];
+    mpm_uint32 all_end_states;
+    mpm_uint8 char_class[CHAR_CLASS_TABLE_SIZE];
+} mpm_default_dfa;
+
+/* The compiled data is stored in a read-only file mapping (see mpm_save.c),
+   and the re is allocated as an mpm_mapped_re. */
+#define RE_MAPPED              0x800
+
+/* Atomic update of shared_count, returns with its previous value. */
+#if defined HAVE_SYNC_BUILTINS && HAVE_SYNC_BUILTINS
+#define SHARED_COUNT_ADD(re, value) __sync_fetch_and_add(&(re)->shared_count, (mpm_uint32)(value))
+#else
+#define SHARED_COUNT_ADD(re, value) mpm_private_shared_count_add((re), (mpm_uint32)(value))
+#endif
+
+/* Full memory barrier. */
+#if defined HAVE_SYNC_BUILTINS && HAVE_SYNC_BUILTINS
+#define MEMORY_BARRIER() __sync_synchronize()
+#else
+#define MEMORY_BARRIER() mpm_private_memory_barrier()
+#endif
 
 /* Internal representation of the regular expression. */
 struct mpm_re_internal {
     /* These members are used by mpm_add(). */
     mpm_uint32 flags;
+    /* Number of additional rule lists which use this state machine (see mpm_rule_list_update). */
+    mpm_uint32 shared_count;
     union {
         struct {
             mpm_re_pattern *patterns;
@@ -107,23 +276,68 @@ struct mpm_re_internal {
         } compile;
         struct {
             /*
-              starting state_map: compiled_pattern + 4 + optional new or non-new line offset
+              compiled_pattern starts with a character class table (CHAR_CLASS_TABLE_SIZE bytes)
+              followed by the states. All state offsets are relative to the end of this table.
+              starting state_map: new line, non-new line, or start offset
               Each state has:
-                  - Reached end state bitset (at state_map - 4)
-                  - 128 or 256 relative offsets (at state_map)
-                  - a signed, 32 bit offset for each relative state (at state_map + 128 or 256)
+                  - a signed, 8, 16 or 32 bit (see RE_OFFSET_MASK) offset for each
+                    relative state in reverse order, padded to 4 bytes
+                  - Reached end state bitset (at state_map - 4), or the offset
+                    of the end state set if RE_WIDE_END_STATES is set
+                  - STATE_MAP_INDEX of the relative offset for each character class (at state_map)
+              Absorbing states (all transitions lead back to the same state) are
+              stored after all other states starting from absorbing_offset.
             */
             mpm_uint8* compiled_pattern;
+            mpm_uint32 start_offset;
             mpm_uint32 non_newline_offset;
             mpm_uint32 newline_offset;
+            mpm_uint32 absorbing_offset;
+            /* Bitset of all patterns (of the last word if RE_WIDE_END_STATES is set). */
+            mpm_uint32 all_end_states;
+            /* Size of compiled_pattern in bytes. */
+            mpm_uint32 compiled_size;
+            /* Only used if RE_WIDE_END_STATES is set. The length of each
+               set is end_state_set_length words. */
+            mpm_uint32 *end_state_sets;
+            mpm_uint32 end_state_set_length;
+            mpm_uint32 end_state_sets_size;
+            /* Characters which leave the non-newline start state, and the
+               index of the start state in its own state_map. Only used if
+               RE_SKIP_START_STATE is set. Unused skip_chars are filled with
+               the first character. */
+            mpm_uint32 skip_char_count;
+            mpm_uint8 skip_index;
+            mpm_uint8 skip_chars[SKIP_MAX_CHARS];
+            /* Only used if RE_LAZY is set. None of the other members are used in that case. */
+            mpm_lazy_dfa *lazy_dfa;
+            /* Only used if RE_BIT_PARALLEL is set. None of the other members are used in that case. */
+            mpm_bit_parallel *bit_parallel;
+            /* Only used if RE_DEFAULT_TRANSITIONS is set. None of the other members are used in that case. */
+            mpm_default_dfa *default_dfa;
         } run;
     };
 };
 
+/* The mapping is owned by the re, if it is not NULL. Otherwise
+   the re is part of a rule list, which owns the mapping. */
+typedef struct mpm_mapped_re {
+    mpm_re re;
+    void *mapping;
+    mpm_size mapping_size;
+} mpm_mapped_re;
+
+/* Size of the control segment of shared rule lists (see mpm_save.c). */
+#define SHARED_CONTROL_SIZE    (2 * sizeof(mpm_uint32))
+
 /* Each pattern set contains an mpm_re pattern. */
 typedef struct pattern_list_item {
     mpm_uint32 *rule_indices;
     mpm_re *re;
+    /* NULL terminated list of uncompiled copies of the patterns of re (one
+       pattern each, in the order of re), which are used for rebuilding the
+       state machine by mpm_rule_list_update. NULL for loaded rule lists. */
+    mpm_re **sources;
 } pattern_list_item;
 
 struct mpm_rule_list_internal {
@@ -132,6 +346,13 @@ struct mpm_rule_list_internal {
     mpm_size rule_count;
     mpm_uint32 result_length;
     mpm_uint32 result_last_word;
+    /* The rule_indices are stored in this file mapping, if it is not NULL. */
+    void *mapping;
+    mpm_size mapping_size;
+    /* Control segment of a shared rule list (see mpm_rule_list_attach), and
+       the generation of the rule list. Only used if it is not NULL. */
+    mpm_uint32 *shared_control;
+    mpm_uint32 generation;
     pattern_list_item pattern_list[1];
 };
 
@@ -170,11 +391,32 @@ typedef struct mpm_byte_code {
 #define PATTERN_LIST_END       0x20000
 #define PATTERN_LIST_MASK      0x0ffff
 
+/* Start positions for mpm_private_start_terms. */
+#define START_AT_BEGIN          0
+#define START_AFTER_NON_NEWLINE 1
+#define START_AFTER_NEWLINE     2
+
 /* Private, shared functions. */
 int mpm_private_add(mpm_re *re, mpm_char8 *pattern, mpm_uint32 byte_code_length, mpm_uint32 flags);
+int mpm_private_start_terms(mpm_re_pattern *pattern, mpm_uint32 *term_set, mpm_uint32 **term_map, mpm_uint32 start_type);
+mpm_uint32 mpm_private_char_classes(mpm_uint32 **term, mpm_uint32 **last_term, mpm_uint8 *char_class);
+int mpm_private_compile_lazy(mpm_re *re, mpm_size *consumed_memory, mpm_uint32 flags);
+void mpm_private_free_lazy(mpm_lazy_dfa *dfa);
+mpm_lazy_state * mpm_private_lazy_start_state(mpm_lazy_dfa *dfa, mpm_uint32 start_type);
+mpm_lazy_state * mpm_private_lazy_next_state(mpm_lazy_dfa *dfa, mpm_lazy_state *state, mpm_uint32 current_class);
+int mpm_private_compile_bit_parallel(mpm_re *re, mpm_size *consumed_memory, mpm_uint32 flags);
+int mpm_private_compile_default(mpm_re *re, mpm_uint32 *next_states, mpm_uint32 *end_states,
+    mpm_uint32 state_count, mpm_uint32 class_count, mpm_uint8 *char_class, mpm_uint32 *start_states,
+    mpm_size *consumed_memory, mpm_uint32 flags);
 int mpm_private_rating(mpm_re_pattern *pattern);
 void mpm_private_free_patterns(mpm_re_pattern *pattern);
 mpm_size mpm_private_get_pattern_size(mpm_re_pattern *pattern);
+void mpm_private_unmap(void *mapping, mpm_size mapping_size);
+void mpm_private_free_sources(mpm_re **sources);
+#if !(defined HAVE_SYNC_BUILTINS && HAVE_SYNC_BUILTINS)
+mpm_uint32 mpm_private_shared_count_add(mpm_re *re, mpm_uint32 value);
+void mpm_private_memory_barrier(void);
+#endif
 
 #if defined MPM_VERBOSE && MPM_VERBOSE
 void mpm_private_print_char_range(mpm_uint8 *bitset);
@@ -0,0 +1,255 @@
+/* Copyright (C) 2012 Open Information Security Foundation
+ *
+ * You can copy, redistribute or modify this Program under the terms of
+ * the GNU General Public License version 2 as published by the Free
+ * Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/**
+ * \file
+ *
+ * \author Zoltan Herczeg <zherczeg@inf.u-szeged.hu>
+ */
+
+#include "mpm_internal.h"
+
+/* Default size of the state cache. */
+#define LAZY_CACHE_SIZE        (1024 * 1024)
+/* The cache can hold at least this number of states. */
+#define LAZY_MIN_STATES        64
+/* Number of hash buckets. Must be a power of 2. */
+#define LAZY_HASH_SIZE         4096
+
+/* ----------------------------------------------------------------------- */
+/*                           State cache management.                       */
+/* ----------------------------------------------------------------------- */
+
+/* Eviction policy: all states are dropped when the cache is full. The
+   matching continues from the current state, and only the states which
+   are reached again are rebuilt. */
+static void flush_cache(mpm_lazy_dfa *dfa)
+{
+    memset(dfa->buckets, 0, LAZY_HASH_SIZE * sizeof(mpm_lazy_state *));
+    dfa->start_states[0] = NULL;
+    dfa->start_states[1] = NULL;
+    dfa->start_states[2] = NULL;
+    dfa->cache_next = dfa->cache;
+    dfa->flush_count++;
+}
+
+/* Returns with the state belonging to the record. The cache is flushed if it is full. */
+static mpm_lazy_state * get_state(mpm_lazy_dfa *dfa, mpm_uint32 *record)
+{
+    mpm_uint32 hash = 0;
+    mpm_uint32 length = dfa->record_size / sizeof(mpm_uint32);
+    mpm_uint32 i;
+    mpm_lazy_state *state;
+
+    for (i = 0; i < length; i++)
+        hash = (hash ^ record[i]) * 0x01000193;
+    hash ^= hash >> 15;
+
+    state = dfa->buckets[hash & (LAZY_HASH_SIZE - 1)];
+    while (state) {
+        if (state->hash == hash && memcmp(LAZY_STATE_RECORD(dfa, state), record, dfa->record_size) == 0)
+            return state;
+        state = state->hash_next;
+    }
+
+    if (dfa->cache_next + dfa->state_size > dfa->cache_end)
+        flush_cache(dfa);
+
+    state = (mpm_lazy_state *)dfa->cache_next;
+    dfa->cache_next += dfa->state_size;
+
+    state->hash_next = dfa->buckets[hash & (LAZY_HASH_SIZE - 1)];
+    dfa->buckets[hash & (LAZY_HASH_SIZE - 1)] = state;
+    state->hash = hash;
+    state->end_states = record[dfa->term_set_length];
+    memset(state->next_state, 0, dfa->class_count * sizeof(mpm_lazy_state *));
+    memcpy(LAZY_STATE_RECORD(dfa, state), record, dfa->record_size);
+    return state;
+}
+
+mpm_lazy_state * mpm_private_lazy_start_state(mpm_lazy_dfa *dfa, mpm_uint32 start_type)
+{
+    if (!dfa->start_states[start_type])
+        dfa->start_states[start_type] = get_state(dfa, dfa->start_sets + start_type * (dfa->record_size / sizeof(mpm_uint32)));
+    return dfa->start_states[start_type];
+}
+
+/* Computes the next state of a state for a character class.
+   The same algorithm is used by mpm_compile for all classes. */
+mpm_lazy_state * mpm_private_lazy_next_state(mpm_lazy_dfa *dfa, mpm_lazy_state *state, mpm_uint32 current_class)
+{
+    mpm_uint32 *bit_set, *bit_set_end, *word_code;
+    mpm_uint32 **term, **last_term;
+    mpm_uint32 term_base, term_bits;
+    mpm_uint32 current_char = dfa->class_chars[current_class];
+    mpm_lazy_state *next_state;
+    mpm_size flush_count;
+
+    /* Decoding the set of terms. */
+    last_term = dfa->term_list;
+    term_base = 0;
+    bit_set = LAZY_STATE_RECORD(dfa, state);
+    bit_set_end = bit_set + dfa->term_set_length;
+    while (bit_set < bit_set_end) {
+        term_bits = *bit_set++;
+        if (term_bits == 0) {
+            term_base += 32;
+            continue;
+        }
+
+        do {
+            if (term_bits & 0x1)
+                *last_term++ = dfa->term_map[term_base];
+            term_bits >>= 1;
+            term_base++;
+        } while (term_base & 0x1f);
+    }
+
+    /* The non-newline start terms are always active. */
+    memcpy(dfa->current, dfa->start_sets + START_AFTER_NON_NEWLINE * (dfa->record_size / sizeof(mpm_uint32)), dfa->record_size);
+    term = dfa->term_list;
+    while (term < last_term) {
+        if (CHARSET_GETBIT(term[0], current_char)) {
+            word_code = term[0] + CHAR_SET_SIZE;
+            if (word_code[0] != DFA_NO_DATA)
+                DFA_SETBIT(dfa->current + dfa->term_set_length, word_code[0]);
+
+            word_code++;
+            while (word_code[0] != DFA_NO_DATA) {
+                DFA_SETBIT(dfa->current, word_code[0]);
+                word_code++;
+            }
+        }
+        term++;
+    }
+
+    flush_count = dfa->flush_count;
+    next_state = get_state(dfa, dfa->current);
+    /* The current state is dropped if the cache is flushed. */
+    if (flush_count == dfa->flush_count)
+        state->next_state[current_class] = next_state;
+    return next_state;
+}
+
+/* ----------------------------------------------------------------------- */
+/*                               Compile and free.                         */
+/* ----------------------------------------------------------------------- */
+
+int mpm_private_compile_lazy(mpm_re *re, mpm_size *consumed_memory, mpm_uint32 flags)
+{
+    mpm_lazy_dfa *dfa;
+    mpm_re_pattern *pattern = re->compile.patterns;
+    mpm_uint32 no_terms = re->compile.next_term_index;
+    mpm_uint32 no_patterns = re->compile.next_id;
+    mpm_uint32 record_length, i;
+    mpm_size pattern_size;
+
+    /* The end states must fit into a single word. */
+    if (no_patterns > NARROW_PATTERN_LIMIT)
+        return MPM_PATTERN_LIMIT;
+
+    dfa = (mpm_lazy_dfa *)malloc(sizeof(mpm_lazy_dfa));
+    if (!dfa)
+        return MPM_NO_MEMORY;
+    memset(dfa, 0, sizeof(mpm_lazy_dfa));
+
+    dfa->term_set_length = (no_terms + 31) >> 5;
+    if (dfa->term_set_length == 0)
+        dfa->term_set_length = 1;
+    /* The end states are stored in a single word. */
+    record_length = dfa->term_set_length + 1;
+    dfa->record_size = record_length * sizeof(mpm_uint32);
+    dfa->all_end_states = (no_patterns >= 32) ? 0xffffffff : (((mpm_uint32)1 << no_patterns) - 1);
+
+    dfa->term_map = (mpm_uint32 **)malloc((no_terms > 0 ? no_terms : 1) * sizeof(mpm_uint32 *) * 2);
+    dfa->start_sets = (mpm_uint32 *)malloc(dfa->record_size * 4);
+    dfa->buckets = (mpm_lazy_state **)malloc(LAZY_HASH_SIZE * sizeof(mpm_lazy_state *));
+    if (!dfa->term_map || !dfa->start_sets || !dfa->buckets) {
+        mpm_private_free_lazy(dfa);
+        return MPM_NO_MEMORY;
+    }
+    dfa->term_list = dfa->term_map + no_terms;
+    dfa->current = dfa->start_sets + 3 * record_length;
+
+    memset(dfa->start_sets, 0, dfa->record_size * 3);
+    if (mpm_private_start_terms(pattern, dfa->start_sets + START_AT_BEGIN * record_length, dfa->term_map, START_AT_BEGIN) != MPM_NO_ERROR) {
+        mpm_private_free_lazy(dfa);
+        return MPM_INTERNAL_ERROR;
+    }
+    mpm_private_start_terms(pattern, dfa->start_sets + START_AFTER_NON_NEWLINE * record_length, NULL, START_AFTER_NON_NEWLINE);
+    mpm_private_start_terms(pattern, dfa->start_sets + START_AFTER_NEWLINE * record_length, NULL, START_AFTER_NEWLINE);
+
+    dfa->class_count = mpm_private_char_classes(dfa->term_map, dfa->term_map + no_terms, dfa->char_class);
+    for (i = 256; i > 0; i--)
+        dfa->class_chars[dfa->char_class[i - 1]] = i - 1;
+
+    /* The states are aligned to pointer size. */
+    dfa->state_size = sizeof(mpm_lazy_state) + (dfa->class_count - 1) * sizeof(mpm_lazy_state *) + dfa->record_size;
+    dfa->state_size = (dfa->state_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    dfa->cache_size = LAZY_CACHE_SIZE;
+    if (dfa->cache_size < dfa->state_size * LAZY_MIN_STATES)
+        dfa->cache_size = dfa->state_size * LAZY_MIN_STATES;
+
+    dfa->cache = (mpm_uint8 *)malloc(dfa->cache_size);
+    if (!dfa->cache) {
+        mpm_private_free_lazy(dfa);
+        return MPM_NO_MEMORY;
+    }
+    dfa->cache_end = dfa->cache + dfa->cache_size;
+    flush_cache(dfa);
+    dfa->flush_count = 0;
+
+    pattern_size = 0;
+    while (pattern) {
+        pattern_size += mpm_private_get_pattern_size(pattern);
+        pattern = pattern->next;
+    }
+
+#if defined MPM_VERBOSE && MPM_VERBOSE
+    if (flags & MPM_COMPILE_VERBOSE_STATS) {
+        printf("\nStatistics:\n  total patterns: %d, total terms: %d, character classes: %d\n  lazy state cache: %d bytes (%d states)\n",
+            (int)no_patterns, (int)no_terms, (int)dfa->class_count,
+            (int)dfa->cache_size, (int)(dfa->cache_size / dfa->state_size));
+    }
+#endif
+
+    if (consumed_memory)
+        *consumed_memory = sizeof(mpm_re) + sizeof(mpm_lazy_dfa) + pattern_size
+            + no_terms * sizeof(mpm_uint32 *) * 2 + dfa->record_size * 4
+            + LAZY_HASH_SIZE * sizeof(mpm_lazy_state *) + dfa->cache_size;
+
+    /* The patterns are kept, since the states are built from them. */
+    dfa->patterns = re->compile.patterns;
+    re->flags = (re->flags & ~RE_MODE_COMPILE) | RE_LAZY;
+    re->run.lazy_dfa = dfa;
+    return MPM_NO_ERROR;
+}
+
+void mpm_private_free_lazy(mpm_lazy_dfa *dfa)
+{
+    if (dfa->patterns)
+        mpm_private_free_patterns(dfa->patterns);
+    if (dfa->term_map)
+        free(dfa->term_map);
+    if (dfa->start_sets)
+        free(dfa->start_sets);
+    if (dfa->buckets)
+        free(dfa->buckets);
+    if (dfa->cache)
+        free(dfa->cache);
+    free(dfa);
+}
@@ -464,18 +464,18 @@ typedef struct pcre32_callout_block {
   /* ------------------------------------------------------------------ */
 } pcre32_callout_block;
 
-/* Indirection for store get and free functions. These can be set to
-alternative malloc/free functions if required. Special ones are used in the
-non-recursive case for "frames". There is also an optional callout function
-that is triggered by the (?) regex item. For Virtual Pascal, these definitions
-have to take another form. */
+/* Indirection for store get and free functions. These are constant in
+this copy of the library, so they cannot be replaced. Special ones are used
+in the non-recursive case for "frames". There is also an optional callout
+function that is triggered by the (?) regex item. For Virtual Pascal, these
+definitions have to take another form. */
 
 #ifndef VPCOMPAT
-PCRE_EXP_DECL void *(*mpm_pcre_malloc)(size_t);
-PCRE_EXP_DECL void  (*mpm_pcre_free)(void *);
-PCRE_EXP_DECL void *(*mpm_pcre_stack_malloc)(size_t);
-PCRE_EXP_DECL void  (*mpm_pcre_stack_free)(void *);
-PCRE_EXP_DECL int   (*mpm_pcre_callout)(mpm_pcre_callout_block *);
+PCRE_EXP_DECL void *(* const mpm_pcre_malloc)(size_t);
+PCRE_EXP_DECL void  (* const mpm_pcre_free)(void *);
+PCRE_EXP_DECL void *(* const mpm_pcre_stack_malloc)(size_t);
+PCRE_EXP_DECL void  (* const mpm_pcre_stack_free)(void *);
+PCRE_EXP_DECL int   (* const mpm_pcre_callout)(mpm_pcre_callout_block *);
 
 PCRE_EXP_DECL void *(*pcre16_malloc)(size_t);
 PCRE_EXP_DECL void  (*pcre16_free)(void *);
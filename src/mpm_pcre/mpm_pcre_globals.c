@@ -42,8 +42,8 @@ POSSIBILITY OF SUCH DAMAGE.
 PCRE is thread-clean and doesn't use any global variables in the normal sense.
 However, it calls memory allocation and freeing functions via the four
 indirections below, and it can optionally do callouts, using the fifth
-indirection. These values can be changed by the caller, but are shared between
-all threads.
+indirection. In this copy of the library the values are constant, so they
+can be safely used by multiple threads at the same time.
 
 For MS Visual Studio and Symbian OS, there are problems in initializing these
 variables to non-local functions. In these cases, therefore, an indirection via
@@ -67,18 +67,18 @@ static void LocalPcreFree(void* aPtr)
   {
   free(aPtr);
   }
-PCRE_EXP_DATA_DEFN void *(*PUBL(malloc))(size_t) = LocalPcreMalloc;
-PCRE_EXP_DATA_DEFN void  (*PUBL(free))(void *) = LocalPcreFree;
-PCRE_EXP_DATA_DEFN void *(*PUBL(stack_malloc))(size_t) = LocalPcreMalloc;
-PCRE_EXP_DATA_DEFN void  (*PUBL(stack_free))(void *) = LocalPcreFree;
-PCRE_EXP_DATA_DEFN int   (*PUBL(callout))(PUBL(callout_block) *) = NULL;
+PCRE_EXP_DATA_DEFN void *(* const PUBL(malloc))(size_t) = LocalPcreMalloc;
+PCRE_EXP_DATA_DEFN void  (* const PUBL(free))(void *) = LocalPcreFree;
+PCRE_EXP_DATA_DEFN void *(* const PUBL(stack_malloc))(size_t) = LocalPcreMalloc;
+PCRE_EXP_DATA_DEFN void  (* const PUBL(stack_free))(void *) = LocalPcreFree;
+PCRE_EXP_DATA_DEFN int   (* const PUBL(callout))(PUBL(callout_block) *) = NULL;
 
 #elif !defined VPCOMPAT
-PCRE_EXP_DATA_DEFN void *(*PUBL(malloc))(size_t) = malloc;
-PCRE_EXP_DATA_DEFN void  (*PUBL(free))(void *) = free;
-PCRE_EXP_DATA_DEFN void *(*PUBL(stack_malloc))(size_t) = malloc;
-PCRE_EXP_DATA_DEFN void  (*PUBL(stack_free))(void *) = free;
-PCRE_EXP_DATA_DEFN int   (*PUBL(callout))(PUBL(callout_block) *) = NULL;
+PCRE_EXP_DATA_DEFN void *(* const PUBL(malloc))(size_t) = malloc;
+PCRE_EXP_DATA_DEFN void  (* const PUBL(free))(void *) = free;
+PCRE_EXP_DATA_DEFN void *(* const PUBL(stack_malloc))(size_t) = malloc;
+PCRE_EXP_DATA_DEFN void  (* const PUBL(stack_free))(void *) = free;
+PCRE_EXP_DATA_DEFN int   (* const PUBL(callout))(PUBL(callout_block) *) = NULL;
 #endif
 
 /* End of pcre_globals.c */
@@ -40,6 +40,8 @@ typedef struct rule_index_list {
 typedef struct re_list {
     struct re_list *next;
     mpm_re *re;
+    /* The pattern is matched by the bit parallel engine. */
+    mpm_uint32 bit_parallel;
     union {
         rule_index_list *rule_indices;
         mpm_uint32 *rule_indices_ptr;
@@ -86,6 +88,7 @@ typedef struct mpm_arena {
     mpm_uint32 mask;
     mpm_uint32 pattern_count;
     mpm_uint32 re_count;
+    mpm_uint32 bit_parallel_re_count;
     mpm_uint32 rule_index;
 } mpm_arena;
 
@@ -190,7 +193,7 @@ static int realloc_hash_table(mpm_arena *arena)
 
 static int mpm_private_get_byte_code(mpm_byte_code **byte_code, mpm_char8 *pattern, mpm_uint32 flags);
 
-static int compile_pattern(mpm_byte_code **byte_code, mpm_rule_pattern *rule)
+static int compile_pattern(mpm_byte_code **byte_code, mpm_rule_pattern *rule, mpm_uint32 compile_flags)
 {
     mpm_re *re = mpm_create();
     mpm_uint32 flags = (rule->flags & ~MPM_RULE_NEW);
@@ -202,7 +205,9 @@ static int compile_pattern(mpm_byte_code **byte_code, mpm_rule_pattern *rule)
     if (!re)
         return MPM_NO_MEMORY;
 
-    error_code = mpm_private_add(re, rule->pattern, 0, flags | MPM_ADD_TEST_RATING);
+    /* The low rated sub-patterns are matched by the bit parallel engine. */
+    error_code = mpm_private_add(re, rule->pattern, 0,
+        (compile_flags & MPM_COMPILE_RULES_BIT_PARALLEL) ? flags : (flags | MPM_ADD_TEST_RATING));
     mpm_free(re);
 
     if (error_code != MPM_NO_ERROR)
@@ -463,16 +468,27 @@ static mpm_uint32 update_strengths(mpm_arena *arena, sub_pattern_list *sub_patte
     return total_cover;
 }
 
-static int try_compile(mpm_arena *arena, sub_pattern_list *pattern)
+static int try_compile(mpm_arena *arena, sub_pattern_list *pattern, mpm_uint32 flags)
 {
     mpm_re *re = mpm_create();
     re_list *re_ptr;
+    mpm_uint32 bit_parallel = 0;
     int error_code;
 
     if (!re)
         return MPM_NO_MEMORY;
 
-    error_code = mpm_private_add(re, pattern->from, pattern->length, MPM_ADD_TEST_RATING);
+    if (!(flags & MPM_COMPILE_RULES_BIT_PARALLEL))
+        error_code = mpm_private_add(re, pattern->from, pattern->length, MPM_ADD_TEST_RATING);
+    else {
+        /* The byte code is modified by mpm_private_add, so it cannot be added twice. */
+        error_code = mpm_private_add(re, pattern->from, pattern->length, 0);
+        if (error_code == MPM_NO_ERROR && mpm_private_rating(re->compile.patterns) >= 8) {
+            if (re->compile.next_term_index > BIT_PARALLEL_TERM_LIMIT)
+                error_code = MPM_TOO_LOW_RATING;
+            bit_parallel = 1;
+        }
+    }
     if (error_code != MPM_NO_ERROR) {
         mpm_free(re);
         return error_code;
@@ -487,8 +503,10 @@ static int try_compile(mpm_arena *arena, sub_pattern_list *pattern)
     re_ptr->next = arena->first_re;
     arena->first_re = re_ptr;
     re_ptr->re = re;
+    re_ptr->bit_parallel = bit_parallel;
     re_ptr->u.rule_indices = pattern->rule_indices;
     arena->re_count ++;
+    arena->bit_parallel_re_count += bit_parallel;
     return MPM_NO_ERROR;
 }
 
@@ -567,101 +585,388 @@ static mpm_uint32 * compute_rule_list(re_list *first_re, mpm_uint32 rule_count,
     return rule_indices;
 }
 
+/* The bit parallel patterns are moved to the end of the items. */
 static mpm_cluster_item * create_items(re_list *re, mpm_uint32 re_count)
 {
     mpm_cluster_item *items;
     mpm_cluster_item *item;
+    mpm_cluster_item *next_item;
+    mpm_cluster_item *next_bit_parallel_item;
 
     items = (mpm_cluster_item *)malloc(sizeof(mpm_cluster_item) * re_count);
     if (!items)
         return NULL;
 
-    item = items;
+    next_item = items;
+    next_bit_parallel_item = items + re_count;
     do {
+        item = re->bit_parallel ? --next_bit_parallel_item : next_item++;
         item->re = re->re;
         item->data = re->u.rule_indices_ptr;
-        item++;
         re = re->next;
     } while (--re_count);
 
     return items;
 }
 
-static int final_phase(mpm_rule_list **result_rule_list, mpm_cluster_item *items, mpm_uint32 re_count, mpm_size *consumed_memory, mpm_uint32 flags)
+/* Copies the rule indices of the patterns of a state machine, whose
+   first item has a non-NULL re and the others are combined into it. */
+static mpm_uint32 * copy_rule_indices(mpm_cluster_item *item, mpm_cluster_item *item_end, mpm_uint32 *rule_index)
+{
+    mpm_uint32 *source;
+
+    do {
+        source = (mpm_uint32 *)item->data;
+        do {
+            rule_index[0] = source[0] & ~(PATTERN_LIST_END | RULE_LIST_END);
+            rule_index[1] = source[1];
+            rule_index += 2;
+            source += 2;
+        } while (!(source[-2] & (PATTERN_LIST_END | RULE_LIST_END)));
+        rule_index[-2] |= PATTERN_LIST_END;
+        item++;
+    } while (item < item_end && !item->re);
+
+    rule_index[-2] |= RULE_LIST_END;
+    return rule_index;
+}
+
+typedef struct compile_job {
+    /* The re is replaced when it is loaded from the compile cache. */
+    mpm_re **re;
+    mpm_uint32 flags;
+    mpm_size consumed_memory;
+    int error_code;
+} compile_job;
+
+typedef struct compile_pool {
+    compile_job *jobs;
+    mpm_uint32 no_jobs;
+    mpm_uint32 next_job;
+    char *cache_directory;
+#if defined MPM_THREADS && MPM_THREADS
+    int use_lock;
+    pthread_mutex_t lock;
+#endif
+} compile_pool;
+
+static void * compile_jobs(void *arg)
 {
+    compile_pool *pool = (compile_pool *)arg;
+    compile_job *job;
+
+    while (1) {
+#if defined MPM_THREADS && MPM_THREADS
+        if (pool->use_lock)
+            pthread_mutex_lock(&pool->lock);
+#endif
+        job = NULL;
+        if (pool->next_job < pool->no_jobs)
+            job = pool->jobs + pool->next_job++;
+#if defined MPM_THREADS && MPM_THREADS
+        if (pool->use_lock)
+            pthread_mutex_unlock(&pool->lock);
+#endif
+        if (!job)
+            return NULL;
+        job->error_code = mpm_compile_cached(job->re, &job->consumed_memory, job->flags, pool->cache_directory);
+    }
+}
+
+/* The state machines are independent, so they can be compiled in any
+   order. The jobs are taken one by one, since their compilation time
+   varies greatly. The result does not depend on the number of threads. */
+static int run_compile_jobs(compile_job *jobs, mpm_uint32 no_jobs, mpm_uint32 no_threads, char *cache_directory)
+{
+    compile_pool pool;
+#if defined MPM_THREADS && MPM_THREADS
+    pthread_t threads[MAX_THREADS];
+    int started[MAX_THREADS];
+#endif
+    mpm_uint32 i;
+
+    pool.jobs = jobs;
+    pool.no_jobs = no_jobs;
+    pool.next_job = 0;
+    pool.cache_directory = cache_directory;
+
+    /* A single state machine is compiled by multiple threads. */
+    if (no_jobs == 1 && no_threads > 1)
+        jobs[0].flags |= MPM_COMPILE_THREADS(no_threads > MAX_THREADS ? MAX_THREADS : no_threads);
+
+    if (no_threads > no_jobs)
+        no_threads = no_jobs;
+    if (no_threads > MAX_THREADS)
+        no_threads = MAX_THREADS;
+
+#if defined MPM_THREADS && MPM_THREADS
+    pool.use_lock = no_threads > 1 && pthread_mutex_init(&pool.lock, NULL) == 0;
+    if (pool.use_lock) {
+        for (i = 1; i < no_threads; i++)
+            started[i] = pthread_create(threads + i, NULL, compile_jobs, &pool) == 0;
+        compile_jobs(&pool);
+        for (i = 1; i < no_threads; i++)
+            if (started[i])
+                pthread_join(threads[i], NULL);
+        pthread_mutex_destroy(&pool.lock);
+    } else
+        compile_jobs(&pool);
+#else
+    compile_jobs(&pool);
+#endif
+
+    for (i = 0; i < no_jobs; i++)
+        if (jobs[i].error_code != MPM_NO_ERROR)
+            return jobs[i].error_code;
+    return MPM_NO_ERROR;
+}
+
+/* State machines with the same offset size are grouped together,
+   since only these can be executed by the interleaved matchers.
+   The state machines with wide end state sets or default transitions
+   are matched one by one, and the bit parallel state machines are
+   matched last. */
+#define PATTERN_LIST_ORDER_MASK (RE_OFFSET_MASK | RE_WIDE_END_STATES | RE_DEFAULT_TRANSITIONS | RE_BIT_PARALLEL)
+#define PATTERN_LIST_ORDER_SIZE 8
+
+static const mpm_uint32 pattern_list_order[PATTERN_LIST_ORDER_SIZE] = {
+    RE_OFFSET_8,
+    RE_OFFSET_16,
+    0,
+    RE_WIDE_END_STATES | RE_OFFSET_8,
+    RE_WIDE_END_STATES | RE_OFFSET_16,
+    RE_WIDE_END_STATES,
+    RE_DEFAULT_TRANSITIONS,
+    RE_BIT_PARALLEL
+};
+
+/* Default transitions are only supported by narrow end state sets. */
+static mpm_uint32 dfa_compile_flags(mpm_re *re, mpm_uint32 mapped_flags, mpm_uint32 flags)
+{
+    if ((flags & MPM_COMPILE_RULES_DEFAULT_TRANSITIONS) && re->compile.next_id <= NARROW_PATTERN_LIMIT)
+        return mapped_flags | MPM_COMPILE_DEFAULT_TRANSITIONS;
+    return mapped_flags;
+}
+
+static int final_phase(mpm_rule_list **result_rule_list, mpm_cluster_item *items, mpm_uint32 re_count,
+    mpm_uint32 bit_parallel_re_count, mpm_uint32 **rule_indices, mpm_size *consumed_memory,
+    mpm_uint32 no_threads, char *cache_directory, mpm_uint32 flags)
+{
+    mpm_uint32 *new_rule_indices;
+    mpm_uint32 *rule_index;
     mpm_rule_list *rule_list;
     pattern_list_item *pattern_list;
-    mpm_size last_consumed_memory;
+    compile_job *jobs;
+    compile_job *job;
+    mpm_re **sources;
+    mpm_re ***group_sources;
     mpm_uint32 mapped_flags;
     mpm_uint32 pattern_list_length;
+    mpm_uint32 dfa_re_count;
     mpm_uint32 group_id;
     mpm_re **re;
-    mpm_uint32 i;
+    mpm_uint32 i, j;
     int error_code;
 
-    mapped_flags = 0;
-    if (flags & MPM_COMPILE_RULES_VERBOSE)
-        mapped_flags |= MPM_CLUSTERING_VERBOSE;
-
-    error_code = mpm_clustering(items, re_count, mapped_flags);
-    if (error_code != MPM_NO_ERROR)
+    /* The bit parallel patterns are stored after the other patterns. */
+    dfa_re_count = re_count - bit_parallel_re_count;
+    pattern_list_length = 0;
+    group_sources = NULL;
+
+    /* The state machines are compiled after all groups are combined. */
+    jobs = (compile_job *)malloc(re_count * sizeof(compile_job));
+    sources = NULL;
+    if (flags & MPM_COMPILE_RULES_UPDATABLE) {
+        sources = (mpm_re **)malloc(re_count * sizeof(mpm_re *));
+        if (sources)
+            memset(sources, 0, re_count * sizeof(mpm_re *));
+    }
+    if (!jobs || ((flags & MPM_COMPILE_RULES_UPDATABLE) && !sources)) {
+        error_code = MPM_NO_MEMORY;
         goto leave;
+    }
+    job = jobs;
 
-    mapped_flags = 0;
-    if (flags & MPM_COMPILE_RULES_VERBOSE_STATS)
-        mapped_flags |= MPM_COMPILE_VERBOSE_STATS;
-
-    re = &items[0].re;
-    group_id = items[0].group_id;
-    pattern_list_length = 1;
-    for (i = 1; i < re_count; i++) {
-        if (items[i].group_id != group_id) {
-            error_code = mpm_compile(*re, &last_consumed_memory, mapped_flags);
+    if (dfa_re_count > 0) {
+        mapped_flags = 0;
+        if (flags & MPM_COMPILE_RULES_VERBOSE)
+            mapped_flags |= MPM_CLUSTERING_VERBOSE;
+
+        error_code = mpm_clustering(items, dfa_re_count, mapped_flags | MPM_CLUSTERING_THREADS(no_threads));
+        if (error_code != MPM_NO_ERROR)
+            goto leave;
+    }
+
+    /* The patterns are copied before they are combined. */
+    if (sources) {
+        for (i = 0; i < re_count; i++) {
+            error_code = mpm_combine(sources + i, items[i].re, MPM_COMBINE_COPY);
             if (error_code != MPM_NO_ERROR)
                 goto leave;
-            if (consumed_memory)
-                *consumed_memory += last_consumed_memory;
-            re = &items[i].re;
-            group_id = items[i].group_id;
-            pattern_list_length++;
-        } else {
-            error_code = mpm_combine(re, items[i].re, 0);
-            if (error_code != MPM_NO_ERROR)
+        }
+    }
+
+    if (dfa_re_count > 0) {
+        mapped_flags = 0;
+        if (flags & MPM_COMPILE_RULES_VERBOSE_STATS)
+            mapped_flags |= MPM_COMPILE_VERBOSE_STATS;
+
+        re = &items[0].re;
+        group_id = items[0].group_id;
+        pattern_list_length++;
+        for (i = 1; i < dfa_re_count; i++) {
+            if (items[i].group_id != group_id) {
+                job->re = re;
+                job->flags = dfa_compile_flags(*re, mapped_flags, flags);
+                job++;
+                re = &items[i].re;
+                group_id = items[i].group_id;
+                pattern_list_length++;
+            } else {
+                error_code = mpm_combine(re, items[i].re, 0);
+                if (error_code != MPM_NO_ERROR)
+                    goto leave;
+                items[i].re = NULL;
+            }
+        }
+
+        job->re = re;
+        job->flags = dfa_compile_flags(*re, mapped_flags, flags);
+        job++;
+    }
+
+    if (bit_parallel_re_count > 0) {
+        mapped_flags = MPM_COMPILE_BIT_PARALLEL;
+        if (flags & MPM_COMPILE_RULES_VERBOSE_STATS)
+            mapped_flags |= MPM_COMPILE_VERBOSE_STATS;
+
+        /* No clustering is needed: the matching speed does not depend
+           on the patterns, so they are combined while they fit. */
+        re = &items[dfa_re_count].re;
+        pattern_list_length++;
+        for (i = dfa_re_count + 1; i < re_count; i++) {
+            if ((*re)->compile.next_term_index + items[i].re->compile.next_term_index > BIT_PARALLEL_TERM_LIMIT
+                    || (*re)->compile.next_id >= NARROW_PATTERN_LIMIT) {
+                job->re = re;
+                job->flags = mapped_flags;
+                job++;
+                re = &items[i].re;
+                pattern_list_length++;
+            } else {
+                error_code = mpm_combine(re, items[i].re, 0);
+                if (error_code != MPM_NO_ERROR)
+                    goto leave;
+                items[i].re = NULL;
+            }
+        }
+
+        job->re = re;
+        job->flags = mapped_flags;
+        job++;
+    }
+
+    /* The copies of the patterns of each state machine are moved into a
+       separate list, since the state machines can be freed one by one. */
+    if (sources) {
+        error_code = MPM_NO_MEMORY;
+        group_sources = (mpm_re ***)malloc(re_count * sizeof(mpm_re **));
+        if (!group_sources)
+            goto leave;
+        memset(group_sources, 0, re_count * sizeof(mpm_re **));
+
+        for (i = 0; i < re_count; i = j) {
+            j = i + 1;
+            while (j < re_count && !items[j].re)
+                j++;
+            group_sources[i] = (mpm_re **)malloc((j - i + 1) * sizeof(mpm_re *));
+            if (!group_sources[i])
                 goto leave;
-            items[i].re = NULL;
+            memcpy(group_sources[i], sources + i, (j - i) * sizeof(mpm_re *));
+            memset(sources + i, 0, (j - i) * sizeof(mpm_re *));
+            group_sources[i][j - i] = NULL;
         }
     }
 
-    error_code = mpm_compile(*re, &last_consumed_memory, mapped_flags);
+    /* Verbose messages of the state machines must not be mixed. */
+    if (flags & MPM_COMPILE_RULES_VERBOSE_STATS)
+        no_threads = 1;
+
+    error_code = run_compile_jobs(jobs, job - jobs, no_threads, cache_directory);
     if (error_code != MPM_NO_ERROR)
         goto leave;
-    if (consumed_memory)
-        *consumed_memory += last_consumed_memory;
+
+    if (consumed_memory) {
+        for (i = 0; i < pattern_list_length; i++)
+            *consumed_memory += jobs[i].consumed_memory;
+        for (i = 0; group_sources && i < re_count; i++)
+            if (group_sources[i]) {
+                for (re = group_sources[i]; *re; re++)
+                    *consumed_memory += sizeof(mpm_re *) + sizeof(mpm_re) + mpm_private_get_pattern_size((*re)->compile.patterns);
+                *consumed_memory += sizeof(mpm_re *);
+            }
+    }
+    free(jobs);
+    jobs = NULL;
 
     error_code = MPM_NO_MEMORY;
     rule_list = (mpm_rule_list *)malloc(sizeof(mpm_rule_list) + ((pattern_list_length - 1) * sizeof(pattern_list_item)));
     if (!rule_list)
         goto leave;
 
+    /* The clustering reorders the patterns, so the rule indices
+       of each state machine are collected into a single list. */
+    rule_index = *rule_indices;
+    while (!(rule_index[0] & RULE_LIST_END))
+        rule_index += 2;
+    rule_index += 2;
+
+    new_rule_indices = (mpm_uint32 *)malloc((rule_index - *rule_indices) * sizeof(mpm_uint32));
+    if (!new_rule_indices) {
+        free(rule_list);
+        goto leave;
+    }
+
     rule_list->pattern_list_length = pattern_list_length;
+    rule_list->mapping = NULL;
+    rule_list->shared_control = NULL;
     pattern_list = rule_list->pattern_list;
-    for (i = 0; i < re_count; i++)
-        if (items[i].re) {
-            pattern_list->rule_indices = (mpm_uint32 *)items[i].data;
-            pattern_list->re = items[i].re;
-            pattern_list++;
-        }
+    rule_index = new_rule_indices;
+    for (j = 0; j < PATTERN_LIST_ORDER_SIZE; j++)
+        for (i = 0; i < re_count; i++)
+            if (items[i].re && (items[i].re->flags & PATTERN_LIST_ORDER_MASK) == pattern_list_order[j]) {
+                pattern_list->rule_indices = rule_index;
+                pattern_list->re = items[i].re;
+                pattern_list->sources = group_sources ? group_sources[i] : NULL;
+                pattern_list++;
+                rule_index = copy_rule_indices(items + i, items + re_count, rule_index);
+            }
 
+    free(*rule_indices);
+    *rule_indices = new_rule_indices;
     *result_rule_list = rule_list;
+    if (group_sources)
+        free(group_sources);
+    if (sources)
+        free(sources);
     free(items);
     return MPM_NO_ERROR;
 
 leave:
+    if (jobs)
+        free(jobs);
     for (i = 0; i < re_count; i++) {
         if (items[i].re)
             mpm_free(items[i].re);
+        if (sources && sources[i])
+            mpm_free(sources[i]);
+        if (group_sources)
+            mpm_private_free_sources(group_sources[i]);
     }
 
+    if (group_sources)
+        free(group_sources);
+    if (sources)
+        free(sources);
     free(items);
     return error_code;
 }
@@ -703,8 +1008,26 @@ static void print_arena_stats(mpm_arena *arena)
 /*                                 Main function.                          */
 /* ----------------------------------------------------------------------- */
 
-int mpm_compile_rules(mpm_rule_pattern *rules, mpm_size no_rule_patterns, mpm_rule_list **result_rule_list,
-    mpm_size *consumed_memory, mpm_compile_rules_args *args, mpm_uint32 flags)
+void mpm_compile_rules_args_init(mpm_compile_rules_args *args)
+{
+    args->no_selected_patterns = 0;
+    args->minimum_no_new_cover = 0;
+    args->rule_strength_scale = -1.0;
+    args->inner_distance_scale = -1.0;
+    args->outer_distance_scale = -1.0;
+    args->length_scale = -1.0;
+    args->no_threads = 0;
+    args->cache_directory = NULL;
+}
+
+/* Selects the patterns, which are matched by state machines. The rules are
+   numbered from first_rule_index, and result_rule_count is set to the index
+   after the last rule. The items and their rule indices are passed to
+   final_phase when MPM_NO_ERROR is returned. */
+static int select_patterns(mpm_rule_pattern *rules, mpm_size no_rule_patterns, mpm_uint32 first_rule_index,
+    mpm_compile_rules_args *args, mpm_cluster_item **result_items, mpm_uint32 **result_rule_indices,
+    mpm_uint32 *result_rule_count, mpm_uint32 *re_count, mpm_uint32 *bit_parallel_re_count,
+    mpm_size *consumed_memory, mpm_uint32 flags)
 {
     mpm_byte_code **byte_codes;
     mpm_byte_code **byte_code;
@@ -720,22 +1043,10 @@ int mpm_compile_rules(mpm_rule_pattern *rules, mpm_size no_rule_patterns, mpm_ru
     int error_code = MPM_NO_MEMORY;
     mpm_arena arena;
 
-    *result_rule_list = NULL;
-    if (consumed_memory)
-        *consumed_memory = 0;
-    if (!no_rule_patterns || !result_rule_list)
-        return MPM_INVALID_ARGS;
-
-    if (args) {
+    if (args)
         arena.args = *args;
-    } else {
-        arena.args.no_selected_patterns = 0;
-        arena.args.minimum_no_new_cover = 0;
-        arena.args.rule_strength_scale = -1.0;
-        arena.args.inner_distance_scale = -1.0;
-        arena.args.outer_distance_scale = -1.0;
-        arena.args.length_scale = -1.0;
-    }
+    else
+        mpm_compile_rules_args_init(&arena.args);
 
     if (arena.args.no_selected_patterns < 1) {
         if (no_rule_patterns < 16)
@@ -772,6 +1083,8 @@ int mpm_compile_rules(mpm_rule_pattern *rules, mpm_size no_rule_patterns, mpm_ru
     /* Arena initialization. */
     rule_strength = NULL;
     rule_list = NULL;
+    items = NULL;
+    rule_count = 0;
     arena.map = NULL;
     arena.first_pattern = NULL;
     arena.first_re = NULL;
@@ -795,11 +1108,12 @@ int mpm_compile_rules(mpm_rule_pattern *rules, mpm_size no_rule_patterns, mpm_ru
 
     arena.pattern_count = 0;
     arena.re_count = 0;
-    rule_count = 0;
+    arena.bit_parallel_re_count = 0;
+    rule_count = first_rule_index;
 
     byte_code = byte_codes;
     do {
-        if ((rule_count == 0) || (rules->flags & MPM_RULE_NEW)) {
+        if ((rule_count == first_rule_index) || (rules->flags & MPM_RULE_NEW)) {
             arena.rule_index = rule_count;
             rule_count++;
         }
@@ -809,7 +1123,7 @@ int mpm_compile_rules(mpm_rule_pattern *rules, mpm_size no_rule_patterns, mpm_ru
         else if ((flags & MPM_COMPILE_RULES_IGNORE_REGEX) && (!GET_FIXED_SIZE(rules->flags)))
             error_code = MPM_UNSUPPORTED_PATTERN;
         else
-            error_code = compile_pattern(byte_code, rules);
+            error_code = compile_pattern(byte_code, rules, flags);
 
         switch (error_code) {
         case MPM_NO_ERROR:
@@ -889,7 +1203,7 @@ int mpm_compile_rules(mpm_rule_pattern *rules, mpm_size no_rule_patterns, mpm_ru
         }
         all_cover += new_cover;
 
-        error_code = try_compile(&arena, max);
+        error_code = try_compile(&arena, max, flags);
         max->u.s2.strength = 0.0;
         if (error_code == MPM_TOO_LOW_RATING || error_code == MPM_EMPTY_PATTERN)
             continue;
@@ -908,7 +1222,8 @@ int mpm_compile_rules(mpm_rule_pattern *rules, mpm_size no_rule_patterns, mpm_ru
 
 #if defined MPM_VERBOSE && MPM_VERBOSE
     if (flags & MPM_COMPILE_RULES_VERBOSE)
-        printf("\n%d (%f%%) rules (from %d) are covered.\n\n", all_cover, (float)all_cover * 100.0 / (float)rule_count, rule_count);
+        printf("\n%d (%f%%) rules (from %d) are covered.\n\n", all_cover,
+            (float)all_cover * 100.0 / (float)(rule_count - first_rule_index), rule_count - first_rule_index);
 #endif
 
     if (!arena.re_count) {
@@ -946,18 +1261,448 @@ leave:
         free(rule_strength);
 
     if (error_code == MPM_NO_ERROR) {
-        error_code = final_phase(result_rule_list, items, arena.re_count, consumed_memory, flags);
+        *result_items = items;
+        *result_rule_indices = rule_list;
+        *result_rule_count = rule_count;
+        *re_count = arena.re_count;
+        *bit_parallel_re_count = arena.bit_parallel_re_count;
+    } else if (rule_list)
+        free(rule_list);
+    return error_code;
+}
+
+int mpm_compile_rules(mpm_rule_pattern *rules, mpm_size no_rule_patterns, mpm_rule_list **result_rule_list,
+    mpm_size *consumed_memory, mpm_compile_rules_args *args, mpm_uint32 flags)
+{
+    mpm_cluster_item *items;
+    mpm_uint32 *rule_list;
+    mpm_uint32 rule_count, re_count, bit_parallel_re_count;
+    int error_code;
+
+    *result_rule_list = NULL;
+    if (consumed_memory)
+        *consumed_memory = 0;
+    if (!no_rule_patterns || !result_rule_list)
+        return MPM_INVALID_ARGS;
+
+    error_code = select_patterns(rules, no_rule_patterns, 0, args, &items, &rule_list,
+        &rule_count, &re_count, &bit_parallel_re_count, consumed_memory, flags);
+    if (error_code != MPM_NO_ERROR)
+        return error_code;
+
+    error_code = final_phase(result_rule_list, items, re_count, bit_parallel_re_count, &rule_list,
+        consumed_memory, args ? args->no_threads : 0, args ? args->cache_directory : NULL, flags);
+    if (error_code != MPM_NO_ERROR) {
+        free(rule_list);
+        return error_code;
+    }
+
+    (*result_rule_list)->rule_indices = rule_list;
+    (*result_rule_list)->rule_count = rule_count;
+    (*result_rule_list)->result_length = ((rule_count - 1) & ~0x1f) >> 3;
+    (*result_rule_list)->result_last_word = (rule_count & 0x1f) == 0 ? 0xffffffff : ((mpm_uint32)1 << (rule_count & 0x1f)) - 1;
+    return MPM_NO_ERROR;
+}
+
+/* ----------------------------------------------------------------------- */
+/*                             Rule list update.                           */
+/* ----------------------------------------------------------------------- */
+
+#define RULE_REMOVED 0xffffffff
+
+/* Returns with the rule indices of the next pattern. */
+static mpm_uint32 * skip_pattern(mpm_uint32 *rule_index)
+{
+    while (!(rule_index[0] & (PATTERN_LIST_END | RULE_LIST_END)))
+        rule_index += 2;
+    return rule_index + 2;
+}
+
+/* Returns with non-zero, if the pattern belongs to a rule, which is not removed. */
+static int is_pattern_live(mpm_uint32 *rule_index, mpm_uint32 *new_rule_index)
+{
+    mpm_uint32 rule_offset, bits, index;
+
+    do {
+        rule_offset = rule_index[0];
+        /* The cleared bits represent the rules of the pattern. */
+        bits = ~rule_index[1];
+        index = (rule_offset & PATTERN_LIST_MASK) << 3;
+        while (bits) {
+            if ((bits & 0x1) && new_rule_index[index] != RULE_REMOVED)
+                return 1;
+            bits >>= 1;
+            index++;
+        }
+        rule_index += 2;
+    } while (!(rule_offset & (PATTERN_LIST_END | RULE_LIST_END)));
+    return 0;
+}
+
+/* A state machine is rebuilt, if any of its patterns belongs only to removed rules. */
+static int is_group_affected(pattern_list_item *item, mpm_uint32 *new_rule_index)
+{
+    mpm_uint32 *rule_index = item->rule_indices;
+
+    do {
+        if (!is_pattern_live(rule_index, new_rule_index))
+            return 1;
+        rule_index = skip_pattern(rule_index);
+    } while (!(rule_index[-2] & RULE_LIST_END));
+    return 0;
+}
+
+/* Copies the rule indices of a single pattern, and returns with the next free position. */
+static mpm_uint32 * copy_pattern_rule_indices(mpm_uint32 *source, mpm_uint32 *rule_index)
+{
+    do {
+        rule_index[0] = source[0] & ~(PATTERN_LIST_END | RULE_LIST_END);
+        rule_index[1] = source[1];
+        rule_index += 2;
+        source += 2;
+    } while (!(source[-2] & (PATTERN_LIST_END | RULE_LIST_END)));
+    rule_index[-2] |= PATTERN_LIST_END;
+    return rule_index;
+}
+
+/* Copies the rule indices of a state machine, and renumbers the rules by
+   new_rule_index. Removed rules are dropped, and a pattern without rules
+   gets a single entry, which clears nothing. Returns with the number of
+   words, and only computes it if destination is NULL. */
+static mpm_size renumber_rule_indices(mpm_uint32 *source, mpm_uint32 *new_rule_index, mpm_uint32 *touched_rules,
+    mpm_uint32 touched_rule_words, mpm_uint32 *destination)
+{
+    mpm_size length = 0;
+    mpm_size pattern_start;
+    mpm_uint32 rule_offset, rule_index, bits, i;
+
+    do {
+        memset(touched_rules, 0, touched_rule_words * sizeof(mpm_uint32));
+        do {
+            rule_offset = source[0];
+            /* The cleared bits represent the rules of the pattern. */
+            bits = ~source[1];
+            rule_index = (rule_offset & PATTERN_LIST_MASK) << 3;
+            while (bits) {
+                if ((bits & 0x1) && new_rule_index[rule_index] != RULE_REMOVED)
+                    touched_rules[new_rule_index[rule_index] >> 5] |= 1 << (new_rule_index[rule_index] & 0x1f);
+                bits >>= 1;
+                rule_index++;
+            }
+            source += 2;
+        } while (!(rule_offset & (PATTERN_LIST_END | RULE_LIST_END)));
+
+        pattern_start = length;
+        for (i = 0; i < touched_rule_words; i++)
+            if (touched_rules[i]) {
+                if (destination) {
+                    destination[length] = i << 2;
+                    destination[length + 1] = ~touched_rules[i];
+                }
+                length += 2;
+            }
+
+        if (length == pattern_start) {
+            if (destination) {
+                destination[length] = 0;
+                destination[length + 1] = 0xffffffff;
+            }
+            length += 2;
+        }
+
+        if (destination)
+            destination[length - 2] |= PATTERN_LIST_END | (rule_offset & RULE_LIST_END);
+    } while (!(rule_offset & RULE_LIST_END));
+
+    return length;
+}
+
+/* The remaining patterns of the affected state machines and the patterns
+   of the added rules are clustered and compiled into new state machines.
+   The rules are numbered as in rule_list, and the added rules follow them. */
+static int rebuild_groups(mpm_rule_list *rule_list, mpm_rule_list **result_rule_list,
+    mpm_rule_pattern *added, mpm_size no_added, mpm_uint32 *new_rule_index,
+    mpm_compile_rules_args *args, mpm_uint32 flags)
+{
+    mpm_cluster_item *added_items = NULL;
+    mpm_cluster_item *items = NULL;
+    mpm_cluster_item *next_item;
+    mpm_cluster_item *next_bit_parallel_item;
+    mpm_cluster_item *target;
+    mpm_uint32 *added_rule_indices = NULL;
+    mpm_uint32 *rule_indices = NULL;
+    mpm_uint32 *rule_index;
+    mpm_uint32 *source_rule_index;
+    pattern_list_item *item;
+    pattern_list_item *item_end;
+    mpm_re **source;
+    mpm_uint32 rule_count, re_count, bit_parallel_re_count;
+    mpm_uint32 added_re_count, added_bit_parallel_re_count;
+    mpm_size length;
+    mpm_uint32 i;
+    int error_code;
+
+    *result_rule_list = NULL;
+    added_re_count = 0;
+    added_bit_parallel_re_count = 0;
+    length = 0;
+    if (no_added > 0) {
+        error_code = select_patterns(added, no_added, rule_list->rule_count, args, &added_items, &added_rule_indices,
+            &rule_count, &added_re_count, &added_bit_parallel_re_count, NULL, flags);
         if (error_code == MPM_NO_ERROR) {
-            (*result_rule_list)->rule_indices = rule_list;
-            (*result_rule_list)->rule_count = rule_count;
-            (*result_rule_list)->result_length = ((rule_count - 1) & ~0x1f) >> 3;
-            (*result_rule_list)->result_last_word = (rule_count & 0x1f) == 0 ? 0xffffffff : (1 << (rule_count & 0x1f)) - 1;
-        } else
-            free(rule_list);
-    } else {
-        if (rule_list)
-            free(rule_list);
+            rule_index = added_rule_indices;
+            while (!(rule_index[0] & RULE_LIST_END))
+                rule_index += 2;
+            length = (rule_index + 2) - added_rule_indices;
+        } else if (error_code != MPM_EMPTY_PATTERN)
+            return error_code;
+    }
+
+    /* Counting the remaining patterns. */
+    re_count = added_re_count;
+    bit_parallel_re_count = added_bit_parallel_re_count;
+    item = rule_list->pattern_list;
+    item_end = item + rule_list->pattern_list_length;
+    for (; item < item_end; item++) {
+        if (!is_group_affected(item, new_rule_index))
+            continue;
+        source_rule_index = item->rule_indices;
+        for (source = item->sources; *source; source++) {
+            rule_index = skip_pattern(source_rule_index);
+            if (is_pattern_live(source_rule_index, new_rule_index)) {
+                re_count++;
+                if (item->re->flags & RE_BIT_PARALLEL)
+                    bit_parallel_re_count++;
+                length += rule_index - source_rule_index;
+            }
+            source_rule_index = rule_index;
+        }
+    }
+
+    if (re_count == 0) {
+        error_code = MPM_EMPTY_PATTERN;
+        goto leave;
+    }
+
+    error_code = MPM_NO_MEMORY;
+    items = (mpm_cluster_item *)malloc(re_count * sizeof(mpm_cluster_item));
+    rule_indices = (mpm_uint32 *)malloc(length * sizeof(mpm_uint32));
+    if (!items || !rule_indices)
+        goto leave;
+
+    for (i = 0; i < re_count; i++)
+        items[i].re = NULL;
+
+    /* The bit parallel patterns are moved to the end of the items. */
+    next_item = items;
+    next_bit_parallel_item = items + (re_count - bit_parallel_re_count);
+    rule_index = rule_indices;
+
+    for (i = 0; i < added_re_count; i++) {
+        target = (i >= added_re_count - added_bit_parallel_re_count) ? next_bit_parallel_item++ : next_item++;
+        target->re = added_items[i].re;
+        target->data = rule_index;
+        added_items[i].re = NULL;
+        rule_index = copy_pattern_rule_indices((mpm_uint32 *)added_items[i].data, rule_index);
+    }
+
+    for (item = rule_list->pattern_list; item < item_end; item++) {
+        if (!is_group_affected(item, new_rule_index))
+            continue;
+        source_rule_index = item->rule_indices;
+        for (source = item->sources; *source; source++) {
+            if (is_pattern_live(source_rule_index, new_rule_index)) {
+                target = (item->re->flags & RE_BIT_PARALLEL) ? next_bit_parallel_item++ : next_item++;
+                error_code = mpm_combine(&target->re, *source, MPM_COMBINE_COPY);
+                if (error_code != MPM_NO_ERROR)
+                    goto leave;
+                target->data = rule_index;
+                rule_index = copy_pattern_rule_indices(source_rule_index, rule_index);
+            }
+            source_rule_index = skip_pattern(source_rule_index);
+        }
+    }
+    rule_index[-2] |= RULE_LIST_END;
+
+    /* The items are freed by final_phase. */
+    error_code = final_phase(result_rule_list, items, re_count, bit_parallel_re_count, &rule_indices, NULL,
+        args ? args->no_threads : 0, args ? args->cache_directory : NULL, flags);
+    items = NULL;
+    if (error_code == MPM_NO_ERROR) {
+        (*result_rule_list)->rule_indices = rule_indices;
+        rule_indices = NULL;
+    }
+
+leave:
+    if (items) {
+        for (i = 0; i < re_count; i++)
+            if (items[i].re)
+                mpm_free(items[i].re);
+        free(items);
+    }
+    if (rule_indices)
+        free(rule_indices);
+    if (added_items) {
+        for (i = 0; i < added_re_count; i++)
+            if (added_items[i].re)
+                mpm_free(added_items[i].re);
+        free(added_items);
     }
+    if (added_rule_indices)
+        free(added_rule_indices);
+    return error_code;
+}
+
+int mpm_rule_list_update(mpm_rule_list *rule_list, mpm_rule_list **result_rule_list,
+    mpm_rule_pattern *added, mpm_size no_added, mpm_uint32 *removed, mpm_size no_removed,
+    mpm_compile_rules_args *args, mpm_uint32 flags)
+{
+    mpm_rule_list *rebuilt_list = NULL;
+    mpm_rule_list *new_list;
+    mpm_rule_list *source_list;
+    pattern_list_item *pattern_list;
+    pattern_list_item *item;
+    pattern_list_item *item_end;
+    mpm_uint32 *new_rule_index;
+    mpm_uint32 *touched_rules = NULL;
+    mpm_uint32 *rule_indices;
+    mpm_uint32 added_rule_count, new_rule_count, touched_rule_words;
+    mpm_uint32 pattern_list_length;
+    mpm_size length;
+    mpm_uint32 i, j;
+    int error_code;
+
+    *result_rule_list = NULL;
+    /* The state machines of a loaded rule list cannot outlive its mapping. */
+    if (!rule_list || rule_list->mapping || (no_added > 0 && !added) || (no_removed > 0 && !removed))
+        return MPM_INVALID_ARGS;
+
+    /* The uncompiled patterns are kept only by MPM_COMPILE_RULES_UPDATABLE. */
+    for (i = 0; i < rule_list->pattern_list_length; i++)
+        if (!rule_list->pattern_list[i].sources)
+            return MPM_INVALID_ARGS;
+    flags |= MPM_COMPILE_RULES_UPDATABLE;
+
+    added_rule_count = 0;
+    for (i = 0; i < no_added; i++)
+        if (i == 0 || (added[i].flags & MPM_RULE_NEW))
+            added_rule_count++;
+
+    /* The rule indices of the added rules follow the rules of the rule list. */
+    if ((((rule_list->rule_count + added_rule_count - 1) >> 5) << 2) > PATTERN_LIST_MASK)
+        return MPM_INVALID_ARGS;
+
+    /* The remaining rules keep their order, and the added rules are appended after them. */
+    new_rule_index = (mpm_uint32 *)malloc((rule_list->rule_count + added_rule_count) * sizeof(mpm_uint32));
+    if (!new_rule_index)
+        return MPM_NO_MEMORY;
+
+    memset(new_rule_index, 0, rule_list->rule_count * sizeof(mpm_uint32));
+    error_code = MPM_INVALID_ARGS;
+    for (i = 0; i < no_removed; i++) {
+        if (removed[i] >= rule_list->rule_count)
+            goto leave;
+        new_rule_index[removed[i]] = RULE_REMOVED;
+    }
+
+    new_rule_count = 0;
+    for (i = 0; i < rule_list->rule_count; i++)
+        if (new_rule_index[i] != RULE_REMOVED)
+            new_rule_index[i] = new_rule_count++;
+    for (i = 0; i < added_rule_count; i++)
+        new_rule_index[rule_list->rule_count + i] = new_rule_count++;
+
+    touched_rule_words = (new_rule_count + 0x1f) >> 5;
+    if (new_rule_count == 0)
+        goto leave;
+
+    /* Only the affected state machines and the patterns of the added rules are compiled. */
+    error_code = rebuild_groups(rule_list, &rebuilt_list, added, no_added, new_rule_index, args, flags);
+    if (error_code != MPM_NO_ERROR && error_code != MPM_EMPTY_PATTERN)
+        goto leave;
+
+    error_code = MPM_NO_MEMORY;
+    touched_rules = (mpm_uint32 *)malloc(touched_rule_words * sizeof(mpm_uint32));
+    if (!touched_rules)
+        goto leave;
+
+    /* The unaffected state machines are shared with the old list. */
+    length = 0;
+    pattern_list_length = 0;
+    for (source_list = rule_list; source_list; source_list = (source_list == rule_list) ? rebuilt_list : NULL) {
+        item = source_list->pattern_list;
+        item_end = item + source_list->pattern_list_length;
+        for (; item < item_end; item++) {
+            if (source_list == rule_list && is_group_affected(item, new_rule_index))
+                continue;
+            length += renumber_rule_indices(item->rule_indices, new_rule_index,
+                touched_rules, touched_rule_words, NULL);
+            pattern_list_length++;
+        }
+    }
+
+    if (pattern_list_length == 0) {
+        error_code = MPM_EMPTY_PATTERN;
+        goto leave;
+    }
+
+    new_list = (mpm_rule_list *)malloc(sizeof(mpm_rule_list) + ((pattern_list_length - 1) * sizeof(pattern_list_item)));
+    if (!new_list)
+        goto leave;
+
+    rule_indices = (mpm_uint32 *)malloc(length * sizeof(mpm_uint32));
+    if (!rule_indices) {
+        free(new_list);
+        goto leave;
+    }
+
+    new_list->rule_indices = rule_indices;
+    new_list->rule_count = new_rule_count;
+    new_list->result_length = ((new_rule_count - 1) & ~0x1f) >> 3;
+    new_list->result_last_word = (new_rule_count & 0x1f) == 0 ? 0xffffffff : ((mpm_uint32)1 << (new_rule_count & 0x1f)) - 1;
+    new_list->pattern_list_length = pattern_list_length;
+    new_list->mapping = NULL;
+    new_list->shared_control = NULL;
+
+    pattern_list = new_list->pattern_list;
+    for (j = 0; j < PATTERN_LIST_ORDER_SIZE; j++)
+        for (source_list = rule_list; source_list; source_list = (source_list == rule_list) ? rebuilt_list : NULL) {
+            item = source_list->pattern_list;
+            item_end = item + source_list->pattern_list_length;
+            for (; item < item_end; item++) {
+                if ((item->re->flags & PATTERN_LIST_ORDER_MASK) != pattern_list_order[j])
+                    continue;
+                if (source_list == rule_list && is_group_affected(item, new_rule_index))
+                    continue;
+
+                pattern_list->rule_indices = rule_indices;
+                pattern_list->re = item->re;
+                pattern_list->sources = item->sources;
+                pattern_list++;
+                rule_indices += renumber_rule_indices(item->rule_indices, new_rule_index,
+                    touched_rules, touched_rule_words, rule_indices);
+                /* The state machines of the old list are shared. */
+                if (source_list == rule_list)
+                    SHARED_COUNT_ADD(item->re, 1);
+            }
+        }
+
+    /* The state machines of the rebuilt list are moved into the new list. */
+    if (rebuilt_list) {
+        free(rebuilt_list->rule_indices);
+        free(rebuilt_list);
+        rebuilt_list = NULL;
+    }
+
+    *result_rule_list = new_list;
+    error_code = MPM_NO_ERROR;
+
+leave:
+    if (rebuilt_list)
+        mpm_rule_list_free(rebuilt_list);
+    if (touched_rules)
+        free(touched_rules);
+    free(new_rule_index);
     return error_code;
 }
 
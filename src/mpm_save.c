@@ -0,0 +1,992 @@
+/* Copyright (C) 2012 Open Information Security Foundation
+ *
+ * You can copy, redistribute or modify this Program under the terms of
+ * the GNU General Public License version 2 as published by the Free
+ * Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/**
+ * \file
+ *
+ * \author Zoltan Herczeg <zherczeg@inf.u-szeged.hu>
+ */
+
+
+#include "mpm_internal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* ----------------------------------------------------------------------- */
+/*                     Saving and loading compiled data.                   */
+/* ----------------------------------------------------------------------- */
+
+/* A file starts with a header, followed by a rule list record (rule lists
+   only), a record for each state machine and the data blocks referenced
+   by the records. Compile cache entries also end with a key block, which
+   holds the data the name of the entry is computed from. The blocks are
+   aligned to 8 bytes and referenced by their offset from the start of the
+   file, so the file can be used in place after
+   it is mapped to any address. The file uses the byte order and word size of
+   the machine which created it, and the version must be increased when the
+   layout of the compiled data changes. */
+
+#define FILE_MAGIC             0x424d504d
+#define FILE_VERSION           1
+#define FILE_WORD_SIZES        (sizeof(void *) | (sizeof(mpm_size) << 8))
+
+#define FILE_TYPE_RE           1
+#define FILE_TYPE_RULE_LIST    2
+
+#define FILE_ALIGN(size)       (((size) + 7) & ~(mpm_size)7)
+
+typedef struct file_header {
+    mpm_uint32 magic;
+    mpm_uint32 version;
+    mpm_uint32 word_sizes;
+    mpm_uint32 type;
+    /* Size of the whole file. */
+    mpm_uint32 size;
+    mpm_uint32 re_count;
+    /* Checksum of the data after the header. */
+    mpm_uint32 checksum;
+    /* Size of the key block at the end of the file. */
+    mpm_uint32 key_size;
+} file_header;
+
+typedef struct file_rule_list {
+    mpm_uint32 rule_count;
+    mpm_uint32 result_length;
+    mpm_uint32 result_last_word;
+    mpm_uint32 rule_indices_offset;
+    mpm_uint32 rule_indices_size;
+    mpm_uint32 reserved;
+} file_rule_list;
+
+typedef struct file_re {
+    mpm_uint32 flags;
+    /* Index of the first rule index of the state machine (rule lists only). */
+    mpm_uint32 rule_index;
+    /* The compiled_pattern, or the mpm_bit_parallel / mpm_default_dfa
+       structure followed by its tables. */
+    mpm_uint32 data_offset;
+    mpm_uint32 data_size;
+    mpm_uint32 end_state_sets_offset;
+    mpm_uint32 end_state_sets_size;
+    mpm_uint32 start_offset;
+    mpm_uint32 non_newline_offset;
+    mpm_uint32 newline_offset;
+    mpm_uint32 absorbing_offset;
+    mpm_uint32 all_end_states;
+    mpm_uint32 end_state_set_length;
+    mpm_uint32 skip_char_count;
+    mpm_uint8 skip_index;
+    mpm_uint8 skip_chars[SKIP_MAX_CHARS];
+    mpm_uint8 reserved[3];
+} file_re;
+
+static mpm_uint32 compute_checksum(mpm_uint32 *data, mpm_size length)
+{
+    /* FNV-1a hash of 32 bit words. */
+    mpm_uint32 hash = 2166136261u;
+
+    length /= sizeof(mpm_uint32);
+    while (length > 0) {
+        hash ^= *data++;
+        hash *= 16777619u;
+        length--;
+    }
+    return hash;
+}
+
+static mpm_size bit_parallel_tables_size(mpm_bit_parallel *bit_parallel)
+{
+    return (bit_parallel->chunk_count * 256 * (bit_parallel->term_set_length + 1)
+        + 256 * bit_parallel->term_set_length) * sizeof(mpm_uint32);
+}
+
+/* Returns with the size of the data blocks of the state machine, or 0 if it cannot be saved. */
+static mpm_size get_re_size(mpm_re *re)
+{
+    mpm_size size;
+
+    if (re->flags & (RE_MODE_COMPILE | RE_LAZY | RE_ANY_OFFSET))
+        return 0;
+
+    if (re->flags & RE_BIT_PARALLEL)
+        return FILE_ALIGN(sizeof(mpm_bit_parallel) + bit_parallel_tables_size(re->run.bit_parallel));
+
+    if (re->flags & RE_DEFAULT_TRANSITIONS)
+        return FILE_ALIGN(sizeof(mpm_default_dfa) + re->run.default_dfa->states_size);
+
+    size = FILE_ALIGN(re->run.compiled_size);
+    if (re->flags & RE_WIDE_END_STATES)
+        size += FILE_ALIGN(re->run.end_state_sets_size);
+    return size;
+}
+
+static mpm_size save_re(mpm_uint8 *image, mpm_size offset, file_re *record, mpm_re *re)
+{
+    mpm_size size;
+
+    record->flags = re->flags & ~RE_MAPPED;
+    record->data_offset = offset;
+
+    if (re->flags & RE_BIT_PARALLEL) {
+        size = bit_parallel_tables_size(re->run.bit_parallel);
+        memcpy(image + offset, re->run.bit_parallel, sizeof(mpm_bit_parallel));
+        memcpy(image + offset + sizeof(mpm_bit_parallel), re->run.bit_parallel->follow, size);
+        record->data_size = sizeof(mpm_bit_parallel) + size;
+        return offset + FILE_ALIGN(record->data_size);
+    }
+
+    if (re->flags & RE_DEFAULT_TRANSITIONS) {
+        size = re->run.default_dfa->states_size;
+        memcpy(image + offset, re->run.default_dfa, sizeof(mpm_default_dfa));
+        memcpy(image + offset + sizeof(mpm_default_dfa), re->run.default_dfa->states, size);
+        record->data_size = sizeof(mpm_default_dfa) + size;
+        return offset + FILE_ALIGN(record->data_size);
+    }
+
+    memcpy(image + offset, re->run.compiled_pattern, re->run.compiled_size);
+    record->data_size = re->run.compiled_size;
+    offset += FILE_ALIGN(re->run.compiled_size);
+
+    if (re->flags & RE_WIDE_END_STATES) {
+        memcpy(image + offset, re->run.end_state_sets, re->run.end_state_sets_size);
+        record->end_state_sets_offset = offset;
+        record->end_state_sets_size = re->run.end_state_sets_size;
+        offset += FILE_ALIGN(re->run.end_state_sets_size);
+    }
+
+    record->start_offset = re->run.start_offset;
+    record->non_newline_offset = re->run.non_newline_offset;
+    record->newline_offset = re->run.newline_offset;
+    record->absorbing_offset = re->run.absorbing_offset;
+    record->all_end_states = re->run.all_end_states;
+    record->end_state_set_length = re->run.end_state_set_length;
+    /* These members are uninitialized if RE_SKIP_START_STATE is not set. */
+    if (re->flags & RE_SKIP_START_STATE) {
+        record->skip_char_count = re->run.skip_char_count;
+        record->skip_index = re->run.skip_index;
+        memcpy(record->skip_chars, re->run.skip_chars, SKIP_MAX_CHARS);
+    }
+    return offset;
+}
+
+static int write_image(int fd, mpm_uint8 *image)
+{
+    mpm_size size = ((file_header *)image)->size;
+    ssize_t written;
+
+    while (size > 0) {
+        written = write(fd, image, size);
+        if (written <= 0)
+            return MPM_FILE_ERROR;
+        image += written;
+        size -= written;
+    }
+    return MPM_NO_ERROR;
+}
+
+/* The image is freed by the caller. Its size is stored in its header. The
+   key_size must be aligned to 8 bytes. */
+static int build_image(pattern_list_item *items, mpm_uint32 re_count, mpm_rule_list *rule_list,
+    mpm_uint32 *key, mpm_size key_size, mpm_uint8 **result_image)
+{
+    mpm_uint8 *image;
+    file_header *header;
+    file_rule_list *rule_list_record = NULL;
+    file_re *record;
+    mpm_uint32 *rule_index;
+    mpm_size rule_indices_size = 0;
+    mpm_size size, re_size;
+    mpm_uint32 i;
+
+    size = sizeof(file_header) + re_count * sizeof(file_re) + key_size;
+
+    if (rule_list) {
+        size += sizeof(file_rule_list);
+        /* The rule indices of the last state machine are not necessarily the last ones. */
+        for (i = 0; i < re_count; i++) {
+            rule_index = items[i].rule_indices;
+            while (!(rule_index[0] & RULE_LIST_END))
+                rule_index += 2;
+            rule_index += 2;
+            if ((mpm_size)(rule_index - rule_list->rule_indices) * sizeof(mpm_uint32) > rule_indices_size)
+                rule_indices_size = (rule_index - rule_list->rule_indices) * sizeof(mpm_uint32);
+        }
+        size += FILE_ALIGN(rule_indices_size);
+    }
+
+    for (i = 0; i < re_count; i++) {
+        re_size = get_re_size(items[i].re);
+        if (re_size == 0)
+            return (items[i].re->flags & RE_MODE_COMPILE) ? MPM_RE_IS_NOT_COMPILED : MPM_INVALID_ARGS;
+        size += re_size;
+    }
+
+    if (size > 0xffffffff)
+        return MPM_INVALID_ARGS;
+
+    image = (mpm_uint8 *)malloc(size);
+    if (!image)
+        return MPM_NO_MEMORY;
+    memset(image, 0, size);
+
+    header = (file_header *)image;
+    header->magic = FILE_MAGIC;
+    header->version = FILE_VERSION;
+    header->word_sizes = FILE_WORD_SIZES;
+    header->type = rule_list ? FILE_TYPE_RULE_LIST : FILE_TYPE_RE;
+    header->size = size;
+    header->re_count = re_count;
+    header->key_size = key_size;
+
+    size = sizeof(file_header);
+    if (rule_list) {
+        rule_list_record = (file_rule_list *)(image + size);
+        size += sizeof(file_rule_list);
+    }
+    record = (file_re *)(image + size);
+    size += re_count * sizeof(file_re);
+
+    if (rule_list) {
+        rule_list_record->rule_count = rule_list->rule_count;
+        rule_list_record->result_length = rule_list->result_length;
+        rule_list_record->result_last_word = rule_list->result_last_word;
+        rule_list_record->rule_indices_offset = size;
+        rule_list_record->rule_indices_size = rule_indices_size;
+        memcpy(image + size, rule_list->rule_indices, rule_indices_size);
+        size += FILE_ALIGN(rule_indices_size);
+    }
+
+    for (i = 0; i < re_count; i++) {
+        if (rule_list)
+            record[i].rule_index = items[i].rule_indices - rule_list->rule_indices;
+        size = save_re(image, size, record + i, items[i].re);
+    }
+
+    if (key_size > 0)
+        memcpy(image + size, key, key_size);
+
+    header->checksum = compute_checksum((mpm_uint32 *)(header + 1), header->size - sizeof(file_header));
+
+    *result_image = image;
+    return MPM_NO_ERROR;
+}
+
+/* The image is written under the temp_name first (which must be a mkstemp
+   template in the directory of file_name), and renamed to file_name after,
+   so other processes never load a partially written file. */
+static int replace_file(mpm_uint8 *image, char *temp_name, char *file_name)
+{
+    int fd;
+    int error;
+
+    fd = mkstemp(temp_name);
+    if (fd < 0)
+        return MPM_FILE_ERROR;
+
+    /* The files can be shared with other users. */
+    fchmod(fd, 0644);
+    error = write_image(fd, image);
+    if (close(fd) != 0)
+        error = MPM_FILE_ERROR;
+    if (error == MPM_NO_ERROR && rename(temp_name, file_name) != 0)
+        error = MPM_FILE_ERROR;
+    if (error != MPM_NO_ERROR)
+        unlink(temp_name);
+    return error;
+}
+
+static int save_image(mpm_uint8 *image, char *file_name)
+{
+    char *temp_name;
+    int error;
+
+    temp_name = (char *)malloc(strlen(file_name) + 8);
+    if (!temp_name) {
+        free(image);
+        return MPM_NO_MEMORY;
+    }
+    sprintf(temp_name, "%s.XXXXXX", file_name);
+
+    error = replace_file(image, temp_name, file_name);
+    free(temp_name);
+    free(image);
+    return error;
+}
+
+int mpm_save(mpm_re *re, char *file_name)
+{
+    pattern_list_item item;
+    mpm_uint8 *image;
+    int error;
+
+    item.rule_indices = NULL;
+    item.re = re;
+    error = build_image(&item, 1, NULL, NULL, 0, &image);
+    if (error != MPM_NO_ERROR)
+        return error;
+    return save_image(image, file_name);
+}
+
+int mpm_rule_list_save(mpm_rule_list *rule_list, char *file_name)
+{
+    mpm_uint8 *image;
+    int error;
+
+    error = build_image(rule_list->pattern_list, rule_list->pattern_list_length, rule_list, NULL, 0, &image);
+    if (error != MPM_NO_ERROR)
+        return error;
+    return save_image(image, file_name);
+}
+
+void mpm_private_unmap(void *mapping, mpm_size mapping_size)
+{
+    munmap(mapping, mapping_size);
+}
+
+/* The file descriptor is not closed. */
+static int map_image(int fd, mpm_uint32 type, mpm_uint8 **result_image, mpm_size *result_size)
+{
+    struct stat file_stat;
+    mpm_uint8 *image;
+    file_header *header;
+    mpm_size size;
+
+    if (fstat(fd, &file_stat) != 0)
+        return MPM_FILE_ERROR;
+
+    size = (mpm_size)file_stat.st_size;
+    if (size < sizeof(file_header) || (size & 0x7) || (off_t)size != file_stat.st_size)
+        return MPM_INVALID_FILE;
+
+    /* The pages are shared by all processes which load the same file. */
+    image = (mpm_uint8 *)mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (image == MAP_FAILED)
+        return MPM_FILE_ERROR;
+
+    header = (file_header *)image;
+    if (header->magic != FILE_MAGIC || header->version != FILE_VERSION
+            || header->word_sizes != FILE_WORD_SIZES || header->type != type
+            || header->size != size || header->re_count == 0
+            || header->key_size > size - sizeof(file_header) || (header->key_size & 0x7)
+            || header->checksum != compute_checksum((mpm_uint32 *)(header + 1), size - sizeof(file_header))) {
+        munmap(image, size);
+        return MPM_INVALID_FILE;
+    }
+
+    *result_image = image;
+    *result_size = size;
+    return MPM_NO_ERROR;
+}
+
+/* Checks that the block is inside the image and aligned to 8 bytes. */
+#define CHECK_BLOCK(offset, block_size) \
+    ((offset) >= sizeof(file_header) && !((offset) & 0x7) \
+        && (offset) <= size && (block_size) <= size - (offset))
+
+static int load_re(mpm_uint8 *image, mpm_size size, file_re *record, mpm_re **result_re)
+{
+    mpm_mapped_re *mapped_re;
+    mpm_re *re;
+    mpm_uint8 *data = image + record->data_offset;
+
+    if (!CHECK_BLOCK(record->data_offset, record->data_size)
+            || (record->flags & (RE_MODE_COMPILE | RE_LAZY | RE_ANY_OFFSET | RE_MAPPED)))
+        return MPM_INVALID_FILE;
+
+    mapped_re = (mpm_mapped_re *)malloc(sizeof(mpm_mapped_re));
+    if (!mapped_re)
+        return MPM_NO_MEMORY;
+    memset(mapped_re, 0, sizeof(mpm_mapped_re));
+
+    re = &mapped_re->re;
+    re->flags = record->flags | RE_MAPPED;
+
+    if (record->flags & RE_BIT_PARALLEL) {
+        /* Only the structure is copied, the tables are used in place. */
+        if (record->data_size < sizeof(mpm_bit_parallel))
+            goto invalid_file;
+        re->run.bit_parallel = (mpm_bit_parallel *)malloc(sizeof(mpm_bit_parallel));
+        if (!re->run.bit_parallel) {
+            free(mapped_re);
+            return MPM_NO_MEMORY;
+        }
+        memcpy(re->run.bit_parallel, data, sizeof(mpm_bit_parallel));
+        if (re->run.bit_parallel->term_set_length == 0 || re->run.bit_parallel->term_set_length > BIT_PARALLEL_MAX_WORDS
+                || re->run.bit_parallel->chunk_count == 0 || re->run.bit_parallel->chunk_count > BIT_PARALLEL_TERM_LIMIT / 8
+                || sizeof(mpm_bit_parallel) + bit_parallel_tables_size(re->run.bit_parallel) != record->data_size) {
+            free(re->run.bit_parallel);
+            goto invalid_file;
+        }
+        re->run.bit_parallel->follow = (mpm_uint32 *)(data + sizeof(mpm_bit_parallel));
+        re->run.bit_parallel->class_terms = re->run.bit_parallel->follow
+            + re->run.bit_parallel->chunk_count * 256 * (re->run.bit_parallel->term_set_length + 1);
+        *result_re = re;
+        return MPM_NO_ERROR;
+    }
+
+    if (record->flags & RE_DEFAULT_TRANSITIONS) {
+        if (record->data_size < sizeof(mpm_default_dfa))
+            goto invalid_file;
+        re->run.default_dfa = (mpm_default_dfa *)malloc(sizeof(mpm_default_dfa));
+        if (!re->run.default_dfa) {
+            free(mapped_re);
+            return MPM_NO_MEMORY;
+        }
+        memcpy(re->run.default_dfa, data, sizeof(mpm_default_dfa));
+        if (sizeof(mpm_default_dfa) + re->run.default_dfa->states_size != record->data_size
+                || re->run.default_dfa->start_offsets[0] >= re->run.default_dfa->states_size / sizeof(mpm_uint32)
+                || re->run.default_dfa->start_offsets[1] >= re->run.default_dfa->states_size / sizeof(mpm_uint32)
+                || re->run.default_dfa->start_offsets[2] >= re->run.default_dfa->states_size / sizeof(mpm_uint32)) {
+            free(re->run.default_dfa);
+            goto invalid_file;
+        }
+        re->run.default_dfa->states = (mpm_uint32 *)(data + sizeof(mpm_default_dfa));
+        *result_re = re;
+        return MPM_NO_ERROR;
+    }
+
+    if (record->data_size <= CHAR_CLASS_TABLE_SIZE
+            || record->start_offset >= record->data_size - CHAR_CLASS_TABLE_SIZE
+            || record->non_newline_offset >= record->data_size - CHAR_CLASS_TABLE_SIZE
+            || record->newline_offset >= record->data_size - CHAR_CLASS_TABLE_SIZE
+            || record->skip_char_count > SKIP_MAX_CHARS)
+        goto invalid_file;
+
+    if (record->flags & RE_WIDE_END_STATES) {
+        if (!CHECK_BLOCK(record->end_state_sets_offset, record->end_state_sets_size)
+                || record->end_state_sets_size < record->end_state_set_length * sizeof(mpm_uint32))
+            goto invalid_file;
+        re->run.end_state_sets = (mpm_uint32 *)(image + record->end_state_sets_offset);
+        re->run.end_state_sets_size = record->end_state_sets_size;
+    }
+
+    re->run.compiled_pattern = data;
+    re->run.compiled_size = record->data_size;
+    re->run.start_offset = record->start_offset;
+    re->run.non_newline_offset = record->non_newline_offset;
+    re->run.newline_offset = record->newline_offset;
+    re->run.absorbing_offset = record->absorbing_offset;
+    re->run.all_end_states = record->all_end_states;
+    re->run.end_state_set_length = record->end_state_set_length;
+    re->run.skip_char_count = record->skip_char_count;
+    re->run.skip_index = record->skip_index;
+    memcpy(re->run.skip_chars, record->skip_chars, SKIP_MAX_CHARS);
+    *result_re = re;
+    return MPM_NO_ERROR;
+
+invalid_file:
+    free(mapped_re);
+    return MPM_INVALID_FILE;
+}
+
+/* The file is rejected if its key block is different from the key (when
+   the key is not NULL). */
+static int load_file(mpm_re **result_re, char *file_name, mpm_uint32 *key, mpm_size key_size)
+{
+    mpm_uint8 *image;
+    mpm_size size;
+    int fd;
+    int error;
+
+    fd = open(file_name, O_RDONLY);
+    if (fd < 0)
+        return MPM_FILE_ERROR;
+    error = map_image(fd, FILE_TYPE_RE, &image, &size);
+    close(fd);
+    if (error != MPM_NO_ERROR)
+        return error;
+
+    if (((file_header *)image)->re_count != 1
+            || (key && (((file_header *)image)->key_size != key_size
+                || memcmp(image + size - key_size, key, key_size) != 0))) {
+        munmap(image, size);
+        return MPM_INVALID_FILE;
+    }
+
+    error = load_re(image, size, (file_re *)(image + sizeof(file_header)), result_re);
+    if (error != MPM_NO_ERROR) {
+        munmap(image, size);
+        return error;
+    }
+
+    ((mpm_mapped_re *)*result_re)->mapping = image;
+    ((mpm_mapped_re *)*result_re)->mapping_size = size;
+    return MPM_NO_ERROR;
+}
+
+int mpm_load(mpm_re **result_re, char *file_name)
+{
+    return load_file(result_re, file_name, NULL, 0);
+}
+
+/* The image is unmapped if an error occurs. */
+static int load_rule_list(mpm_uint8 *image, mpm_size size, mpm_rule_list **result_rule_list)
+{
+    mpm_rule_list *rule_list;
+    file_rule_list *rule_list_record;
+    file_re *record;
+    mpm_uint32 *rule_indices;
+    mpm_uint32 re_count, rule_indices_length, i;
+    int error;
+
+    re_count = ((file_header *)image)->re_count;
+    rule_list_record = (file_rule_list *)(image + sizeof(file_header));
+    record = (file_re *)(rule_list_record + 1);
+
+    if (re_count > (size - sizeof(file_header) - sizeof(file_rule_list)) / sizeof(file_re)
+            || !CHECK_BLOCK(rule_list_record->rule_indices_offset, rule_list_record->rule_indices_size)
+            || rule_list_record->rule_indices_size < 2 * sizeof(mpm_uint32)
+            || (rule_list_record->rule_indices_size & 0x7)) {
+        munmap(image, size);
+        return MPM_INVALID_FILE;
+    }
+
+    rule_indices = (mpm_uint32 *)(image + rule_list_record->rule_indices_offset);
+    rule_indices_length = rule_list_record->rule_indices_size / sizeof(mpm_uint32);
+    /* The rule index lists of the state machines must be terminated inside the block. */
+    if (!(rule_indices[rule_indices_length - 2] & RULE_LIST_END)) {
+        munmap(image, size);
+        return MPM_INVALID_FILE;
+    }
+
+    rule_list = (mpm_rule_list *)malloc(sizeof(mpm_rule_list) + (re_count - 1) * sizeof(pattern_list_item));
+    if (!rule_list) {
+        munmap(image, size);
+        return MPM_NO_MEMORY;
+    }
+
+    rule_list->rule_indices = rule_indices;
+    rule_list->rule_count = rule_list_record->rule_count;
+    rule_list->result_length = rule_list_record->result_length;
+    rule_list->result_last_word = rule_list_record->result_last_word;
+    rule_list->mapping = image;
+    rule_list->mapping_size = size;
+    rule_list->shared_control = NULL;
+
+    for (i = 0; i < re_count; i++, record++) {
+        if (record->rule_index >= rule_indices_length || (record->rule_index & 0x1))
+            error = MPM_INVALID_FILE;
+        else
+            error = load_re(image, size, record, &rule_list->pattern_list[i].re);
+
+        if (error != MPM_NO_ERROR) {
+            rule_list->pattern_list_length = i;
+            mpm_rule_list_free(rule_list);
+            return error;
+        }
+        rule_list->pattern_list[i].rule_indices = rule_indices + record->rule_index;
+        rule_list->pattern_list[i].sources = NULL;
+    }
+    rule_list->pattern_list_length = re_count;
+
+    *result_rule_list = rule_list;
+    return MPM_NO_ERROR;
+}
+
+int mpm_rule_list_load(mpm_rule_list **result_rule_list, char *file_name)
+{
+    mpm_uint8 *image;
+    mpm_size size;
+    int fd;
+    int error;
+
+    fd = open(file_name, O_RDONLY);
+    if (fd < 0)
+        return MPM_FILE_ERROR;
+    error = map_image(fd, FILE_TYPE_RULE_LIST, &image, &size);
+    close(fd);
+    if (error != MPM_NO_ERROR)
+        return error;
+    return load_rule_list(image, size, result_rule_list);
+}
+
+/* ----------------------------------------------------------------------- */
+/*                          Shared memory segments.                        */
+/* ----------------------------------------------------------------------- */
+
+/* A published rule list is stored in the "<name>.<generation>" segment in the
+   same format as a file, and the current generation is stored in the "<name>"
+   control segment. The new segment is completely written before the generation
+   is increased, and the previous segment is unlinked afterwards. The processes
+   which attached the previous segment keep using it until they free it.
+
+   Each publisher creates its segment exclusively, so concurrent publishers
+   use different generations. The control segment is locked while the current
+   generation is replaced, and the newest generation always wins. */
+
+#define SHARED_MAGIC           0x534d504d
+
+static char * segment_name(char *name, mpm_uint32 generation)
+{
+    char *result = (char *)malloc(strlen(name) + 12);
+
+    if (result)
+        sprintf(result, "%s.%u", name, generation);
+    return result;
+}
+
+static void unlink_segment(char *name, mpm_uint32 generation)
+{
+    char *data_name = segment_name(name, generation);
+
+    if (data_name) {
+        shm_unlink(data_name);
+        free(data_name);
+    }
+}
+
+static int lock_control(int fd, short type)
+{
+    struct flock lock;
+
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    while (fcntl(fd, F_SETLKW, &lock) != 0)
+        if (errno != EINTR)
+            return MPM_FILE_ERROR;
+    return MPM_NO_ERROR;
+}
+
+/* Creates a new segment with a generation which is not used by others. */
+static int create_segment(char *name, mpm_uint32 *generation)
+{
+    char *data_name;
+    int fd;
+
+    while (1) {
+        if (*generation == 0)
+            *generation = 1;
+        data_name = segment_name(name, *generation);
+        if (!data_name) {
+            errno = ENOMEM;
+            return -1;
+        }
+        fd = shm_open(data_name, O_RDWR | O_CREAT | O_EXCL, 0644);
+        free(data_name);
+        if (fd >= 0 || errno != EEXIST)
+            return fd;
+        (*generation)++;
+    }
+}
+
+int mpm_rule_list_publish(mpm_rule_list *rule_list, char *name)
+{
+    mpm_uint8 *image;
+    volatile mpm_uint32 *control;
+    mpm_uint32 generation, current;
+    int control_fd;
+    int fd;
+    int error;
+
+    error = build_image(rule_list->pattern_list, rule_list->pattern_list_length, rule_list, NULL, 0, &image);
+    if (error != MPM_NO_ERROR)
+        return error;
+
+    control_fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+    if (control_fd < 0) {
+        free(image);
+        return MPM_FILE_ERROR;
+    }
+
+    /* A newly created control segment is filled with zeroes. */
+    control = MAP_FAILED;
+    if (ftruncate(control_fd, SHARED_CONTROL_SIZE) == 0)
+        control = (volatile mpm_uint32 *)mmap(NULL, SHARED_CONTROL_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, control_fd, 0);
+    if (control == MAP_FAILED) {
+        close(control_fd);
+        free(image);
+        return MPM_FILE_ERROR;
+    }
+
+    if (control[0] != SHARED_MAGIC && control[0] != 0) {
+        error = MPM_INVALID_FILE;
+        goto leave;
+    }
+
+    generation = control[1] + 1;
+    fd = create_segment(name, &generation);
+    if (fd < 0) {
+        error = (errno == ENOMEM) ? MPM_NO_MEMORY : MPM_FILE_ERROR;
+        goto leave;
+    }
+
+    error = write_image(fd, image);
+    close(fd);
+    if (error == MPM_NO_ERROR)
+        error = lock_control(control_fd, F_WRLCK);
+    if (error != MPM_NO_ERROR) {
+        unlink_segment(name, generation);
+        goto leave;
+    }
+
+    control[0] = SHARED_MAGIC;
+    current = control[1];
+    if (current == 0 || (int32_t)(generation - current) > 0) {
+        /* The segment must be complete before it is published. */
+        MEMORY_BARRIER();
+        control[1] = generation;
+        if (current != 0)
+            unlink_segment(name, current);
+    } else {
+        /* A newer generation is published by another process. */
+        unlink_segment(name, generation);
+    }
+    lock_control(control_fd, F_UNLCK);
+
+leave:
+    munmap((void *)control, SHARED_CONTROL_SIZE);
+    close(control_fd);
+    free(image);
+    return error;
+}
+
+int mpm_rule_list_attach(mpm_rule_list **result_rule_list, char *name)
+{
+    mpm_uint8 *image;
+    mpm_size size;
+    volatile mpm_uint32 *control;
+    mpm_uint32 generation;
+    char *data_name;
+    int fd;
+    int error;
+
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+        return MPM_FILE_ERROR;
+    control = (volatile mpm_uint32 *)mmap(NULL, SHARED_CONTROL_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (control == MAP_FAILED)
+        return MPM_FILE_ERROR;
+
+    if (control[0] != SHARED_MAGIC) {
+        error = MPM_INVALID_FILE;
+        goto error_exit;
+    }
+
+    /* The segment is unlinked if a newer generation is published
+       before it is opened. In this case the newer one is opened. */
+    while (1) {
+        generation = control[1];
+        MEMORY_BARRIER();
+        if (generation == 0) {
+            error = MPM_FILE_ERROR;
+            goto error_exit;
+        }
+
+        data_name = segment_name(name, generation);
+        if (!data_name) {
+            error = MPM_NO_MEMORY;
+            goto error_exit;
+        }
+        fd = shm_open(data_name, O_RDONLY, 0);
+        error = errno;
+        free(data_name);
+
+        if (fd >= 0)
+            break;
+        if (error != ENOENT || control[1] == generation) {
+            error = MPM_FILE_ERROR;
+            goto error_exit;
+        }
+    }
+
+    error = map_image(fd, FILE_TYPE_RULE_LIST, &image, &size);
+    close(fd);
+    if (error == MPM_NO_ERROR)
+        error = load_rule_list(image, size, result_rule_list);
+    if (error != MPM_NO_ERROR)
+        goto error_exit;
+
+    (*result_rule_list)->shared_control = (mpm_uint32 *)control;
+    (*result_rule_list)->generation = generation;
+    return MPM_NO_ERROR;
+
+error_exit:
+    munmap((void *)control, SHARED_CONTROL_SIZE);
+    return error;
+}
+
+int mpm_rule_list_outdated(mpm_rule_list *rule_list)
+{
+    if (!rule_list->shared_control)
+        return 0;
+    return ((volatile mpm_uint32 *)rule_list->shared_control)[1] != rule_list->generation;
+}
+
+int mpm_rule_list_unpublish(char *name)
+{
+    volatile mpm_uint32 *control;
+    int fd;
+
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+        return MPM_FILE_ERROR;
+    control = (volatile mpm_uint32 *)mmap(NULL, SHARED_CONTROL_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (control == MAP_FAILED)
+        return MPM_FILE_ERROR;
+
+    if (control[0] == SHARED_MAGIC && control[1] != 0)
+        unlink_segment(name, control[1]);
+    munmap((void *)control, SHARED_CONTROL_SIZE);
+    shm_unlink(name);
+    return MPM_NO_ERROR;
+}
+
+/* ----------------------------------------------------------------------- */
+/*                               Compile cache.                            */
+/* ----------------------------------------------------------------------- */
+
+/* These flags do not change the matching of the compiled state machine. */
+#define CACHE_IGNORED_FLAGS \
+    (MPM_COMPILE_VERBOSE | MPM_COMPILE_VERBOSE_STATS | MPM_COMPILE_THREADS(0xff))
+
+/* The key is built from the byte code of the patterns, not from their source.
+   It is stored in the cache entry, and compared before the entry is used, so
+   the entries with the same hash are never confused. */
+static mpm_uint32 * build_cache_key(mpm_re *re, mpm_uint32 flags, mpm_size *result_size)
+{
+    mpm_re_pattern *pattern;
+    mpm_uint32 *key;
+    mpm_uint8 *data;
+    mpm_size size, pattern_size;
+
+    size = 3 * sizeof(mpm_uint32);
+    pattern = re->compile.patterns;
+    while (pattern) {
+        size += mpm_private_get_pattern_size(pattern) - (mpm_size)((mpm_uint8 *)&pattern->flags - (mpm_uint8 *)pattern);
+        pattern = pattern->next;
+    }
+    size = FILE_ALIGN(size);
+
+    key = (mpm_uint32 *)malloc(size);
+    if (!key)
+        return NULL;
+    memset(key, 0, size);
+
+    key[0] = FILE_VERSION;
+    key[1] = re->flags;
+    key[2] = flags & ~CACHE_IGNORED_FLAGS;
+
+    data = (mpm_uint8 *)(key + 3);
+    pattern = re->compile.patterns;
+    while (pattern) {
+        pattern_size = mpm_private_get_pattern_size(pattern) - (mpm_size)((mpm_uint8 *)&pattern->flags - (mpm_uint8 *)pattern);
+        memcpy(data, &pattern->flags, pattern_size);
+        data += pattern_size;
+        pattern = pattern->next;
+    }
+
+    *result_size = size;
+    return key;
+}
+
+static void hash_cache_key(mpm_uint32 *hash, mpm_uint32 *key, mpm_size length)
+{
+    /* Two different 32 bit hashes form a 64 bit hash. */
+    hash[0] = 2166136261u;
+    hash[1] = 0;
+    while (length > 0) {
+        hash[0] = (hash[0] ^ *key) * 16777619u;
+        hash[1] = (hash[1] + *key) * 0x9e3779b1u;
+        hash[1] ^= hash[1] >> 15;
+        key++;
+        length--;
+    }
+}
+
+static mpm_size get_loaded_size(mpm_re *re)
+{
+    if (re->flags & RE_BIT_PARALLEL)
+        return sizeof(mpm_re) + sizeof(mpm_bit_parallel) + bit_parallel_tables_size(re->run.bit_parallel);
+    if (re->flags & RE_DEFAULT_TRANSITIONS)
+        return sizeof(mpm_re) + sizeof(mpm_default_dfa) + re->run.default_dfa->states_size;
+    if (re->flags & RE_WIDE_END_STATES)
+        return sizeof(mpm_re) + re->run.compiled_size + re->run.end_state_sets_size;
+    return sizeof(mpm_re) + re->run.compiled_size;
+}
+
+static void store_cache_entry(mpm_re *re, mpm_uint32 *key, mpm_size key_size, char *cache_directory, char *file_name)
+{
+    pattern_list_item item;
+    mpm_uint8 *image;
+    char *temp_name;
+
+    item.rule_indices = NULL;
+    item.re = re;
+    if (build_image(&item, 1, NULL, key, key_size, &image) != MPM_NO_ERROR)
+        return;
+
+    temp_name = (char *)malloc(strlen(cache_directory) + 16);
+    if (!temp_name) {
+        free(image);
+        return;
+    }
+    sprintf(temp_name, "%s/.mpm-XXXXXX", cache_directory);
+
+    replace_file(image, temp_name, file_name);
+    free(temp_name);
+    free(image);
+}
+
+int mpm_compile_cached(mpm_re **re, mpm_size *consumed_memory, mpm_uint32 flags, char *cache_directory)
+{
+    mpm_re *cached_re;
+    mpm_uint32 *key;
+    mpm_size key_size;
+    mpm_uint32 hash[2];
+    char *file_name;
+    int error_code;
+
+    if (!cache_directory || (flags & MPM_COMPILE_LAZY) || !((*re)->flags & RE_MODE_COMPILE))
+        return mpm_compile(*re, consumed_memory, flags);
+
+    key = build_cache_key(*re, flags, &key_size);
+    if (!key)
+        return MPM_NO_MEMORY;
+    hash_cache_key(hash, key, key_size / sizeof(mpm_uint32));
+
+    file_name = (char *)malloc(strlen(cache_directory) + 22);
+    if (!file_name) {
+        free(key);
+        return MPM_NO_MEMORY;
+    }
+    sprintf(file_name, "%s/%08x%08x.mpm", cache_directory, hash[0], hash[1]);
+
+    if (load_file(&cached_re, file_name, key, key_size) == MPM_NO_ERROR) {
+        mpm_free(*re);
+        *re = cached_re;
+        if (consumed_memory)
+            *consumed_memory = get_loaded_size(cached_re);
+        free(key);
+        free(file_name);
+        return MPM_NO_ERROR;
+    }
+
+    error_code = mpm_compile(*re, consumed_memory, flags);
+    /* The cache is optional, so the errors of storing the entry are ignored. */
+    if (error_code == MPM_NO_ERROR)
+        store_cache_entry(*re, key, key_size, cache_directory, file_name);
+    free(key);
+    free(file_name);
+    return error_code;
+}
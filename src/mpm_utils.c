@@ -34,6 +34,7 @@ mpm_re * mpm_create(void)
         return NULL;
 
     re->flags = RE_MODE_COMPILE;
+    re->shared_count = 0;
     re->compile.patterns = NULL;
     re->compile.next_id = 0;
     re->compile.next_term_index = 0;
@@ -41,6 +42,40 @@ mpm_re * mpm_create(void)
     return re;
 }
 
+#if !(defined HAVE_SYNC_BUILTINS && HAVE_SYNC_BUILTINS)
+
+#if defined MPM_THREADS && MPM_THREADS
+/* Locking and unlocking a mutex also synchronizes the memory. */
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+mpm_uint32 mpm_private_shared_count_add(mpm_re *re, mpm_uint32 value)
+{
+    mpm_uint32 shared_count;
+
+#if defined MPM_THREADS && MPM_THREADS
+    pthread_mutex_lock(&sync_lock);
+#endif
+    shared_count = re->shared_count;
+    re->shared_count = shared_count + value;
+#if defined MPM_THREADS && MPM_THREADS
+    pthread_mutex_unlock(&sync_lock);
+#endif
+    return shared_count;
+}
+
+void mpm_private_memory_barrier(void)
+{
+    /* Without threads, the function call prevents the compiler from
+       moving memory accesses across the barrier. */
+#if defined MPM_THREADS && MPM_THREADS
+    pthread_mutex_lock(&sync_lock);
+    pthread_mutex_unlock(&sync_lock);
+#endif
+}
+
+#endif
+
 void mpm_private_free_patterns(mpm_re_pattern *pattern)
 {
     mpm_re_pattern *next;
@@ -56,23 +91,54 @@ void mpm_free(mpm_re *re)
     if (re->flags & RE_MODE_COMPILE) {
         if (re->compile.patterns)
             mpm_private_free_patterns(re->compile.patterns);
-    } else {
+    } else if (re->flags & RE_LAZY) {
+        mpm_private_free_lazy(re->run.lazy_dfa);
+    } else if (re->flags & RE_BIT_PARALLEL) {
+        free(re->run.bit_parallel);
+    } else if (re->flags & RE_DEFAULT_TRANSITIONS) {
+        free(re->run.default_dfa);
+    } else if (!(re->flags & RE_MAPPED)) {
         if (re->run.compiled_pattern)
             free(re->run.compiled_pattern);
+        if (re->flags & RE_WIDE_END_STATES)
+            free(re->run.end_state_sets);
     }
+
+    if ((re->flags & RE_MAPPED) && ((mpm_mapped_re *)re)->mapping)
+        mpm_private_unmap(((mpm_mapped_re *)re)->mapping, ((mpm_mapped_re *)re)->mapping_size);
     free(re);
 }
 
+void mpm_private_free_sources(mpm_re **sources)
+{
+    mpm_re **source = sources;
+
+    if (!sources)
+        return;
+    while (*source)
+        mpm_free(*source++);
+    free(sources);
+}
+
 void mpm_rule_list_free(mpm_rule_list *rule_list)
 {
     pattern_list_item *pattern_list = rule_list->pattern_list;
     pattern_list_item *pattern_list_end = pattern_list + rule_list->pattern_list_length;
     while (pattern_list < pattern_list_end) {
-        mpm_free(pattern_list->re);
+        /* Shared state machines are freed by the last rule list. */
+        if (SHARED_COUNT_ADD(pattern_list->re, -1) == 0) {
+            mpm_free(pattern_list->re);
+            mpm_private_free_sources(pattern_list->sources);
+        }
         pattern_list++;
     }
 
-    free(rule_list->rule_indices);
+    if (rule_list->shared_control)
+        mpm_private_unmap(rule_list->shared_control, SHARED_CONTROL_SIZE);
+    if (rule_list->mapping)
+        mpm_private_unmap(rule_list->mapping, rule_list->mapping_size);
+    else
+        free(rule_list->rule_indices);
     free(rule_list);
 }
 
@@ -105,6 +171,12 @@ char *mpm_error_to_string(int error_code)
         return "Number of allowed states is reached (max " TOSTRING(STATE_LIMIT) " states)";
     case MPM_NO_SUCH_PATTERN:
         return "No such pattern (invalid index argument)";
+    case MPM_TERM_LIMIT:
+        return "Number of allowed terms is reached (max " TOSTRING(BIT_PARALLEL_TERM_LIMIT) " terms)";
+    case MPM_FILE_ERROR:
+        return "File cannot be opened, read or written";
+    case MPM_INVALID_FILE:
+        return "File is not a valid database (unknown format, version or checksum)";
     default:
         return "Unknown error code";
     }
@@ -227,6 +299,7 @@ int mpm_combine(mpm_re **destination_re, mpm_re *source_re, mpm_uint32 flags)
         }
     }
 
+    destination_re[0]->flags |= source_re->flags & RE_CHAR_SET_256;
     destination_re[0]->compile.next_id += source_re->compile.next_id;
     destination_re[0]->compile.next_term_index += source_re->compile.next_term_index;
 
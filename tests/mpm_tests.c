@@ -27,6 +27,10 @@
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <pthread.h>
 
 /* ----------------------------------------------------------------------- */
 /*                               Utility functions.                        */
@@ -238,7 +242,7 @@ static void test6()
     test_mpm_add_fail(re, "^(?:a|a*)", MPM_ADD_MULTILINE | MPM_ADD_VERBOSE, MPM_EMPTY_PATTERN);
     test_mpm_add_fail(re, "^a|a", MPM_ADD_VERBOSE, MPM_UNSUPPORTED_PATTERN);
 
-    for (i = 0; i < 32; i++)
+    for (i = 0; i < 1024; i++)
         test_mpm_add(re, "A", 0);
     test_mpm_add_fail(re, "B", 0, MPM_PATTERN_LIMIT);
     mpm_free(re);
@@ -331,11 +335,1623 @@ static void test8()
     test_mpm_exec(re1, "Morphing Strings", 0);
 }
 
-#define MAX_TESTS 8
+static void test_mpm_stream(mpm_re *re, char *subject, int segment_length)
+{
+    mpm_stream stream;
+    unsigned int result[1];
+    unsigned int exec_result[1];
+    int length = strlen(subject);
+    int error_code, offset;
+
+    error_code = mpm_stream_begin(re, &stream);
+    for (offset = 0; offset < length && error_code == MPM_NO_ERROR; offset += segment_length)
+        error_code = mpm_stream_feed(re, &stream, (mpm_char8*)subject + offset,
+            (offset + segment_length <= length) ? segment_length : length - offset);
+    if (error_code == MPM_NO_ERROR)
+        error_code = mpm_stream_end(re, &stream, result);
+    if (error_code == MPM_NO_ERROR)
+        error_code = mpm_exec(re, (mpm_char8*)subject, length, 0, exec_result);
+
+    if (error_code != MPM_NO_ERROR) {
+        printf("WARNING: mpm_stream is failed: %s\n\n", mpm_error_to_string(error_code));
+        test_failed = 1;
+        return;
+    }
+    if (result[0] != exec_result[0]) {
+        printf("WARNING: mpm_stream result (0x%x) differs from mpm_exec result (0x%x)\n", (int)result[0], (int)exec_result[0]);
+        test_failed = 1;
+    }
+    printf("String: '%s' in %d byte segments: 0x%x\n", subject, segment_length, (int)result[0]);
+}
+
+static void test9()
+{
+    mpm_re *re;
+
+    printf("Test9: Testing stream matching.\n\n");
+
+    re = test_mpm_create();
+    if (!re)
+        return;
+
+    test_mpm_add(re, "^abc", 0);
+    test_mpm_add(re, "x[0-9]+y", 0);
+    test_mpm_add(re, "^mm", MPM_ADD_MULTILINE);
+    test_mpm_add(re, "Stream", MPM_ADD_CASELESS | MPM_ADD_FIXED(6));
+    test_mpm_compile(re, NULL, 0);
+
+    test_mpm_stream(re, "abcx0123456789y", 1);
+    test_mpm_stream(re, "abcx0123456789y", 2);
+    test_mpm_stream(re, "abcx0123456789y", 7);
+    test_mpm_stream(re, "-abc\nmm-sTrEaM", 1);
+    test_mpm_stream(re, "-abc\nmm-sTrEaM", 5);
+    test_mpm_stream(re, "-abc\nmm-sTrEaM", 100);
+    test_mpm_stream(re, "x12-y stream", 3);
+    mpm_free(re);
+}
+
+static int print_match(mpm_uint32 pattern_id, mpm_size end_offset, void *user_data)
+{
+    int *limit = (int *)user_data;
+
+    printf("  Pattern %d matches, end offset: %d\n", (int)pattern_id, (int)end_offset);
+    if (*limit > 0 && --(*limit) == 0)
+        return 1;
+    return 0;
+}
+
+static void test_mpm_exec_callback(mpm_re *re, char *subject, int offset, int limit, mpm_uint32 flags)
+{
+    int error_code;
+
+    printf("String: '%s' from %d (limit: %d, flags: 0x%x)\n", subject, offset, limit, (int)flags);
+    error_code = mpm_exec_callback(re, (mpm_char8*)subject, strlen(subject), offset, print_match, &limit, flags);
+    if (error_code != MPM_NO_ERROR) {
+        printf("WARNING: mpm_exec_callback is failed: %s\n\n", mpm_error_to_string(error_code));
+        test_failed = 1;
+    }
+}
+
+static void test10()
+{
+    mpm_re *re;
+
+    printf("Test10: Testing match callbacks.\n\n");
+
+    re = test_mpm_create();
+    if (!re)
+        return;
+
+    test_mpm_add(re, "ab+", 0);
+    test_mpm_add(re, "^x", MPM_ADD_MULTILINE);
+    test_mpm_add(re, "b\\x80", 0);
+    test_mpm_compile(re, NULL, 0);
+
+    test_mpm_exec_callback(re, "xabbb\x80\nxab", 0, 0, 0);
+    test_mpm_exec_callback(re, "xabbb\x80\nxab", 0, 0, MPM_EXEC_CALLBACK_FIRST);
+    test_mpm_exec_callback(re, "xabbb\x80\nxab", 0, 3, 0);
+    test_mpm_exec_callback(re, "xabbb\x80\nxab", 2, 0, 0);
+    test_mpm_exec_callback(re, "xabbb\x80\nxab", 7, 0, 0);
+    mpm_free(re);
+}
+
+static void test_mpm_execN(mpm_re **re, int count, char *subject, int offset)
+{
+    unsigned int result[16];
+    unsigned int exec_result[1];
+    int length = strlen(subject);
+    int error_code, i;
+
+    error_code = mpm_execN(re, count, (mpm_char8*)subject, length, offset, result);
+    if (error_code != MPM_NO_ERROR) {
+        printf("WARNING: mpm_execN is failed: %s\n\n", mpm_error_to_string(error_code));
+        test_failed = 1;
+        return;
+    }
+
+    printf("String: '%s' from %d with %d state machines:", subject, offset, count);
+    for (i = 0; i < count; i++) {
+        printf(" 0x%x", (int)result[i]);
+        error_code = mpm_exec(re[i], (mpm_char8*)subject, length, offset, exec_result);
+        if (error_code != MPM_NO_ERROR || result[i] != exec_result[0]) {
+            printf("\nWARNING: mpm_execN result differs from mpm_exec result\n");
+            test_failed = 1;
+        }
+    }
+    printf("\n");
+}
+
+static void test11()
+{
+    char *patterns[11] = { "ab", "b\\x80", "^a", "c+d", "[a-c]{3}", "\\xff",
+        "x.*y", "d.a", "^(ab|cd)", "b[^a]", "\\d\\D" };
+    mpm_re *re[11];
+    int i;
+
+    printf("Test11: Testing multiple state machine matching.\n\n");
+
+    for (i = 0; i < 11; i++) {
+        re[i] = test_mpm_create();
+        if (!re[i])
+            return;
+        test_mpm_add(re[i], patterns[i], 0);
+        test_mpm_add(re[i], "x", 0);
+        test_mpm_compile(re[i], NULL, 0);
+    }
+
+    test_mpm_execN(re, 11, "abcdx", 0);
+    test_mpm_execN(re, 11, "xcdab\x80", 1);
+    test_mpm_execN(re, 8, "ab\xff", 0);
+    test_mpm_execN(re + 1, 7, "ccd\x80y9z", 0);
+    test_mpm_execN(re + 2, 3, "abc", 0);
+    test_mpm_execN(re + 5, 1, "\xff", 0);
+
+    for (i = 0; i < 11; i++)
+        mpm_free(re[i]);
+}
+
+static void test_mpm_exec_batch(mpm_re *re, char **subjects, int count)
+{
+    mpm_char8 *subject_list[16];
+    mpm_size length_list[16];
+    unsigned int result[16];
+    unsigned int exec_result[1];
+    int error_code, i;
+
+    for (i = 0; i < count; i++) {
+        subject_list[i] = (mpm_char8*)subjects[i];
+        length_list[i] = strlen(subjects[i]);
+    }
+
+    error_code = mpm_exec_batch(re, subject_list, length_list, count, result);
+    if (error_code != MPM_NO_ERROR) {
+        printf("WARNING: mpm_exec_batch is failed: %s\n\n", mpm_error_to_string(error_code));
+        test_failed = 1;
+        return;
+    }
+
+    for (i = 0; i < count; i++) {
+        printf("String: '%.20s' (%d): 0x%x\n", subjects[i], (int)length_list[i], (int)result[i]);
+        error_code = mpm_exec(re, subject_list[i], length_list[i], 0, exec_result);
+        if (error_code != MPM_NO_ERROR || result[i] != exec_result[0]) {
+            printf("WARNING: mpm_exec_batch result differs from mpm_exec result (0x%x)\n", (int)exec_result[0]);
+            test_failed = 1;
+        }
+    }
+    puts("");
+}
+
+static void test12()
+{
+    mpm_re *re;
+    char long_subject[1000];
+    char *subjects[9];
+
+    printf("Test12: Testing batch matching.\n\n");
+
+    re = test_mpm_create();
+    if (!re)
+        return;
+
+    test_mpm_add(re, "ab+c", 0);
+    test_mpm_add(re, "^xy", 0);
+    test_mpm_add(re, "z\\d+z", 0);
+    test_mpm_compile(re, NULL, 0);
+
+    memset(long_subject, 'b', sizeof(long_subject) - 1);
+    long_subject[0] = 'a';
+    long_subject[sizeof(long_subject) - 2] = 'c';
+    long_subject[sizeof(long_subject) - 1] = '\0';
+
+    subjects[0] = "abbc";
+    subjects[1] = long_subject;
+    subjects[2] = "";
+    subjects[3] = "xyz12z";
+    subjects[4] = "axy";
+    subjects[5] = long_subject + 1;
+    subjects[6] = "z0z abc";
+    subjects[7] = "xy";
+    subjects[8] = "q";
+
+    test_mpm_exec_batch(re, subjects, 9);
+    test_mpm_exec_batch(re, subjects + 3, 3);
+    mpm_free(re);
+}
+
+static void test13()
+{
+    mpm_re *re;
+    char subject[1100];
+
+    printf("Test13: Testing start state skipping.\n\n");
+
+    re = test_mpm_create();
+    if (!re)
+        return;
+
+    test_mpm_add(re, "ab+c", 0);
+    test_mpm_add(re, "^xy", MPM_ADD_MULTILINE);
+    test_mpm_add(re, "\\x80z", 0);
+    test_mpm_compile(re, NULL, 0);
+
+    memset(subject, '-', sizeof(subject) - 1);
+    subject[sizeof(subject) - 1] = '\0';
+    test_mpm_exec(re, subject, 0);
+
+    /* Match across a block boundary. */
+    memcpy(subject + 254, "abbc", 4);
+    test_mpm_exec(re, subject, 0);
+    test_mpm_exec(re, subject, 255);
+
+    memcpy(subject + 700, "\nxy", 3);
+    test_mpm_exec(re, subject, 300);
+    memcpy(subject + 1095, "\x80z", 2);
+    test_mpm_exec(re, subject, 300);
+    memcpy(subject + 600, "ab", 2);
+    test_mpm_exec(re, subject + 590, 0);
+    mpm_free(re);
+}
+
+static void test14()
+{
+    mpm_re *re;
+    mpm_stream stream;
+    char subject[64];
+    int error_code;
+
+    printf("Test14: Testing lazy state machines.\n\n");
+
+    re = test_mpm_create();
+    if (!re)
+        return;
+
+    test_mpm_add(re, "a.{14}b", 0);
+    test_mpm_add(re, "c[^d]{12}e", 0);
+    test_mpm_add(re, "^x", MPM_ADD_MULTILINE);
+
+    /* Too many states for mpm_compile. */
+    error_code = mpm_compile(re, NULL, 0);
+    printf("Expected error: '%s' occured\n", mpm_error_to_string(error_code));
+    if (error_code != MPM_STATE_MACHINE_LIMIT)
+        test_failed = 1;
+
+    test_mpm_compile(re, NULL, MPM_COMPILE_LAZY | MPM_COMPILE_VERBOSE_STATS);
+    printf("\n");
+
+    test_mpm_exec(re, "a--------------b", 0);
+    test_mpm_exec(re, "a-------------b", 0);
+    test_mpm_exec(re, "ac-----------d-e-b", 0);
+    test_mpm_exec(re, "c------------e\nx", 0);
+    test_mpm_exec(re, "-x", 1);
+    test_mpm_exec(re, "\nx", 1);
+
+    strcpy(subject, "aacca-cc--c-aa-c-b-ee-e--a-b-e\nxb");
+    test_mpm_exec(re, subject, 0);
+    test_mpm_exec(re, subject, 3);
+    test_mpm_exec_callback(re, subject, 0, 0, 0);
+
+    error_code = mpm_stream_begin(re, &stream);
+    printf("Expected error: '%s' occured\n", mpm_error_to_string(error_code));
+    if (error_code != MPM_INVALID_ARGS)
+        test_failed = 1;
+    mpm_free(re);
+}
+
+static void test15()
+{
+    mpm_re *re;
+    char subject[64];
+    int error_code;
+
+    printf("Test15: Testing bit parallel state machines.\n\n");
+
+    re = test_mpm_create();
+    if (!re)
+        return;
+
+    /* Single word term sets. */
+    test_mpm_add(re, "a.{14}b", 0);
+    test_mpm_add(re, "^x", MPM_ADD_MULTILINE);
+    test_mpm_compile(re, NULL, MPM_COMPILE_BIT_PARALLEL);
+
+    test_mpm_exec(re, "a--------------b", 0);
+    test_mpm_exec(re, "a-------------b", 0);
+    test_mpm_exec(re, "-x", 1);
+    test_mpm_exec(re, "\nx", 1);
+    test_mpm_exec(re, "aaaaaaaaaaaaaaaaaaaab\nx", 0);
+    mpm_free(re);
+
+    re = test_mpm_create();
+    if (!re)
+        return;
+
+    /* Multi word term sets. */
+    test_mpm_add(re, "a.{14}b", 0);
+    test_mpm_add(re, "c[^d]{12}e", 0);
+    test_mpm_add(re, "^x", MPM_ADD_MULTILINE);
+    test_mpm_add(re, "y[0-9]{8}z", 0);
+    test_mpm_compile(re, NULL, MPM_COMPILE_BIT_PARALLEL);
+
+    test_mpm_exec(re, "a--------------b", 0);
+    test_mpm_exec(re, "ac-----------d-e-b", 0);
+    test_mpm_exec(re, "c------------e\nx", 0);
+    test_mpm_exec(re, "y1234567z y12345678z", 0);
+
+    strcpy(subject, "aacca-cc--c-aa-c-b-ee-e--a-b-e\nxby01234567z");
+    test_mpm_exec(re, subject, 0);
+    test_mpm_exec(re, subject, 3);
+    test_mpm_exec_callback(re, subject, 0, 0, 0);
+    test_mpm_exec_callback(re, subject, 0, 0, MPM_EXEC_CALLBACK_FIRST);
+    mpm_free(re);
+
+    re = test_mpm_create();
+    if (!re)
+        return;
+
+    test_mpm_add(re, "a.{130}b", 0);
+    error_code = mpm_compile(re, NULL, MPM_COMPILE_BIT_PARALLEL);
+    printf("Expected error: '%s' occured\n", mpm_error_to_string(error_code));
+    if (error_code != MPM_TERM_LIMIT)
+        test_failed = 1;
+    mpm_free(re);
+}
+
+static void test_mpm_exec_wide(mpm_re *re, char *subject, int offset, int result_length)
+{
+    unsigned int result[4];
+    int error_code = mpm_exec(re, (mpm_char8*)subject, strlen(subject), offset, result);
+    int i;
+
+    if (error_code != MPM_NO_ERROR) {
+        printf("WARNING: mpm_exec is failed: %s\n\n", mpm_error_to_string(error_code));
+        test_failed = 1;
+        return;
+    }
+    printf("String: '%s' from %d result:", subject, offset);
+    for (i = 0; i < result_length; i++)
+        printf(" 0x%x", (int)result[i]);
+    printf("\n");
+}
+
+static void test16()
+{
+    mpm_re *re;
+    mpm_re *re_list[4];
+    mpm_stream stream;
+    mpm_uint32 results[4];
+    char pattern[16];
+    int error_code;
+    int i;
+
+    printf("Test16: Testing more than 32 patterns.\n\n");
+
+    re = test_mpm_create();
+    if (!re)
+        return;
+
+    for (i = 0; i < 70; i++) {
+        sprintf(pattern, "#%d#", i);
+        test_mpm_add(re, pattern, 0);
+    }
+    test_mpm_add(re, "x[0-9]+y", 0);
+
+    error_code = mpm_compile(re, NULL, MPM_COMPILE_LAZY);
+    printf("Expected error: '%s' occured\n", mpm_error_to_string(error_code));
+    if (error_code != MPM_PATTERN_LIMIT)
+        test_failed = 1;
+
+    test_mpm_compile(re, NULL, 0);
+
+    test_mpm_exec_wide(re, "-#0#-", 0, 3);
+    test_mpm_exec_wide(re, "#31#32#33#", 0, 3);
+    test_mpm_exec_wide(re, "#64##69#x12y", 0, 3);
+    test_mpm_exec_wide(re, "#1#-#65#", 3, 3);
+    test_mpm_exec_wide(re, "#7", 0, 3);
+    test_mpm_exec_wide(re, "", 0, 3);
+
+    test_mpm_exec_callback(re, "#40#x1y#3#x22y#40#", 0, 0, 0);
+    test_mpm_exec_callback(re, "#40#x1y#3#x22y#40#", 0, 0, MPM_EXEC_CALLBACK_FIRST);
+    test_mpm_exec_callback(re, "#40#x1y#3#x22y#40#", 0, 2, 0);
+
+    error_code = mpm_stream_begin(re, &stream);
+    printf("Expected error: '%s' occured\n", mpm_error_to_string(error_code));
+    if (error_code != MPM_INVALID_ARGS)
+        test_failed = 1;
+
+    for (i = 0; i < 4; i++)
+        re_list[i] = (i == 2) ? re : mpm_dummy_re();
+    error_code = mpm_exec4(re_list, (mpm_char8*)"#1#", 3, 0, results);
+    printf("Expected error: '%s' occured\n", mpm_error_to_string(error_code));
+    if (error_code != MPM_INVALID_ARGS)
+        test_failed = 1;
+    mpm_free(re);
+}
+
+static void test17()
+{
+    mpm_cluster_item *items;
+    char *used;
+    char pattern[32];
+    int i, no_items, error_code, no_groups, group_size, max_group_size;
+
+    printf("Test17: Clustering a large number of patterns.\n\n");
+
+    items = (mpm_cluster_item *)malloc(3000 * sizeof(mpm_cluster_item));
+    used = (char *)calloc(3000, 1);
+    if (!items || !used) {
+        printf("Not enough memory\n");
+        test_failed = 1;
+        free(items);
+        free(used);
+        return;
+    }
+
+    for (no_items = 0; no_items < 3000; no_items++) {
+        i = no_items;
+        items[i].re = test_mpm_create();
+        if (!items[i].re)
+            break;
+        if (i & 0x1)
+            sprintf(pattern, "%c%d[a-z]+%d", 'a' + (i % 7), i, i % 11);
+        else
+            sprintf(pattern, "x%dy%d", i % 13, i);
+        test_mpm_add(items[i].re, pattern, 0);
+        items[i].data = used + i;
+    }
+
+    error_code = MPM_NO_MEMORY;
+    if (no_items == 3000)
+        error_code = mpm_clustering(items, 3000, 0);
+    if (error_code != MPM_NO_ERROR) {
+        printf("WARNING: mpm_clustering is failed: %s\n", mpm_error_to_string(error_code));
+        test_failed = 1;
+    } else {
+        no_groups = 1;
+        group_size = 0;
+        max_group_size = 0;
+        for (i = 0; i < 3000; i++) {
+            *(char *)items[i].data += 1;
+            if (i > 0 && items[i].group_id != items[i - 1].group_id) {
+                if (items[i].group_id != items[i - 1].group_id + 1)
+                    test_failed = 1;
+                no_groups++;
+                group_size = 0;
+            }
+            group_size++;
+            if (group_size > max_group_size)
+                max_group_size = group_size;
+        }
+        if (items[0].group_id != 0 || max_group_size > 128)
+            test_failed = 1;
+        for (i = 0; i < 3000; i++)
+            if (used[i] != 1)
+                test_failed = 1;
+        printf("Groups: %d, largest group: %d patterns\n", no_groups, max_group_size);
+    }
+
+    for (i = 0; i < no_items; i++)
+        mpm_free(items[i].re);
+    free(items);
+    free(used);
+}
+
+static void test18()
+{
+    mpm_cluster_item items[2][600];
+    char pattern[32];
+    int i, j, error_code, no_groups;
+
+    printf("Test18: Clustering with multiple threads.\n\n");
+
+    for (i = 0; i < 600; i++) {
+        if (i % 3)
+            sprintf(pattern, "%c%d[a-f]+%c", 'a' + (i % 5), i % 37, 'p' + (i % 7));
+        else
+            sprintf(pattern, "q%dr%d", i % 11, i);
+
+        for (j = 0; j < 2; j++) {
+            items[j][i].re = test_mpm_create();
+            if (!items[j][i].re)
+                return;
+            test_mpm_add(items[j][i].re, pattern, 0);
+            items[j][i].data = (void *)(items[0] + i);
+        }
+    }
+
+    for (j = 0; j < 2; j++) {
+        error_code = mpm_clustering(items[j], 600, j ? MPM_CLUSTERING_THREADS(4) : 0);
+        if (error_code != MPM_NO_ERROR) {
+            printf("WARNING: mpm_clustering is failed: %s\n", mpm_error_to_string(error_code));
+            test_failed = 1;
+        }
+    }
+
+    no_groups = 0;
+    for (i = 0; i < 600; i++) {
+        if (items[0][i].group_id != items[1][i].group_id || items[0][i].data != items[1][i].data) {
+            printf("WARNING: results are different at %d\n", i);
+            test_failed = 1;
+            break;
+        }
+        if ((int)items[0][i].group_id >= no_groups)
+            no_groups = items[0][i].group_id + 1;
+    }
+    printf("Groups: %d\n", no_groups);
+
+    for (i = 0; i < 600; i++) {
+        mpm_free(items[0][i].re);
+        mpm_free(items[1][i].re);
+    }
+}
+
+static void test19()
+{
+    mpm_cluster_item items[2][400];
+    char pattern[48];
+    int i, j, error_code, no_groups[2];
+
+    printf("Test19: Clustering with MinHash signatures.\n\n");
+
+    for (i = 0; i < 400; i++) {
+        if (i & 0x1)
+            sprintf(pattern, "%s%d[0-9]+%c", (i & 0x2) ? "user=" : "GET /", i % 23, 'a' + (i % 19));
+        else
+            sprintf(pattern, "%c[a-z]*%d\\s+%d", 'k' + (i % 9), i % 17, i);
+
+        for (j = 0; j < 2; j++) {
+            items[j][i].re = test_mpm_create();
+            if (!items[j][i].re)
+                return;
+            test_mpm_add(items[j][i].re, pattern, 0);
+            items[j][i].data = NULL;
+        }
+    }
+
+    for (j = 0; j < 2; j++) {
+        error_code = mpm_clustering(items[j], 400, j ? MPM_CLUSTERING_LSH : 0);
+        if (error_code != MPM_NO_ERROR) {
+            printf("WARNING: mpm_clustering is failed: %s\n", mpm_error_to_string(error_code));
+            test_failed = 1;
+        }
+
+        no_groups[j] = 1;
+        for (i = 1; i < 400; i++) {
+            if (items[j][i].group_id == items[j][i - 1].group_id)
+                continue;
+            if (items[j][i].group_id != items[j][i - 1].group_id + 1)
+                test_failed = 1;
+            no_groups[j]++;
+        }
+    }
+
+    printf("Groups with exact distances: %d, with MinHash signatures: %d\n", no_groups[0], no_groups[1]);
+    /* The estimation may only slightly reduce the quality of the groups. */
+    if (no_groups[1] > no_groups[0] + no_groups[0] / 4) {
+        printf("WARNING: too many groups with MinHash signatures\n");
+        test_failed = 1;
+    }
+
+    for (i = 0; i < 400; i++) {
+        mpm_free(items[0][i].re);
+        mpm_free(items[1][i].re);
+    }
+}
+
+#define TEST20_THREADS 4
+#define TEST20_SUBJECTS 6
+
+typedef struct test20_data {
+    int error_code;
+    mpm_uint32 result[TEST20_SUBJECTS][2];
+} test20_data;
+
+static char *test20_subjects[TEST20_SUBJECTS] = {
+    "x-ab0123456789xyzcd",
+    "<object data=\"\"",
+    "m3n--k1mbbbn11",
+    "zzp34q p22qr",
+    "AbcDEF ghi",
+    "#12345678#"
+};
+
+/* Builds and runs the same set of regular expressions. Called by multiple threads at the same time. */
+static void * test20_build(void *arg)
+{
+    test20_data *data = (test20_data *)arg;
+    mpm_re *re;
+    char pattern[32];
+    int i, error_code;
+
+    data->error_code = MPM_NO_MEMORY;
+    re = mpm_create();
+    if (!re)
+        return NULL;
+
+    error_code = mpm_add(re, (mpm_char8 *)"\\x3Cobject[^\\x3E]+?data\\s*\\x3D\\s*\\x22\\x22", 0);
+    if (error_code == MPM_NO_ERROR)
+        error_code = mpm_add(re, (mpm_char8 *)"a+b.*[0-9]{3,8}[x-z]+c?d", 0);
+    if (error_code == MPM_NO_ERROR)
+        error_code = mpm_add(re, (mpm_char8 *)"#[0-9]{8}#", 0);
+    if (error_code == MPM_NO_ERROR)
+        error_code = mpm_add(re, (mpm_char8 *)"abcdef", MPM_ADD_CASELESS);
+    for (i = 0; i < 36 && error_code == MPM_NO_ERROR; i++) {
+        if (i & 0x1)
+            sprintf(pattern, "k%dm[a-c]+n%d", i % 5, i);
+        else
+            sprintf(pattern, "p%dq", i);
+        error_code = mpm_add(re, (mpm_char8 *)pattern, 0);
+    }
+
+    if (error_code == MPM_NO_ERROR)
+        error_code = mpm_compile(re, NULL, 0);
+
+    for (i = 0; i < TEST20_SUBJECTS && error_code == MPM_NO_ERROR; i++) {
+        data->result[i][1] = 0;
+        error_code = mpm_exec(re, (mpm_char8 *)test20_subjects[i], strlen(test20_subjects[i]), 0, data->result[i]);
+    }
+
+    mpm_free(re);
+    data->error_code = error_code;
+    return NULL;
+}
+
+static void test20()
+{
+    pthread_t threads[TEST20_THREADS];
+    test20_data data[TEST20_THREADS + 1];
+    int started;
+    mpm_rule_pattern rules[48];
+    char patterns[48][32];
+    mpm_rule_list *rule_list[2];
+    mpm_size consumed_memory[2];
+    mpm_uint32 result[2][2];
+    mpm_compile_rules_args args;
+    char subject[64];
+    int i, j, k, error_code;
+
+    printf("Test20: Compiling rule lists with multiple threads.\n\n");
+
+    for (i = 0; i < 48; i++) {
+        if (i % 3 == 0)
+            sprintf(patterns[i], "r%d[a-f]{2,}s%d", i % 7, i);
+        else
+            sprintf(patterns[i], "k%dm%c+n%d", i % 5, 'a' + (i % 11), i);
+        rules[i].pattern = (mpm_char8 *)patterns[i];
+        rules[i].flags = MPM_RULE_NEW;
+    }
+
+    mpm_compile_rules_args_init(&args);
+
+    for (j = 0; j < 2; j++) {
+        args.no_threads = j ? 4 : 0;
+        error_code = mpm_compile_rules(rules, 48, rule_list + j, consumed_memory + j, &args, 0);
+        if (error_code != MPM_NO_ERROR) {
+            printf("WARNING: mpm_compile_rules is failed: %s\n", mpm_error_to_string(error_code));
+            test_failed = 1;
+            if (j == 1)
+                mpm_rule_list_free(rule_list[0]);
+            return;
+        }
+    }
+
+    if (consumed_memory[0] != consumed_memory[1]) {
+        printf("WARNING: consumed memory is different\n");
+        test_failed = 1;
+    }
+
+    for (i = 0; i < 6; i++) {
+        j = i * 7;
+        k = (i * 11 + 5) % 48;
+        sprintf(subject, "-r%dccs%d-k%dm%c%cn%d-", j % 7, j, k % 5, 'a' + (k % 11), 'a' + (k % 11), k);
+        for (j = 0; j < 2; j++)
+            mpm_exec_list(rule_list[j], (mpm_char8 *)subject, strlen(subject), 0, result[j]);
+        printf("String: '%s' result: 0x%x 0x%x\n", subject, result[0][0], result[0][1]);
+        if (result[0][0] != result[1][0] || result[0][1] != result[1][1]) {
+            printf("WARNING: results are different: 0x%x 0x%x\n", result[1][0], result[1][1]);
+            test_failed = 1;
+        }
+    }
+
+    mpm_rule_list_free(rule_list[0]);
+    mpm_rule_list_free(rule_list[1]);
+
+    printf("\nAdding patterns from multiple threads:\n\n");
+
+    /* The last item is computed by the main thread alone. */
+    test20_build(data + TEST20_THREADS);
+    if (data[TEST20_THREADS].error_code != MPM_NO_ERROR) {
+        printf("WARNING: building the set is failed: %s\n", mpm_error_to_string(data[TEST20_THREADS].error_code));
+        test_failed = 1;
+        return;
+    }
+
+    for (started = 0; started < TEST20_THREADS; started++)
+        if (pthread_create(threads + started, NULL, test20_build, data + started) != 0)
+            break;
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    if (started < TEST20_THREADS) {
+        printf("WARNING: pthread_create is failed\n");
+        test_failed = 1;
+        return;
+    }
+
+    for (i = 0; i < TEST20_SUBJECTS; i++)
+        printf("String: '%s' result: 0x%x 0x%x\n", test20_subjects[i],
+            data[TEST20_THREADS].result[i][0], data[TEST20_THREADS].result[i][1]);
+
+    for (j = 0; j < TEST20_THREADS; j++) {
+        if (data[j].error_code != MPM_NO_ERROR) {
+            printf("WARNING: building the set is failed in thread %d: %s\n", j, mpm_error_to_string(data[j].error_code));
+            test_failed = 1;
+            continue;
+        }
+        for (i = 0; i < TEST20_SUBJECTS; i++)
+            if (data[j].result[i][0] != data[TEST20_THREADS].result[i][0]
+                    || data[j].result[i][1] != data[TEST20_THREADS].result[i][1]) {
+                printf("WARNING: results are different in thread %d: 0x%x 0x%x\n", j,
+                    data[j].result[i][0], data[j].result[i][1]);
+                test_failed = 1;
+            }
+    }
+}
+
+/* Saves the state machine, and returns with the content of the saved file. */
+static char * save_to_memory(mpm_re *re, char *file_name, long *size)
+{
+    FILE *file;
+    char *data;
+
+    if (mpm_save(re, file_name) != MPM_NO_ERROR)
+        return NULL;
+
+    file = fopen(file_name, "rb");
+    if (!file)
+        return NULL;
+    data = NULL;
+    if (fseek(file, 0, SEEK_END) == 0) {
+        *size = ftell(file);
+        data = (char *)malloc(*size > 0 ? *size : 1);
+        rewind(file);
+        if (data && fread(data, 1, *size, file) != (size_t)*size) {
+            free(data);
+            data = NULL;
+        }
+    }
+    fclose(file);
+    unlink(file_name);
+    return data;
+}
+
+/* The reference patterns are followed by the extra patterns (NULL terminated),
+   and each state machine is compiled with its own flags. The compile cache is
+   used when cache_directory is not NULL. Nothing is left allocated when the
+   function fails. */
+static int test_reference_set(mpm_re **re, int count, char **extra_patterns, int *extra_add_flags,
+    mpm_uint32 *compile_flags, mpm_size *consumed_memory, char *cache_directory)
+{
+    mpm_size *consumed;
+    int i, j, error_code;
+
+    for (i = 0; i < count; i++) {
+        re[i] = test_mpm_create();
+        if (!re[i])
+            break;
+
+        test_mpm_add(re[i], "\\x3Cobject[^\\x3E]+?data\\s*\\x3D\\s*\\x22\\x22", 0);
+        test_mpm_add(re[i], "a+b.*[0-9]{3,8}[x-z]+c?d", 0);
+        test_mpm_add(re[i], "#[0-9]{8}#", 0);
+        for (j = 0; extra_patterns[j]; j++)
+            test_mpm_add(re[i], extra_patterns[j], extra_add_flags ? extra_add_flags[j] : 0);
+
+        consumed = consumed_memory ? consumed_memory + i : NULL;
+        if (cache_directory)
+            error_code = mpm_compile_cached(re + i, consumed, compile_flags[i], cache_directory);
+        else
+            error_code = mpm_compile(re[i], consumed, compile_flags[i]);
+        if (error_code != MPM_NO_ERROR) {
+            printf("WARNING: mpm_compile is failed: %s\n", mpm_error_to_string(error_code));
+            test_failed = 1;
+            mpm_free(re[i]);
+            break;
+        }
+    }
+
+    if (i == count)
+        return 1;
+    while (--i >= 0)
+        mpm_free(re[i]);
+    return 0;
+}
+
+/* Prints the result of the first state machine, which must be the same for
+   the other state machines. */
+static void test_compare_results(mpm_re **re, int count, char **subjects)
+{
+    mpm_uint32 result, other_result;
+    int i;
+
+    while (subjects[0]) {
+        mpm_exec(re[0], (mpm_char8 *)subjects[0], strlen(subjects[0]), 0, &result);
+        printf("String: '%s' result: 0x%x\n", subjects[0], result);
+        for (i = 1; i < count; i++) {
+            mpm_exec(re[i], (mpm_char8 *)subjects[0], strlen(subjects[0]), 0, &other_result);
+            if (other_result != result) {
+                printf("WARNING: result of state machine %d is different: 0x%x\n", i, other_result);
+                test_failed = 1;
+            }
+        }
+        subjects++;
+    }
+}
+
+static void test21()
+{
+    mpm_re *re[3];
+    mpm_size consumed_memory[3];
+    mpm_uint32 compile_flags[3] = { 0, MPM_COMPILE_THREADS(2), MPM_COMPILE_THREADS(4) };
+    char patterns[12][32];
+    char *extra_patterns[14];
+    char *saved[3];
+    long saved_size[3];
+    int i;
+    char *subjects[] = {
+        "<object data=\"\"",
+        "<object class=x data = \"\" >",
+        "ab0123456789xyzcd",
+        "aab--cdd xy89z",
+        "#12345678#abc#",
+        "k3maabcn8 k1mcn11",
+        NULL
+    };
+
+    printf("Test21: Compiling a state machine with multiple threads.\n\n");
+
+    extra_patterns[0] = "[^a][b-y]{2}#";
+    /* The state machine has more states than a batch. */
+    for (i = 0; i < 12; i++) {
+        sprintf(patterns[i], "k%dm[a-c]+n%d", i % 5, i);
+        extra_patterns[i + 1] = patterns[i];
+    }
+    extra_patterns[13] = NULL;
+
+    if (!test_reference_set(re, 3, extra_patterns, NULL, compile_flags, consumed_memory, NULL))
+        return;
+
+    if (consumed_memory[0] != consumed_memory[1] || consumed_memory[0] != consumed_memory[2]) {
+        printf("WARNING: consumed memory is different\n");
+        test_failed = 1;
+    }
+
+    /* The state machines must be the same, including the state numbering. */
+    for (i = 0; i < 3; i++)
+        saved[i] = save_to_memory(re[i], "test21.mpm", saved_size + i);
+    if (!saved[0] || !saved[1] || !saved[2]) {
+        printf("WARNING: saving is failed\n");
+        test_failed = 1;
+    } else if (saved_size[0] != saved_size[1] || saved_size[0] != saved_size[2]
+            || memcmp(saved[0], saved[1], saved_size[0]) != 0 || memcmp(saved[0], saved[2], saved_size[0]) != 0) {
+        printf("WARNING: state machines are different\n");
+        test_failed = 1;
+    }
+    for (i = 0; i < 3; i++)
+        if (saved[i])
+            free(saved[i]);
+
+    test_compare_results(re, 3, subjects);
+
+    for (i = 0; i < 3; i++)
+        mpm_free(re[i]);
+}
+
+static void test22()
+{
+    mpm_re *re[2];
+    mpm_size consumed_memory[2];
+    mpm_uint32 compile_flags[2] = { 0, MPM_COMPILE_MINIMIZE };
+    char *extra_patterns[] = { "xb.*cd", "yb.*cd", "a.*b", NULL };
+    char *subjects[] = {
+        "<object data=\"\"",
+        "ab0123456789xyzcd",
+        "xxb--cd",
+        "yb-c-d",
+        "#12345678#abc#",
+        "a-bb",
+        NULL
+    };
+
+    printf("Test22: Minimizing a state machine.\n\n");
+
+    if (!test_reference_set(re, 2, extra_patterns, NULL, compile_flags, consumed_memory, NULL))
+        return;
+
+    printf("Consumed memory: %d bytes, after minimization: %d bytes\n", (int)consumed_memory[0], (int)consumed_memory[1]);
+    if (consumed_memory[1] >= consumed_memory[0]) {
+        printf("WARNING: the state machine is not minimized\n");
+        test_failed = 1;
+    }
+
+    test_compare_results(re, 2, subjects);
+
+    mpm_free(re[0]);
+    mpm_free(re[1]);
+}
+
+static void test23()
+{
+    mpm_re *re[2];
+    mpm_uint32 compile_flags[2] = { 0, MPM_COMPILE_DEFAULT_TRANSITIONS };
+    mpm_size consumed_memory[2];
+    char *extra_patterns[] = { "xb.*cd", "^x", "a.*b", NULL };
+    int extra_add_flags[] = { 0, MPM_ADD_MULTILINE, 0 };
+    mpm_rule_pattern rules[24];
+    char patterns[24][32];
+    mpm_rule_list *rule_list[2];
+    mpm_uint32 rule_result[2];
+    mpm_compile_rules_args args;
+    char subject[64];
+    int i, j, k, error_code;
+    char *subjects[] = {
+        "<object data=\"\"",
+        "ab0123456789xyzcd",
+        "xxb--cd",
+        "#12345678#abc#",
+        "a-bb\nx",
+        NULL
+    };
+
+    printf("Test23: Default transitions.\n\n");
+
+    if (!test_reference_set(re, 2, extra_patterns, extra_add_flags, compile_flags, consumed_memory, NULL))
+        return;
+
+    printf("Consumed memory: %d bytes, with default transitions: %d bytes\n", (int)consumed_memory[0], (int)consumed_memory[1]);
+
+    test_compare_results(re, 2, subjects);
+    for (i = 0; subjects[i]; i++)
+        test_mpm_exec_callback(re[1], subjects[i], 0, 0, 0);
+
+    mpm_free(re[0]);
+    mpm_free(re[1]);
+
+    for (i = 0; i < 24; i++) {
+        sprintf(patterns[i], "k%dm%c+n%d", i % 5, 'a' + (i % 11), i);
+        rules[i].pattern = (mpm_char8 *)patterns[i];
+        rules[i].flags = MPM_RULE_NEW;
+    }
+
+    mpm_compile_rules_args_init(&args);
+
+    for (j = 0; j < 2; j++) {
+        error_code = mpm_compile_rules(rules, 24, rule_list + j, NULL, &args,
+            j ? MPM_COMPILE_RULES_DEFAULT_TRANSITIONS : 0);
+        if (error_code != MPM_NO_ERROR) {
+            printf("WARNING: mpm_compile_rules is failed: %s\n", mpm_error_to_string(error_code));
+            test_failed = 1;
+            if (j == 1)
+                mpm_rule_list_free(rule_list[0]);
+            return;
+        }
+    }
+
+    for (i = 0; i < 6; i++) {
+        k = (i * 11 + 5) % 24;
+        sprintf(subject, "-k%dm%c%cn%d-", k % 5, 'a' + (k % 11), 'a' + (k % 11), k);
+        for (j = 0; j < 2; j++)
+            mpm_exec_list(rule_list[j], (mpm_char8 *)subject, strlen(subject), 0, rule_result + j);
+        printf("String: '%s' rule result: 0x%x\n", subject, rule_result[0]);
+        if (rule_result[0] != rule_result[1]) {
+            printf("WARNING: results are different: 0x%x\n", rule_result[1]);
+            test_failed = 1;
+        }
+    }
+
+    mpm_rule_list_free(rule_list[0]);
+    mpm_rule_list_free(rule_list[1]);
+}
+
+static void test24()
+{
+    mpm_re *re[2];
+    mpm_re *other_re;
+    mpm_uint32 result[2][2];
+    mpm_rule_pattern rules[40];
+    char patterns[40][32];
+    mpm_rule_list *rule_list[2];
+    mpm_uint32 rule_result[2][2];
+    mpm_compile_rules_args args;
+    char subject[64];
+    FILE *file;
+    int i, j, k, error_code;
+    char *file_name = "test24.mpm";
+    mpm_uint32 flags[] = { 0, MPM_COMPILE_BIT_PARALLEL, MPM_COMPILE_DEFAULT_TRANSITIONS, 0 };
+    char *subjects[] = {
+        "<object data=\"\"",
+        "ab0123456789xyzcd",
+        "xxb--cd",
+        "#12345678#abc#",
+        "a-bb\nx",
+        "p7q-p33q",
+        NULL
+    };
+
+    printf("Test24: Saving and loading.\n\n");
+
+    for (i = 0; i < 4; i++) {
+        re[0] = test_mpm_create();
+        if (!re[0])
+            return;
+
+        test_mpm_add(re[0], "\\x3Cobject[^\\x3E]+?data\\s*\\x3D\\s*\\x22\\x22", 0);
+        test_mpm_add(re[0], "a+b.*[0-9]{3,8}[x-z]+c?d", 0);
+        test_mpm_add(re[0], "#[0-9]{8}#", 0);
+        test_mpm_add(re[0], "xb.*cd", 0);
+        test_mpm_add(re[0], "^x", MPM_ADD_MULTILINE);
+        test_mpm_add(re[0], "a.*b", 0);
+        /* The last state machine has more than 32 patterns. */
+        for (j = 0; i == 3 && j < 34; j++) {
+            sprintf(patterns[j], "p%dq", j);
+            test_mpm_add(re[0], patterns[j], 0);
+        }
+
+        error_code = mpm_compile(re[0], NULL, flags[i]);
+        if (error_code != MPM_NO_ERROR) {
+            printf("WARNING: mpm_compile is failed: %s\n", mpm_error_to_string(error_code));
+            test_failed = 1;
+            return;
+        }
+
+        re[1] = NULL;
+        error_code = mpm_save(re[0], file_name);
+        if (error_code == MPM_NO_ERROR)
+            error_code = mpm_load(re + 1, file_name);
+        /* Replacing the file must not affect the loaded state machine. */
+        if (error_code == MPM_NO_ERROR) {
+            other_re = test_mpm_create();
+            if (!other_re) {
+                mpm_free(re[0]);
+                mpm_free(re[1]);
+                return;
+            }
+            test_mpm_add(other_re, "other", 0);
+            error_code = mpm_compile(other_re, NULL, 0);
+            if (error_code == MPM_NO_ERROR)
+                error_code = mpm_save(other_re, file_name);
+            mpm_free(other_re);
+        }
+        if (error_code != MPM_NO_ERROR) {
+            printf("WARNING: saving or loading is failed: %s\n", mpm_error_to_string(error_code));
+            test_failed = 1;
+            mpm_free(re[0]);
+            if (re[1])
+                mpm_free(re[1]);
+            return;
+        }
+
+        for (j = 0; subjects[j]; j++) {
+            for (k = 0; k < 2; k++) {
+                result[k][1] = 0;
+                mpm_exec(re[k], (mpm_char8 *)subjects[j], strlen(subjects[j]), 0, result[k]);
+            }
+            printf("Machine: %d String: '%s' result: 0x%x 0x%x\n", i, subjects[j], result[0][0], result[0][1]);
+            if (result[0][0] != result[1][0] || result[0][1] != result[1][1]) {
+                printf("WARNING: results are different: 0x%x 0x%x\n", result[1][0], result[1][1]);
+                test_failed = 1;
+            }
+        }
+
+        mpm_free(re[0]);
+        mpm_free(re[1]);
+    }
+
+    for (i = 0; i < 40; i++) {
+        sprintf(patterns[i], "k%dm%c+n%d", i % 5, 'a' + (i % 11), i);
+        rules[i].pattern = (mpm_char8 *)patterns[i];
+        rules[i].flags = MPM_RULE_NEW;
+    }
+
+    mpm_compile_rules_args_init(&args);
+
+    error_code = mpm_compile_rules(rules, 40, rule_list, NULL, &args, 0);
+    if (error_code == MPM_NO_ERROR)
+        error_code = mpm_rule_list_save(rule_list[0], file_name);
+    if (error_code == MPM_NO_ERROR)
+        error_code = mpm_rule_list_load(rule_list + 1, file_name);
+    if (error_code != MPM_NO_ERROR) {
+        printf("WARNING: compiling, saving or loading is failed: %s\n", mpm_error_to_string(error_code));
+        test_failed = 1;
+        return;
+    }
+
+    for (i = 0; i < 8; i++) {
+        k = (i * 11 + 5) % 40;
+        sprintf(subject, "-k%dm%c%cn%d-", k % 5, 'a' + (k % 11), 'a' + (k % 11), k);
+        for (j = 0; j < 2; j++)
+            mpm_exec_list(rule_list[j], (mpm_char8 *)subject, strlen(subject), 0, rule_result[j]);
+        printf("String: '%s' rule result: 0x%x 0x%x\n", subject, rule_result[0][0], rule_result[0][1]);
+        if (rule_result[0][0] != rule_result[1][0] || rule_result[0][1] != rule_result[1][1]) {
+            printf("WARNING: results are different: 0x%x 0x%x\n", rule_result[1][0], rule_result[1][1]);
+            test_failed = 1;
+        }
+    }
+
+    mpm_rule_list_free(rule_list[0]);
+    mpm_rule_list_free(rule_list[1]);
+
+    /* Damaged files are rejected. */
+    file = fopen(file_name, "r+b");
+    if (file) {
+        fseek(file, 100, SEEK_SET);
+        fputc(0x55, file);
+        fclose(file);
+    }
+    error_code = mpm_rule_list_load(rule_list, file_name);
+    printf("Loading a damaged file: %s\n", mpm_error_to_string(error_code));
+    if (error_code != MPM_INVALID_FILE) {
+        if (error_code == MPM_NO_ERROR)
+            mpm_rule_list_free(rule_list[0]);
+        test_failed = 1;
+    }
+
+    error_code = mpm_load(re, file_name);
+    printf("Loading a rule list as a regular expression: %s\n", mpm_error_to_string(error_code));
+    if (error_code != MPM_INVALID_FILE) {
+        if (error_code == MPM_NO_ERROR)
+            mpm_free(re[0]);
+        test_failed = 1;
+    }
+
+    remove(file_name);
+}
+
+static void test25()
+{
+    mpm_rule_pattern rules[40];
+    char patterns[40][32];
+    mpm_rule_list *rule_list[4];
+    mpm_uint32 rule_result[2][2];
+    mpm_compile_rules_args args;
+    char subject[64];
+    int i, j, k, status, error_code;
+    char *name = "/mpm_tests_25";
+    pid_t pid;
+
+    printf("Test25: Shared rule lists.\n\n");
+
+    for (i = 0; i < 40; i++) {
+        sprintf(patterns[i], "k%dm%c+n%d", i % 5, 'a' + (i % 11), i);
+        rules[i].pattern = (mpm_char8 *)patterns[i];
+        rules[i].flags = MPM_RULE_NEW;
+    }
+
+    mpm_compile_rules_args_init(&args);
+
+    /* The second rule list has only 20 rules. */
+    for (i = 0; i < 2; i++) {
+        error_code = mpm_compile_rules(rules, i == 0 ? 40 : 20, rule_list + i, NULL, &args, 0);
+        if (error_code != MPM_NO_ERROR) {
+            printf("WARNING: mpm_compile_rules is failed: %s\n", mpm_error_to_string(error_code));
+            test_failed = 1;
+            if (i == 1)
+                mpm_rule_list_free(rule_list[0]);
+            return;
+        }
+    }
+
+    mpm_rule_list_unpublish(name);
+    error_code = mpm_rule_list_publish(rule_list[0], name);
+    if (error_code == MPM_NO_ERROR)
+        error_code = mpm_rule_list_attach(rule_list + 2, name);
+    if (error_code != MPM_NO_ERROR) {
+        printf("WARNING: publishing or attaching is failed: %s\n", mpm_error_to_string(error_code));
+        test_failed = 1;
+        mpm_rule_list_free(rule_list[0]);
+        mpm_rule_list_free(rule_list[1]);
+        return;
+    }
+
+    /* Another process attaches the same segment. */
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0) {
+        status = 0;
+        if (mpm_rule_list_attach(rule_list + 3, name) != MPM_NO_ERROR)
+            _exit(1);
+        for (i = 0; i < 8; i++) {
+            k = (i * 11 + 5) % 40;
+            sprintf(subject, "-k%dm%c%cn%d-", k % 5, 'a' + (k % 11), 'a' + (k % 11), k);
+            mpm_exec_list(rule_list[0], (mpm_char8 *)subject, strlen(subject), 0, rule_result[0]);
+            mpm_exec_list(rule_list[3], (mpm_char8 *)subject, strlen(subject), 0, rule_result[1]);
+            if (rule_result[0][0] != rule_result[1][0] || rule_result[0][1] != rule_result[1][1])
+                status = 1;
+        }
+        _exit(status);
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("WARNING: the rule list attached by another process is failed\n");
+        test_failed = 1;
+    }
+
+    printf("Outdated after attach: %d\n", mpm_rule_list_outdated(rule_list[2]));
+
+    /* Publishing the next generation does not affect the attached list. */
+    error_code = mpm_rule_list_publish(rule_list[1], name);
+    if (error_code == MPM_NO_ERROR)
+        error_code = mpm_rule_list_attach(rule_list + 3, name);
+    if (error_code != MPM_NO_ERROR) {
+        printf("WARNING: publishing or attaching is failed: %s\n", mpm_error_to_string(error_code));
+        test_failed = 1;
+        for (i = 0; i < 3; i++)
+            mpm_rule_list_free(rule_list[i]);
+        mpm_rule_list_unpublish(name);
+        return;
+    }
+
+    printf("Outdated after publish: %d %d\n", mpm_rule_list_outdated(rule_list[2]), mpm_rule_list_outdated(rule_list[3]));
+    if (!mpm_rule_list_outdated(rule_list[2]) || mpm_rule_list_outdated(rule_list[3]))
+        test_failed = 1;
+
+    for (i = 0; i < 8; i++) {
+        k = (i * 11 + 5) % 40;
+        sprintf(subject, "-k%dm%c%cn%d-", k % 5, 'a' + (k % 11), 'a' + (k % 11), k);
+        for (j = 0; j < 2; j++) {
+            mpm_exec_list(rule_list[j], (mpm_char8 *)subject, strlen(subject), 0, rule_result[0]);
+            mpm_exec_list(rule_list[j + 2], (mpm_char8 *)subject, strlen(subject), 0, rule_result[1]);
+            if (j == 1)
+                rule_result[0][1] = rule_result[1][1] = 0;
+            printf("Generation: %d String: '%s' rule result: 0x%x 0x%x\n", j + 1, subject, rule_result[0][0], rule_result[0][1]);
+            if (rule_result[0][0] != rule_result[1][0] || rule_result[0][1] != rule_result[1][1]) {
+                printf("WARNING: results are different: 0x%x 0x%x\n", rule_result[1][0], rule_result[1][1]);
+                test_failed = 1;
+            }
+        }
+    }
+
+    mpm_rule_list_free(rule_list[3]);
+
+    /* Concurrent publishers get different generations. */
+    fflush(stdout);
+    for (i = 0; i < 4; i++) {
+        pid = fork();
+        if (pid == 0) {
+            for (j = 0; j < 16; j++)
+                if (mpm_rule_list_publish(rule_list[j & 0x1], name) != MPM_NO_ERROR)
+                    _exit(1);
+            _exit(0);
+        }
+        if (pid < 0)
+            break;
+    }
+    status = 0;
+    for (j = 0; j < i; j++) {
+        if (wait(&k) < 0 || !WIFEXITED(k) || WEXITSTATUS(k) != 0)
+            status = 1;
+    }
+    if (status == 0 && i == 4)
+        error_code = mpm_rule_list_attach(rule_list + 3, name);
+    if (status != 0 || i < 4 || error_code != MPM_NO_ERROR) {
+        printf("WARNING: concurrent publishing is failed\n");
+        test_failed = 1;
+        rule_list[3] = NULL;
+    }
+
+    for (i = 0; i < 4; i++)
+        if (rule_list[i])
+            mpm_rule_list_free(rule_list[i]);
+
+    mpm_rule_list_unpublish(name);
+    error_code = mpm_rule_list_attach(rule_list, name);
+    printf("Attach after unpublish: %s\n", mpm_error_to_string(error_code));
+    if (error_code != MPM_FILE_ERROR) {
+        if (error_code == MPM_NO_ERROR)
+            mpm_rule_list_free(rule_list[0]);
+        test_failed = 1;
+    }
+}
+
+static int count_cache_entries(char *directory, int remove_entries)
+{
+    DIR *dir = opendir(directory);
+    struct dirent *entry;
+    char *file_name;
+    int count = 0;
+
+    if (!dir)
+        return -1;
+    while ((entry = readdir(dir))) {
+        if (entry->d_name[0] == '.')
+            continue;
+        count++;
+        if (!remove_entries)
+            continue;
+        file_name = (char *)malloc(strlen(directory) + strlen(entry->d_name) + 2);
+        if (file_name) {
+            sprintf(file_name, "%s/%s", directory, entry->d_name);
+            remove(file_name);
+            free(file_name);
+        }
+    }
+    closedir(dir);
+    return count;
+}
+
+/* Finds an entry which is not the skipped one. */
+static int find_cache_entry(char *directory, char *skipped_name, char *result_name)
+{
+    DIR *dir = opendir(directory);
+    struct dirent *entry;
+
+    if (!dir)
+        return 0;
+    while ((entry = readdir(dir))) {
+        if (entry->d_name[0] == '.')
+            continue;
+        sprintf(result_name, "%s/%s", directory, entry->d_name);
+        if (!skipped_name || strcmp(result_name, skipped_name) != 0) {
+            closedir(dir);
+            return 1;
+        }
+    }
+    closedir(dir);
+    return 0;
+}
+
+static void test26()
+{
+    mpm_re *re[2];
+    mpm_size consumed_memory[2];
+    mpm_uint32 compile_flags[2] = { 0, 0 };
+    char *extra_patterns[] = { NULL };
+    mpm_rule_pattern rules[40];
+    char patterns[40][32];
+    mpm_rule_list *rule_list[2];
+    mpm_size rule_consumed_memory[2];
+    mpm_uint32 rule_result[2][2];
+    mpm_compile_rules_args args;
+    char subject[64];
+    char cache_directory[32];
+    char entry_names[2][64];
+    int i, j, k, error_code;
+    char *subjects[] = {
+        "<object data=\"\"",
+        "ab0123456789xyzcd",
+        "#12345678#abc#",
+        NULL
+    };
+
+    printf("Test26: Compile cache.\n\n");
+
+    strcpy(cache_directory, "/tmp/mpm_tests_XXXXXX");
+    if (!mkdtemp(cache_directory)) {
+        printf("WARNING: cannot create the cache directory\n");
+        test_failed = 1;
+        return;
+    }
+
+    /* The second state machine is loaded from the cache. */
+    if (!test_reference_set(re, 2, extra_patterns, NULL, compile_flags, consumed_memory, cache_directory)) {
+        count_cache_entries(cache_directory, 1);
+        rmdir(cache_directory);
+        return;
+    }
+
+    printf("Consumed memory: %d bytes, loaded from cache: %d bytes, cache entries: %d\n",
+        (int)consumed_memory[0], (int)consumed_memory[1], count_cache_entries(cache_directory, 0));
+    if (consumed_memory[0] != consumed_memory[1])
+        test_failed = 1;
+
+    test_compare_results(re, 2, subjects);
+    mpm_free(re[1]);
+
+    /* An entry of other patterns is not loaded, even if it has the same name. */
+    find_cache_entry(cache_directory, NULL, entry_names[0]);
+    re[1] = test_mpm_create();
+    error_code = MPM_NO_MEMORY;
+    if (re[1]) {
+        test_mpm_add(re[1], "a+b.*[0-9]{3,8}[x-z]+c?d", 0);
+        error_code = mpm_compile_cached(re + 1, NULL, 0, cache_directory);
+        mpm_free(re[1]);
+    }
+    if (error_code != MPM_NO_ERROR || !find_cache_entry(cache_directory, entry_names[0], entry_names[1])
+            || rename(entry_names[1], entry_names[0]) != 0
+            || !test_reference_set(re + 1, 1, extra_patterns, NULL, compile_flags, consumed_memory + 1, cache_directory)) {
+        printf("WARNING: cannot replace the cache entry\n");
+        test_failed = 1;
+        mpm_free(re[0]);
+        count_cache_entries(cache_directory, 1);
+        rmdir(cache_directory);
+        return;
+    }
+
+    printf("Replaced entry: consumed memory: %d bytes, cache entries: %d\n",
+        (int)consumed_memory[1], count_cache_entries(cache_directory, 0));
+    if (consumed_memory[0] != consumed_memory[1])
+        test_failed = 1;
+
+    test_compare_results(re, 2, subjects);
+    mpm_free(re[0]);
+    mpm_free(re[1]);
+
+    for (i = 0; i < 40; i++) {
+        sprintf(patterns[i], "k%dm%c+n%d", i % 5, 'a' + (i % 11), i);
+        rules[i].pattern = (mpm_char8 *)patterns[i];
+        rules[i].flags = MPM_RULE_NEW;
+    }
+
+    mpm_compile_rules_args_init(&args);
+    args.cache_directory = cache_directory;
+
+    for (i = 0; i < 2; i++) {
+        error_code = mpm_compile_rules(rules, 40, rule_list + i, rule_consumed_memory + i, &args, 0);
+        if (error_code != MPM_NO_ERROR) {
+            printf("WARNING: mpm_compile_rules is failed: %s\n", mpm_error_to_string(error_code));
+            test_failed = 1;
+            if (i == 1)
+                mpm_rule_list_free(rule_list[0]);
+            count_cache_entries(cache_directory, 1);
+            rmdir(cache_directory);
+            return;
+        }
+        printf("Rule list %d: consumed memory: %d bytes, cache entries: %d\n", i + 1,
+            (int)rule_consumed_memory[i], count_cache_entries(cache_directory, 0));
+    }
+    if (rule_consumed_memory[0] != rule_consumed_memory[1])
+        test_failed = 1;
+
+    for (i = 0; i < 8; i++) {
+        k = (i * 11 + 5) % 40;
+        sprintf(subject, "-k%dm%c%cn%d-", k % 5, 'a' + (k % 11), 'a' + (k % 11), k);
+        for (j = 0; j < 2; j++)
+            mpm_exec_list(rule_list[j], (mpm_char8 *)subject, strlen(subject), 0, rule_result[j]);
+        printf("String: '%s' rule result: 0x%x 0x%x\n", subject, rule_result[0][0], rule_result[0][1]);
+        if (rule_result[0][0] != rule_result[1][0] || rule_result[0][1] != rule_result[1][1]) {
+            printf("WARNING: results are different: 0x%x 0x%x\n", rule_result[1][0], rule_result[1][1]);
+            test_failed = 1;
+        }
+    }
+
+    mpm_rule_list_free(rule_list[0]);
+    mpm_rule_list_free(rule_list[1]);
+    count_cache_entries(cache_directory, 1);
+    rmdir(cache_directory);
+}
+
+static void test27()
+{
+    mpm_rule_pattern rules[44];
+    char patterns[44][32];
+    mpm_rule_list *rule_list[4];
+    mpm_uint32 rule_result[4][2];
+    mpm_uint32 expected[10][2];
+    mpm_uint32 last_five;
+    mpm_compile_rules_args args;
+    /* All rules of the k4m pattern are removed. */
+    mpm_uint32 removed[36] = { 3, 17, 17, 4, 9, 14, 19, 24, 29, 34, 39 };
+    char removed_rules[40];
+    char subjects[10][32];
+    int i, j, k, bit, error_code;
+
+    printf("Test27: Rule list update.\n\n");
+
+    for (i = 0; i < 40; i++) {
+        sprintf(patterns[i], "k%dm%c+n%d", i % 5, 'a' + (i % 11), i);
+        rules[i].pattern = (mpm_char8 *)patterns[i];
+        rules[i].flags = MPM_RULE_NEW;
+    }
+    for (i = 40; i < 44; i++) {
+        sprintf(patterns[i], "u%dv+w[0-9]", i);
+        rules[i].pattern = (mpm_char8 *)patterns[i];
+        rules[i].flags = MPM_RULE_NEW;
+    }
+
+    for (i = 0; i < 10; i++) {
+        k = (i * 9 + 4) % 44;
+        if (k < 40)
+            sprintf(subjects[i], "-k%dm%c%cn%d-", k % 5, 'a' + (k % 11), 'a' + (k % 11), k);
+        else
+            sprintf(subjects[i], "-u%dvvw7-", k);
+    }
+
+    memset(removed_rules, 0, sizeof(removed_rules));
+    for (i = 0; i < 11; i++)
+        removed_rules[removed[i]] = 1;
+
+    mpm_compile_rules_args_init(&args);
+
+    /* The first list contains the original rules, the second the added ones. */
+    error_code = mpm_compile_rules(rules, 40, rule_list, NULL, &args, MPM_COMPILE_RULES_UPDATABLE);
+    if (error_code == MPM_NO_ERROR) {
+        error_code = mpm_compile_rules(rules + 40, 4, rule_list + 1, NULL, &args, 0);
+        if (error_code != MPM_NO_ERROR)
+            mpm_rule_list_free(rule_list[0]);
+    }
+    if (error_code != MPM_NO_ERROR) {
+        printf("WARNING: mpm_compile_rules is failed: %s\n", mpm_error_to_string(error_code));
+        test_failed = 1;
+        return;
+    }
+
+    /* Expected result: the remaining rules followed by the added rules. */
+    for (i = 0; i < 10; i++) {
+        mpm_exec_list(rule_list[0], (mpm_char8 *)subjects[i], strlen(subjects[i]), 0, rule_result[0]);
+        mpm_exec_list(rule_list[1], (mpm_char8 *)subjects[i], strlen(subjects[i]), 0, rule_result[1]);
+        expected[i][0] = 0;
+        expected[i][1] = 0;
+        bit = 0;
+        for (j = 0; j < 44; j++) {
+            if (j < 40 && removed_rules[j])
+                continue;
+            if (j < 40 ? (rule_result[0][j >> 5] & (1 << (j & 0x1f))) : (rule_result[1][0] & (1 << (j - 40))))
+                expected[i][bit >> 5] |= 1 << (bit & 0x1f);
+            bit++;
+        }
+    }
+
+    /* The second list does not keep its patterns. */
+    error_code = mpm_rule_list_update(rule_list[1], rule_list + 2, NULL, 0, removed, 1, &args, 0);
+    if (error_code != MPM_INVALID_ARGS) {
+        printf("WARNING: updating a list compiled without MPM_COMPILE_RULES_UPDATABLE is not rejected\n");
+        test_failed = 1;
+        if (error_code == MPM_NO_ERROR)
+            mpm_rule_list_free(rule_list[2]);
+    }
+    mpm_rule_list_free(rule_list[1]);
+
+    /* The state machine of the k4m pattern is rebuilt together with the added patterns. */
+    error_code = mpm_rule_list_update(rule_list[0], rule_list + 2, rules + 40, 4, removed, 11, &args, MPM_COMPILE_RULES_VERBOSE_STATS);
+    /* The shared state machines are kept when the old list is freed. */
+    mpm_rule_list_free(rule_list[0]);
+    if (error_code != MPM_NO_ERROR) {
+        printf("WARNING: mpm_rule_list_update is failed: %s\n", mpm_error_to_string(error_code));
+        test_failed = 1;
+        return;
+    }
+
+    /* Only the last five rules remain: the state machines, which have patterns of
+       removed rules, are rebuilt from the remaining patterns (see the statistics). */
+    for (i = 0; i < bit - 5; i++)
+        removed[i] = i;
+    error_code = mpm_rule_list_update(rule_list[2], rule_list + 3, NULL, 0, removed, bit - 5, &args, MPM_COMPILE_RULES_VERBOSE_STATS);
+    if (error_code != MPM_NO_ERROR) {
+        printf("WARNING: mpm_rule_list_update is failed: %s\n", mpm_error_to_string(error_code));
+        test_failed = 1;
+        mpm_rule_list_free(rule_list[2]);
+        return;
+    }
+
+    printf("\n");
+    for (i = 0; i < 10; i++) {
+        for (j = 2; j < 4; j++)
+            mpm_exec_list(rule_list[j], (mpm_char8 *)subjects[i], strlen(subjects[i]), 0, rule_result[j]);
+
+        last_five = 0;
+        for (j = 0; j < 5; j++)
+            if (expected[i][(bit - 5 + j) >> 5] & (1 << ((bit - 5 + j) & 0x1f)))
+                last_five |= 1 << j;
+
+        printf("String: '%s' rule result: 0x%x 0x%x, last five rules: 0x%x\n", subjects[i],
+            rule_result[2][0], rule_result[2][1], rule_result[3][0]);
+        if (rule_result[2][0] != expected[i][0] || rule_result[2][1] != expected[i][1]
+                || rule_result[3][0] != last_five) {
+            printf("WARNING: results are different: 0x%x 0x%x\n", expected[i][0], expected[i][1]);
+            test_failed = 1;
+        }
+    }
+
+    mpm_rule_list_free(rule_list[2]);
+    mpm_rule_list_free(rule_list[3]);
+}
+
+#define MAX_TESTS 27
 
 static test_case tests[MAX_TESTS] = {
     test1, test2, test3, test4, test5,
-    test6, test7, test8
+    test6, test7, test8, test9, test10,
+    test11, test12, test13, test14, test15,
+    test16, test17, test18, test19, test20,
+    test21, test22, test23, test24, test25,
+    test26, test27
 };
 
 /* ----------------------------------------------------------------------- */
@@ -776,14 +2392,7 @@ static void new_feature(void)
     mpm_rule_list *rule_list;
     mpm_uint32 result[2] = { 0, 0 };
     int error_code;
-    mpm_compile_rules_args args = {
-        2,     /* no_selected_patterns */
-        0,     /* minimum_no_new_cover */
-        -1.0,  /* rule_strength_scale */
-        -1.0,  /* inner_distance_scale */
-        -1.0,  /* outer_distance_scale */
-        -1.0   /* length_scale */
-    };
+    mpm_compile_rules_args args;
 
     mpm_rule_pattern rules[] = {
         { (mpm_char8 *)"ab{4,17}c*d+xyz|h", MPM_RULE_NEW },
@@ -798,6 +2407,9 @@ static void new_feature(void)
     };
     char *subject = "bbbbdxyz h";
 
+    mpm_compile_rules_args_init(&args);
+    args.no_selected_patterns = 2;
+
     error_code = mpm_compile_rules(rules, sizeof(rules) / sizeof(mpm_rule_pattern), &rule_list,
         NULL, &args, MPM_COMPILE_RULES_VERBOSE | MPM_COMPILE_RULES_VERBOSE_STATS);
     printf("mpm_compile_rules: %s\n", mpm_error_to_string(error_code));
@@ -814,14 +2426,15 @@ static void new_feature(void)
 
     mpm_rule_list *rule_list;
     mpm_size consumed_memory;
-    mpm_compile_rules_args args = {
-        20,   /* no_selected_patterns */
-        4,    /* minimum_no_new_cover */
-        0.2,  /* rule_strength_scale */
-        0.15, /* inner_distance_scale */
-        0.3,  /* outer_distance_scale */
-        0.2   /* length_scale */
-    };
+    mpm_compile_rules_args args;
+
+    mpm_compile_rules_args_init(&args);
+    args.no_selected_patterns = 20;
+    args.minimum_no_new_cover = 4;
+    args.rule_strength_scale = 0.2;
+    args.inner_distance_scale = 0.15;
+    args.outer_distance_scale = 0.3;
+    args.length_scale = 0.2;
 
     printf("Processing %d rules:\n", (int)(sizeof(rules_global) / sizeof(mpm_rule_pattern)));
 
@@ -21,5 +21,24 @@ runTest 5
 runTest 6
 runTest 7
 runTest 8
+runTest 9
+runTest 10
+runTest 11
+runTest 12
+runTest 13
+runTest 14
+runTest 15
+runTest 16
+runTest 17
+runTest 18
+runTest 19
+runTest 20
+runTest 21
+runTest 22
+runTest 23
+runTest 24
+runTest 25
+runTest 26
+runTest 27
 
 rm test_result